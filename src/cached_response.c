@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "cached_response.h"
+#include "metrics.h"
+
+// Clients may keep a copy but must revalidate it, which costs a 304
+#define CACHE_HEADERS \
+    "Cache-Control: no-cache\r\n" \
+    "Vary: Accept-Encoding\r\n"
+
+static uint64_t hash_body(const char *body, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)body[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static char* render_message(const char *head, size_t head_len, const char *body, size_t len, size_t *out_len) {
+    char *message = (char*)malloc(head_len + len);
+    if (!message) return NULL;
+    memcpy(message, head, head_len);
+    memcpy(message + head_len, body, len);
+    *out_len = head_len + len;
+    return message;
+}
+
+// tag is the validator without its quotes; encodings other than identity
+// append their name so each variant has its own
+static int build_variant(CachedVariant *variant, const char *content_type, const char *encoding,
+                         const char *body, size_t len, const char *tag) {
+    char head[512];
+    int head_len;
+    
+    snprintf(variant->etag, sizeof(variant->etag), "\"%s%s%s\"", tag, *encoding ? "-" : "", encoding);
+    
+    head_len = snprintf(head, sizeof(head),
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: %s\r\n"
+                        "%s%s%s"
+                        HTTP_CORS_HEADERS
+                        CACHE_HEADERS
+                        "ETag: %s\r\n"
+                        "Content-Length: %lu\r\n\r\n",
+                        content_type,
+                        *encoding ? "Content-Encoding: " : "", encoding, *encoding ? "\r\n" : "",
+                        variant->etag, (unsigned long)len);
+    variant->message = render_message(head, (size_t)head_len, body, len, &variant->message_len);
+    variant->head_len = (size_t)head_len;
+    
+    head_len = snprintf(head, sizeof(head),
+                        "HTTP/1.1 304 Not Modified\r\n"
+                        HTTP_CORS_HEADERS
+                        CACHE_HEADERS
+                        "ETag: %s\r\n\r\n",
+                        variant->etag);
+    variant->not_modified = render_message(head, (size_t)head_len, "", 0, &variant->not_modified_len);
+    
+    return variant->message && variant->not_modified;
+}
+
+static void free_variant(CachedVariant *variant) {
+    free(variant->message);
+    free(variant->not_modified);
+    memset(variant, 0, sizeof(*variant));
+}
+
+static int build_response(CachedResponse *response, const char *content_type, const char *body, size_t len,
+                          const char *tag, int gzip_level) {
+    memset(response, 0, sizeof(*response));
+    if (!build_variant(&response->identity, content_type, "", body, len, tag)) {
+        cached_response_free(response);
+        return 0;
+    }
+    
+    if (gzip_level <= 0) return 1;
+    
+    // The gzip variant is an optimization; carry on without it on failure
+    size_t gzip_len;
+    char *gzipped = http_gzip_level(body, len, gzip_level, &gzip_len);
+    if (gzipped) {
+        if (!build_variant(&response->gzip, content_type, "gzip", gzipped, gzip_len, tag)) {
+            free_variant(&response->gzip);
+        }
+        free(gzipped);
+    }
+    return 1;
+}
+
+int cached_response_build(CachedResponse *response, const char *content_type, const char *body, size_t len) {
+    char tag[17];
+    snprintf(tag, sizeof(tag), "%016llx", (unsigned long long)hash_body(body, len));
+    return build_response(response, content_type, body, len, tag, 9);
+}
+
+int cached_response_build_tagged(CachedResponse *response, const char *content_type, const char *body, size_t len,
+                                 const char *etag, int gzip_level) {
+    // Strip the quotes; build_variant puts them back around each variant's tag
+    char tag[CACHED_ETAG_SIZE];
+    size_t tag_len = strlen(etag);
+    if (tag_len < 2 || tag_len + sizeof("-gzip") > sizeof(tag) || etag[0] != '"' || etag[tag_len - 1] != '"') {
+        memset(response, 0, sizeof(*response));
+        return 0;
+    }
+    memcpy(tag, etag + 1, tag_len - 2);
+    tag[tag_len - 2] = '\0';
+    return build_response(response, content_type, body, len, tag, gzip_level);
+}
+
+void cached_response_free(CachedResponse *response) {
+    free_variant(&response->identity);
+    free_variant(&response->gzip);
+}
+
+// If-None-Match is a comma-separated list of entity tags, or "*"
+int http_etag_matches(struct mg_http_message *hm, const char *etag) {
+    struct mg_str *header = mg_http_get_header(hm, "If-None-Match");
+    if (!header) return 0;
+    
+    struct mg_str list = *header;
+    struct mg_str item;
+    while (mg_span(list, &item, &list, ',')) {
+        while (item.len > 0 && item.buf[0] == ' ') {
+            item.buf++;
+            item.len--;
+        }
+        while (item.len > 0 && item.buf[item.len - 1] == ' ') item.len--;
+        if (mg_strcmp(item, mg_str(etag)) == 0 || mg_strcmp(item, mg_str("*")) == 0) return 1;
+    }
+    return 0;
+}
+
+const CachedVariant* cached_response_variant(struct mg_http_message *hm, const CachedResponse *response) {
+    if (response->gzip.message && http_accepts_gzip(hm)) return &response->gzip;
+    return response->identity.message ? &response->identity : NULL;
+}
+
+void cached_response_send(struct mg_connection *c, struct mg_http_message *hm, const CachedResponse *response) {
+    const CachedVariant *variant = cached_response_variant(hm, response);
+    if (!variant) {
+        mg_http_reply(c, 500, "", "Out of memory");
+        return;
+    }
+    
+    if (http_etag_matches(hm, variant->etag)) {
+        mg_send(c, variant->not_modified, variant->not_modified_len);
+    } else {
+        mg_send(c, variant->message, variant->message_len);
+    }
+}
+
+int http_accepts_gzip(struct mg_http_message *hm) {
+    struct mg_str *header = mg_http_get_header(hm, "Accept-Encoding");
+    if (!header) return 0;
+    
+    struct mg_str list = *header;
+    struct mg_str item;
+    while (mg_span(list, &item, &list, ',')) {
+        struct mg_str coding;
+        struct mg_str params;
+        mg_span(item, &coding, &params, ';');
+        while (coding.len > 0 && coding.buf[0] == ' ') {
+            coding.buf++;
+            coding.len--;
+        }
+        while (coding.len > 0 && coding.buf[coding.len - 1] == ' ') coding.len--;
+        if (mg_strcasecmp(coding, mg_str("gzip")) != 0) continue;
+        
+        // "gzip;q=0" explicitly refuses it; anything else accepts it
+        while (params.len > 0 && params.buf[0] == ' ') {
+            params.buf++;
+            params.len--;
+        }
+        if (params.len >= 2 && (params.buf[0] == 'q' || params.buf[0] == 'Q') && params.buf[1] == '=') {
+            for (size_t i = 2; i < params.len; i++) {
+                if (params.buf[i] >= '1' && params.buf[i] <= '9') return 1;
+            }
+            return 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+char* http_gzip(const char *data, size_t len, size_t *out_len) {
+    return http_gzip_level(data, len, 9, out_len);
+}
+
+#ifdef HAVE_ZLIB
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+#endif
+
+char* http_gzip_level(const char *data, size_t len, int level, size_t *out_len) {
+#ifdef HAVE_ZLIB
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // windowBits 15 + 16 asks zlib for a gzip wrapper instead of zlib's own
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    
+    size_t bound = deflateBound(&stream, (uLong)len);
+    char *out = (char*)malloc(bound);
+    if (!out) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)len;
+    stream.next_out = (Bytef*)out;
+    stream.avail_out = (uInt)bound;
+    int status = deflate(&stream, Z_FINISH);
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+    
+    // A body that did not shrink goes out as it was
+    int shrank = status == Z_STREAM_END && *out_len < len;
+    metrics_record_compression(len, shrank ? *out_len : len, elapsed_seconds(&start));
+    if (!shrank) {
+        free(out);
+        return NULL;
+    }
+    return out;
+#else
+    (void)data;
+    (void)len;
+    (void)level;
+    (void)out_len;
+    return NULL;
+#endif
+}
+
+struct HttpGzipStream {
+#ifdef HAVE_ZLIB
+    z_stream zs;
+#endif
+    int finished;
+};
+
+HttpGzipStream* http_gzip_stream_new(int level) {
+#ifdef HAVE_ZLIB
+    HttpGzipStream *stream = (HttpGzipStream*)calloc(1, sizeof(HttpGzipStream));
+    if (!stream) return NULL;
+    if (deflateInit2(&stream->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+#else
+    (void)level;
+    return NULL;
+#endif
+}
+
+int http_gzip_stream_write(HttpGzipStream *stream, const char *data, size_t len, int finish, struct mg_iobuf *io) {
+#ifdef HAVE_ZLIB
+    if (stream->finished) return len == 0;
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    size_t out_start = io->len;
+    stream->zs.next_in = (Bytef*)data;
+    stream->zs.avail_in = (uInt)len;
+    
+    // Without finish, deflate keeps what it cannot emit yet, so this stops
+    // as soon as it no longer fills the space it was given
+    int status;
+    do {
+        if (io->size - io->len < 4096 && !mg_iobuf_resize(io, io->size * 2 + 16 * 1024)) return 0;
+        stream->zs.next_out = io->buf + io->len;
+        stream->zs.avail_out = (uInt)(io->size - io->len);
+        status = deflate(&stream->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+        io->len = io->size - stream->zs.avail_out;
+        if (status == Z_STREAM_ERROR) return 0;
+    } while (finish ? status != Z_STREAM_END : stream->zs.avail_out == 0);
+    
+    stream->finished = finish;
+    metrics_record_compression(len, io->len - out_start, elapsed_seconds(&start));
+    return 1;
+#else
+    (void)stream;
+    (void)data;
+    (void)len;
+    (void)finish;
+    (void)io;
+    return 0;
+#endif
+}
+
+void http_gzip_stream_free(HttpGzipStream *stream) {
+    if (!stream) return;
+#ifdef HAVE_ZLIB
+    deflateEnd(&stream->zs);
+#endif
+    free(stream);
+}
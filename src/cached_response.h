@@ -0,0 +1,84 @@
+#ifndef CACHED_RESPONSE_H
+#define CACHED_RESPONSE_H
+
+#include <stddef.h>
+#include "mongoose.h"
+
+#define CACHED_ETAG_SIZE 64
+
+// The CORS lines every response carries
+#define HTTP_CORS_HEADERS \
+    "Access-Control-Allow-Origin: *\r\n" \
+    "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n" \
+    "Access-Control-Allow-Headers: Content-Type, Authorization, X-Requested-With, Accept, Origin\r\n"
+
+// One encoding of a cached body: the complete 200 message (status line,
+// headers and body) and the matching 304, each ready for a single mg_send
+typedef struct CachedVariant {
+    char *message;              // NULL if this variant is unavailable
+    size_t message_len;
+    size_t head_len;            // the body starts this far into message
+    char *not_modified;
+    size_t not_modified_len;
+    char etag[CACHED_ETAG_SIZE]; // quoted strong validator, unique per encoding
+} CachedVariant;
+
+// A response rendered once and never changed afterwards. The gzip variant
+// exists only when built with zlib and only if compression actually
+// shrinks the body.
+typedef struct CachedResponse {
+    CachedVariant identity;
+    CachedVariant gzip;
+} CachedResponse;
+
+// Render body (len bytes) with the given Content-Type. Returns 1 on
+// success, 0 if out of memory (the response is left empty).
+int cached_response_build(CachedResponse *response, const char *content_type, const char *body, size_t len);
+
+// Like cached_response_build, but the identity variant is tagged with the
+// given quoted etag instead of a hash of the body, and the gzip variant
+// with the same tag plus "-gzip". gzip_level is zlib's 1 (fastest) to 9
+// (smallest), or 0 for no gzip variant. Also returns 0 for a tag that is
+// not quoted or is too long.
+int cached_response_build_tagged(CachedResponse *response, const char *content_type, const char *body, size_t len,
+                                 const char *etag, int gzip_level);
+
+// Release the rendered messages
+void cached_response_free(CachedResponse *response);
+
+// Send the variant matching the request's Accept-Encoding, or its 304 when
+// If-None-Match already names it
+void cached_response_send(struct mg_connection *c, struct mg_http_message *hm, const CachedResponse *response);
+
+// The variant cached_response_send would pick for this request, or NULL if
+// the response is empty
+const CachedVariant* cached_response_variant(struct mg_http_message *hm, const CachedResponse *response);
+
+// Whether If-None-Match names etag (or is "*"), so a 304 will do
+int http_etag_matches(struct mg_http_message *hm, const char *etag);
+
+// Whether the request lists gzip in Accept-Encoding with a non-zero q value
+int http_accepts_gzip(struct mg_http_message *hm);
+
+// Gzip len bytes into a new malloc'd buffer. Returns NULL without zlib,
+// when out of memory, or when compression would not save any space.
+char* http_gzip(const char *data, size_t len, size_t *out_len);
+
+// http_gzip at zlib level 1 (fastest) to 9 (smallest); http_gzip uses 9.
+// Both count the work in the compression metrics.
+char* http_gzip_level(const char *data, size_t len, int level, size_t *out_len);
+
+// Incremental gzip for a body written in pieces, such as a chunked stream.
+// Returns NULL without zlib or when out of memory.
+typedef struct HttpGzipStream HttpGzipStream;
+HttpGzipStream* http_gzip_stream_new(int level);
+
+// Compress len more bytes and append whatever output is ready to io, which
+// may be nothing until enough input has built up. finish flushes the rest
+// and the gzip trailer; nothing can be written after it. Returns 0 if io
+// cannot grow.
+int http_gzip_stream_write(HttpGzipStream *stream, const char *data, size_t len, int finish, struct mg_iobuf *io);
+
+void http_gzip_stream_free(HttpGzipStream *stream);
+
+#endif // CACHED_RESPONSE_H
@@ -0,0 +1,195 @@
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "json_reader.h"
+
+typedef struct JsonCursor {
+    const char *p;
+    const char *end;
+} JsonCursor;
+
+static void skip_space(JsonCursor *cur) {
+    while (cur->p < cur->end && (*cur->p == ' ' || *cur->p == '\t' || *cur->p == '\n' || *cur->p == '\r')) {
+        cur->p++;
+    }
+}
+
+static int consume(JsonCursor *cur, char ch) {
+    if (cur->p >= cur->end || *cur->p != ch) return 0;
+    cur->p++;
+    return 1;
+}
+
+static int is_digit(const JsonCursor *cur, const char *p) {
+    return p < cur->end && *p >= '0' && *p <= '9';
+}
+
+// Strict JSON numbers only; cJSON's looser forms fall back to it
+static int skip_number(JsonCursor *cur) {
+    const char *p = cur->p;
+    if (p < cur->end && *p == '-') p++;
+    if (!is_digit(cur, p)) return 0;
+    if (*p == '0') {
+        p++;
+    } else {
+        while (is_digit(cur, p)) p++;
+    }
+    if (p < cur->end && *p == '.') {
+        if (!is_digit(cur, ++p)) return 0;
+        while (is_digit(cur, p)) p++;
+    }
+    if (p < cur->end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < cur->end && (*p == '+' || *p == '-')) p++;
+        if (!is_digit(cur, p)) return 0;
+        while (is_digit(cur, p)) p++;
+    }
+    cur->p = p;
+    return 1;
+}
+
+static int skip_literal(JsonCursor *cur, const char *literal) {
+    size_t len = strlen(literal);
+    if ((size_t)(cur->end - cur->p) < len || memcmp(cur->p, literal, len) != 0) return 0;
+    cur->p += len;
+    return 1;
+}
+
+// Decodes the string at the cursor into out, NUL-terminated, or just
+// skips it when out is NULL. Gives up on \u escapes, raw control
+// characters and strings longer than room allows.
+static int read_string(JsonCursor *cur, char *out, size_t room, size_t *out_len) {
+    if (!consume(cur, '"')) return 0;
+    size_t len = 0;
+    while (cur->p < cur->end) {
+        char ch = *cur->p++;
+        if (ch == '"') {
+            if (out) out[len] = '\0';
+            *out_len = len;
+            return 1;
+        }
+        if ((unsigned char)ch < 0x20) return 0;
+        if (ch == '\\') {
+            if (cur->p >= cur->end) return 0;
+            switch (*cur->p++) {
+                case '"':  ch = '"'; break;
+                case '\\': ch = '\\'; break;
+                case '/':  ch = '/'; break;
+                case 'b':  ch = '\b'; break;
+                case 'f':  ch = '\f'; break;
+                case 'n':  ch = '\n'; break;
+                case 'r':  ch = '\r'; break;
+                case 't':  ch = '\t'; break;
+                default: return 0;
+            }
+        }
+        if (out) {
+            if (len + 1 >= room) return 0;
+            out[len] = ch;
+        }
+        len++;
+    }
+    return 0;
+}
+
+// Keys are compared in place, so only escape-free ones are handled
+static int read_key(JsonCursor *cur, const char **key, size_t *key_len) {
+    if (!consume(cur, '"')) return 0;
+    const char *start = cur->p;
+    while (cur->p < cur->end && *cur->p != '"') {
+        if (*cur->p == '\\' || (unsigned char)*cur->p < 0x20) return 0;
+        cur->p++;
+    }
+    if (cur->p >= cur->end) return 0;
+    *key = start;
+    *key_len = (size_t)(cur->p - start);
+    cur->p++;
+    return 1;
+}
+
+// cJSON_GetObjectItem ignores case, so this does too
+static int key_is(const char *key, size_t key_len, const char *name) {
+    size_t i = 0;
+    for (; i < key_len && name[i]; i++) {
+        if (tolower((unsigned char)key[i]) != name[i]) return 0;
+    }
+    return i == key_len && name[i] == '\0';
+}
+
+int json_read_user_input(const char *json, size_t len, UserInput *input) {
+    JsonCursor cur = { json, json + len };
+    size_t used = 0;
+    int seen_name = 0;
+    int seen_email = 0;
+    int seen_op = 0;
+    int seen_id = 0;
+    input->name = NULL;
+    input->email = NULL;
+    input->op = NULL;
+    input->id = 0;
+    input->has_id = 0;
+    input->mistyped = 0;
+    
+    skip_space(&cur);
+    if (!consume(&cur, '{')) return 0;
+    skip_space(&cur);
+    if (consume(&cur, '}')) return 1;
+    for (;;) {
+        const char *key;
+        size_t key_len;
+        if (!read_key(&cur, &key, &key_len)) return 0;
+        skip_space(&cur);
+        if (!consume(&cur, ':')) return 0;
+        skip_space(&cur);
+        
+        // Only the first member with a matching key counts, string or not
+        const char **field = NULL;
+        if (!seen_name && key_is(key, key_len, "name")) {
+            seen_name = 1;
+            field = &input->name;
+        } else if (!seen_email && key_is(key, key_len, "email")) {
+            seen_email = 1;
+            field = &input->email;
+        } else if (!seen_op && key_is(key, key_len, "op")) {
+            seen_op = 1;
+            field = &input->op;
+        }
+        int is_id = !seen_id && key_is(key, key_len, "id");
+        seen_id |= is_id;
+        
+        if (cur.p >= cur.end) return 0;
+        if ((field && *cur.p != '"') || (is_id && *cur.p != '-' && (*cur.p < '0' || *cur.p > '9'))) {
+            input->mistyped = 1;
+        }
+        if (*cur.p == '"') {
+            char *out = field ? input->storage + used : NULL;
+            size_t out_len;
+            if (!read_string(&cur, out, sizeof(input->storage) - used, &out_len)) return 0;
+            if (field) {
+                *field = out;
+                used += out_len + 1;
+            }
+        } else if (*cur.p == '-' || (*cur.p >= '0' && *cur.p <= '9')) {
+            const char *start = cur.p;
+            if (!skip_number(&cur)) return 0;
+            if (is_id) {
+                // strtod wants a terminated copy; longer ids are left to cJSON
+                char text[32];
+                size_t text_len = (size_t)(cur.p - start);
+                if (text_len >= sizeof(text)) return 0;
+                memcpy(text, start, text_len);
+                text[text_len] = '\0';
+                input->id = strtod(text, NULL);
+                input->has_id = 1;
+            }
+        } else if (!skip_literal(&cur, "true") && !skip_literal(&cur, "false") && !skip_literal(&cur, "null")) {
+            // Nested objects and arrays included
+            return 0;
+        }
+        
+        skip_space(&cur);
+        if (consume(&cur, '}')) return 1;
+        if (!consume(&cur, ',')) return 0;
+        skip_space(&cur);
+    }
+}
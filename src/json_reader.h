@@ -0,0 +1,31 @@
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <stddef.h>
+
+// Pull parser for UserInput request bodies and bulk items. It walks the
+// body once, copies the strings it keeps into fixed storage and allocates
+// nothing.
+// Bodies outside the simple case are left to cJSON by the caller.
+
+#define JSON_READER_STORAGE 512
+
+typedef struct UserInput {
+    const char *name;           // NULL when absent or not a string
+    const char *email;
+    const char *op;             // the bulk operation
+    double id;                  // valid only when has_id is set
+    int has_id;                 // 0 when absent or not a number
+    int mistyped;               // one of the fields above had another type
+    char storage[JSON_READER_STORAGE];
+} UserInput;
+
+// Read `len` bytes of JSON, which need not be NUL-terminated. Returns 1
+// with the fields filled in, as cJSON_GetObjectItem would find them (first
+// match, keys compared without case). Returns 0 if the body is not a flat
+// object of strings, numbers and literals with short strings without
+// \u escapes, or is not valid JSON; the caller then parses it with cJSON,
+// which decides what it is.
+int json_read_user_input(const char *json, size_t len, UserInput *input);
+
+#endif // JSON_READER_H
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+#include "json_writer.h"
+
+int json_write_raw(struct mg_iobuf *io, const char *data, size_t len) {
+    if (io->len + len > io->size) {
+        size_t size = io->size ? io->size : 256;
+        while (size < io->len + len) size *= 2;
+        if (!mg_iobuf_resize(io, size)) return 0;
+    }
+    memcpy(io->buf + io->len, data, len);
+    io->len += len;
+    return 1;
+}
+
+static int json_write_tabs(struct mg_iobuf *io, int count) {
+    static const char tabs[] = "\t\t\t\t\t\t\t\t";
+    return json_write_raw(io, tabs, (size_t)count);
+}
+
+int json_write_string(struct mg_iobuf *io, const char *value) {
+    int ok = json_write_raw(io, "\"", 1);
+    const char *run = value;
+    const char *p = value;
+    
+    // Copy runs of plain characters in one go; only escapes are written piecewise
+    for (; *p; p++) {
+        unsigned char ch = (unsigned char)*p;
+        if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+        
+        ok &= json_write_raw(io, run, (size_t)(p - run));
+        char escape[8];
+        switch (ch) {
+            case '"':  ok &= json_write_raw(io, "\\\"", 2); break;
+            case '\\': ok &= json_write_raw(io, "\\\\", 2); break;
+            case '\b': ok &= json_write_raw(io, "\\b", 2); break;
+            case '\f': ok &= json_write_raw(io, "\\f", 2); break;
+            case '\n': ok &= json_write_raw(io, "\\n", 2); break;
+            case '\r': ok &= json_write_raw(io, "\\r", 2); break;
+            case '\t': ok &= json_write_raw(io, "\\t", 2); break;
+            default:
+                snprintf(escape, sizeof(escape), "\\u%04x", ch);
+                ok &= json_write_raw(io, escape, 6);
+                break;
+        }
+        run = p + 1;
+    }
+    ok &= json_write_raw(io, run, (size_t)(p - run));
+    ok &= json_write_raw(io, "\"", 1);
+    return ok;
+}
+
+static int json_write_id(struct mg_iobuf *io, int id) {
+    char digits[16];
+    int len = snprintf(digits, sizeof(digits), "%d", id);
+    return json_write_raw(io, digits, (size_t)len);
+}
+
+static int json_write_compact_user(struct mg_iobuf *io, const User *user) {
+    int ok = json_write_raw(io, "{\"id\":", 6);
+    ok &= json_write_id(io, user->id);
+    ok &= json_write_raw(io, ",\"name\":", 8);
+    ok &= json_write_string(io, user->name);
+    ok &= json_write_raw(io, ",\"email\":", 9);
+    ok &= json_write_string(io, user->email);
+    ok &= json_write_raw(io, "}", 1);
+    return ok;
+}
+
+// Renders the record's compact JSON and attaches it, so every later read
+// of the record is a single copy. Returns NULL if out of memory.
+static const UserFragment* build_user_fragment(const User *user) {
+    struct mg_iobuf io = { NULL, 0, 0, 0 };
+    int ok = json_write_compact_user(&io, user);
+    UserFragment *fragment = ok ? user_fragment_alloc(io.len) : NULL;
+    if (fragment) memcpy(fragment->json, io.buf, io.len);
+    mg_iobuf_free(&io);
+    return fragment ? user_attach_fragment(user, fragment) : NULL;
+}
+
+int json_write_user(struct mg_iobuf *io, const User *user, int pretty, int depth) {
+    int ok = 1;
+    
+    if (pretty) {
+        ok &= json_write_raw(io, "{\n", 2);
+        ok &= json_write_tabs(io, depth + 1);
+        ok &= json_write_raw(io, "\"id\":\t", 6);
+        ok &= json_write_id(io, user->id);
+        ok &= json_write_raw(io, ",\n", 2);
+        ok &= json_write_tabs(io, depth + 1);
+        ok &= json_write_raw(io, "\"name\":\t", 8);
+        ok &= json_write_string(io, user->name);
+        ok &= json_write_raw(io, ",\n", 2);
+        ok &= json_write_tabs(io, depth + 1);
+        ok &= json_write_raw(io, "\"email\":\t", 9);
+        ok &= json_write_string(io, user->email);
+        ok &= json_write_raw(io, "\n", 1);
+        ok &= json_write_tabs(io, depth);
+        ok &= json_write_raw(io, "}", 1);
+    } else {
+        const UserFragment *fragment = user_fragment(user);
+        if (!fragment) fragment = build_user_fragment(user);
+        ok = fragment ? json_write_raw(io, fragment->json, fragment->len) : json_write_compact_user(io, user);
+    }
+    return ok;
+}
+
+typedef struct ListWriter {
+    struct mg_iobuf *io;
+    int pretty;
+    int first;
+    int ok;
+} ListWriter;
+
+static void write_list_item(const User *user, void *ctx) {
+    ListWriter *writer = (ListWriter*)ctx;
+    if (!writer->first) {
+        writer->ok &= writer->pretty ? json_write_raw(writer->io, ", ", 2)
+                                     : json_write_raw(writer->io, ",", 1);
+    }
+    writer->first = 0;
+    writer->ok &= json_write_user(writer->io, user, writer->pretty, 1);
+}
+
+int json_write_list_items(struct mg_iobuf *io, User *const *users, size_t count, int pretty, int first) {
+    ListWriter writer = { io, pretty, first, 1 };
+    for (size_t i = 0; i < count; i++) {
+        write_list_item(users[i], &writer);
+    }
+    return writer.ok;
+}
+
+int json_write_users(struct mg_iobuf *io, User *const *users, size_t count, int pretty) {
+    int ok = json_write_raw(io, "[", 1);
+    ok &= json_write_list_items(io, users, count, pretty, 1);
+    ok &= json_write_raw(io, "]", 1);
+    return ok;
+}
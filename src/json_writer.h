@@ -0,0 +1,30 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include "mongoose.h"
+#include "users.h"
+
+// Streaming JSON output straight into a mongoose buffer (normally c->send),
+// without building a cJSON tree. Pretty output matches cJSON_Print byte for
+// byte. All functions return 1 on success and 0 if the buffer cannot grow.
+
+// Append raw bytes, growing the buffer geometrically
+int json_write_raw(struct mg_iobuf *io, const char *data, size_t len);
+
+// Append a quoted string, escaped the same way cJSON escapes it
+int json_write_string(struct mg_iobuf *io, const char *value);
+
+// Append one user object; depth is its nesting level (0 at top level).
+// Compact output is copied from the record's fragment, which is rendered
+// and attached on first use.
+int json_write_user(struct mg_iobuf *io, const User *user, int pretty, int depth);
+
+// Append users as elements of an array the caller has already opened;
+// first says whether the array is still empty (no leading separator)
+int json_write_list_items(struct mg_iobuf *io, User *const *users, size_t count, int pretty, int first);
+
+// Append an array of the given users, in the order given
+int json_write_users(struct mg_iobuf *io, User *const *users, size_t count, int pretty);
+
+
+#endif // JSON_WRITER_H
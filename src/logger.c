@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+// Windows threading
+typedef CRITICAL_SECTION pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+typedef HANDLE pthread_t;
+static inline int pthread_mutex_init(pthread_mutex_t *mutex, void *attr) {
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_lock(pthread_mutex_t *mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_destroy(pthread_mutex_t *mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_cond_init(pthread_cond_t *cond, void *attr) {
+    InitializeConditionVariable(cond);
+    return 0;
+}
+static inline int pthread_cond_signal(pthread_cond_t *cond) {
+    WakeConditionVariable(cond);
+    return 0;
+}
+static inline int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+    return 0;
+}
+static inline int pthread_cond_destroy(pthread_cond_t *cond) {
+    return 0;
+}
+static void cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, int ms) {
+    SleepConditionVariableCS(cond, mutex, (DWORD)ms);
+}
+static void utc_time(const time_t *t, struct tm *tm) {
+    gmtime_s(tm, t);
+}
+#define LOG_THREAD_LOCAL __declspec(thread)
+// Slim reader/writer locks, taken exclusively, stand in for mutexes
+typedef SRWLOCK registry_lock_t;
+#define REGISTRY_LOCK_INIT SRWLOCK_INIT
+#define registry_lock(m) AcquireSRWLockExclusive(m)
+#define registry_unlock(m) ReleaseSRWLockExclusive(m)
+// Fiber-local storage callbacks run on thread exit, as key destructors do
+static void retire_ring(void *ring);
+static DWORD ring_key;
+static VOID WINAPI retire_ring_callback(PVOID ring) {
+    if (ring) retire_ring(ring);
+}
+static int ring_key_create(void) {
+    ring_key = FlsAlloc(retire_ring_callback);
+    return ring_key != FLS_OUT_OF_INDEXES;
+}
+#define ring_key_set(ring) FlsSetValue(ring_key, (ring))
+#define atomic_load_u64(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+#define atomic_store_u64(p, v) InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+#define atomic_add_u64(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+#define atomic_load_int(p) InterlockedCompareExchange((volatile LONG*)(p), 0, 0)
+#define atomic_store_int(p, v) InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+#define atomic_load_int_seq(p) InterlockedCompareExchange((volatile LONG*)(p), 0, 0)
+#define atomic_store_int_seq(p, v) InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+#define atomic_cas_int(p, expected, desired) \
+    (InterlockedCompareExchange((volatile LONG*)(p), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+#define atomic_fence() MemoryBarrier()
+#define thread_yield() SwitchToThread()
+#define atomic_load_ptr(p) InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define atomic_cas_ptr(p, expected, desired) \
+    (InterlockedCompareExchangePointer((PVOID volatile*)(p), (desired), (expected)) == (expected))
+#else
+#include <pthread.h>
+#include <sched.h>
+static void cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, int ms) {
+    struct timespec until;
+    timespec_get(&until, TIME_UTC);
+    until.tv_nsec += (long)ms * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(cond, mutex, &until);
+}
+static void utc_time(const time_t *t, struct tm *tm) {
+    gmtime_r(t, tm);
+}
+#define LOG_THREAD_LOCAL _Thread_local
+typedef pthread_mutex_t registry_lock_t;
+#define REGISTRY_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#define registry_lock(m) pthread_mutex_lock(m)
+#define registry_unlock(m) pthread_mutex_unlock(m)
+static void retire_ring(void *ring);
+static pthread_key_t ring_key;
+static int ring_key_create(void) {
+    return pthread_key_create(&ring_key, retire_ring) == 0;
+}
+#define ring_key_set(ring) pthread_setspecific(ring_key, (ring))
+#define atomic_load_u64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_u64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_add_u64(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define atomic_load_int(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_store_int(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define atomic_load_int_seq(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define atomic_store_int_seq(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_cas_int(p, expected, desired) \
+    __sync_bool_compare_and_swap((p), (expected), (desired))
+#define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define thread_yield() sched_yield()
+#define atomic_load_ptr(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_cas_ptr(p, expected, desired) \
+    __sync_bool_compare_and_swap((p), (expected), (desired))
+#endif
+#include "logger.h"
+
+// Each thread owns one single-producer ring; only the writer thread
+// consumes from it. Producers only stamp the time and copy raw fields;
+// timestamps and access lines are turned into text by the writer.
+#define LOG_RING_SLOTS 4096
+#define LOG_LINE_MAX 240
+#define LOG_BATCH_BYTES (256 * 1024)
+
+// After writing a batch the writer gives the next one this long to fill;
+// once a drain finds every ring empty it sleeps until a line arrives
+#define LOG_BATCH_MS 10
+
+// A ring this full wakes the writer instead of waiting for the batch timer
+#define LOG_WAKE_SLOTS (LOG_RING_SLOTS / 8)
+
+typedef struct LogRecord {
+    struct timespec time;
+    int level;
+    int len;
+    int method_len;             // > 0 for access records: text is method then uri
+    int status;
+    unsigned long bytes;
+    double latency_us;
+    char text[LOG_LINE_MAX];
+} LogRecord;
+
+typedef struct LogRing {
+    struct LogRing *next;       // registry link, fixed once published
+    uint64_t head;              // next record to drain, advanced by the writer
+    uint64_t tail;              // next record to fill, advanced by the owner
+    uint64_t dropped;
+    int wake_requested;         // set by the owner, cleared by the writer
+    int writing;                // the owner is between its level check and publishing
+    int retired;                // the owner has exited; freed by the writer once drained
+    LogRecord records[LOG_RING_SLOTS];
+} LogRing;
+
+// Rings are registered on a thread's first log call and kept until the
+// thread exits, so a thread's pointer stays valid across restarts. Threads
+// push onto the registry without locking; only the writer unlinks, and it
+// holds rings_lock to do so, as do other threads that walk the list.
+static LogRing *rings = NULL;
+static LOG_THREAD_LOCAL LogRing *thread_ring = NULL;
+static registry_lock_t rings_lock = REGISTRY_LOCK_INIT;
+static int ring_key_ready = 0;
+static uint64_t retired_dropped = 0;    // drops counted by freed rings
+
+static int log_level = LOG_OFF;
+static FILE *log_out = NULL;
+static int writer_running = 0;
+static int writer_stopping = 0;
+static int writer_idle = 0;             // the writer is asleep until a line arrives
+static pthread_t writer_thread;
+static pthread_mutex_t writer_lock;
+static pthread_cond_t writer_wake;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static LogRing* acquire_ring(void) {
+    LogRing *ring = thread_ring;
+    if (ring) return ring;
+    
+    ring = (LogRing*)calloc(1, sizeof(LogRing));
+    if (!ring) return NULL;
+    LogRing *first;
+    do {
+        first = (LogRing*)atomic_load_ptr(&rings);
+        ring->next = first;
+    } while (!atomic_cas_ptr(&rings, first, ring));
+    thread_ring = ring;
+    if (ring_key_ready) ring_key_set(ring);
+    return ring;
+}
+
+// Runs on the owning thread as it exits. A destructor that logs after
+// this registers a fresh ring, which is retired in turn.
+static void retire_ring(void *ring) {
+    thread_ring = NULL;
+    atomic_store_int_seq(&((LogRing*)ring)->retired, 1);
+}
+
+// Returns the slot to fill, or NULL (counting a drop) if the ring is full
+static LogRecord* reserve_record(LogRing *ring, LogLevel level) {
+    uint64_t tail = ring->tail;
+    if (tail - atomic_load_u64(&ring->head) >= LOG_RING_SLOTS) {
+        atomic_add_u64(&ring->dropped, 1);
+        return NULL;
+    }
+    LogRecord *record = &ring->records[tail & (LOG_RING_SLOTS - 1)];
+    timespec_get(&record->time, TIME_UTC);
+    record->level = (int)level;
+    record->method_len = 0;
+    return record;
+}
+
+static void publish_record(LogRing *ring, LogRecord *record, int len) {
+    record->len = len < 0 ? 0 : (len >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : len);
+    uint64_t tail = ring->tail + 1;
+    atomic_store_u64(&ring->tail, tail);
+    
+    // Wake the writer once a ring passes the watermark, rather than leave
+    // it to the idle timer. The flag holds further wakes back until the
+    // writer has drained the ring, so this is not paid per line.
+    if (tail - atomic_load_u64(&ring->head) >= LOG_WAKE_SLOTS && !atomic_load_int(&ring->wake_requested)) {
+        atomic_store_int(&ring->wake_requested, 1);
+        pthread_mutex_lock(&writer_lock);
+        pthread_cond_signal(&writer_wake);
+        pthread_mutex_unlock(&writer_lock);
+    }
+    
+    // An idle writer sleeps until the first line after it went idle. The
+    // fence pairs with the one in writer_main: either it sees this record
+    // before sleeping, or this sees it idle.
+    atomic_fence();
+    if (atomic_load_int(&writer_idle) && atomic_cas_int(&writer_idle, 1, 0)) {
+        pthread_mutex_lock(&writer_lock);
+        pthread_cond_signal(&writer_wake);
+        pthread_mutex_unlock(&writer_lock);
+    }
+}
+
+int logger_enabled(LogLevel level) {
+    return (int)level >= atomic_load_int(&log_level);
+}
+
+// Marks the calling thread as writing a record, so logger_stop waits for
+// it before the writer's last drain, and checks the level again now that
+// the mark is visible. Returns the thread's ring, or NULL if the record
+// should not be written after all.
+static LogRing* begin_record(LogLevel level) {
+    LogRing *ring = acquire_ring();
+    if (!ring) return NULL;
+    atomic_store_int_seq(&ring->writing, 1);
+    if ((int)level < atomic_load_int_seq(&log_level)) {
+        atomic_store_int_seq(&ring->writing, 0);
+        return NULL;
+    }
+    return ring;
+}
+
+static void end_record(LogRing *ring) {
+    atomic_store_int_seq(&ring->writing, 0);
+}
+
+void log_message(LogLevel level, const char *fmt, ...) {
+    if (!logger_enabled(level)) return;
+    LogRing *ring = begin_record(level);
+    if (!ring) return;
+    LogRecord *record = reserve_record(ring, level);
+    if (!record) {
+        end_record(ring);
+        return;
+    }
+    
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(record->text, LOG_LINE_MAX, fmt, ap);
+    va_end(ap);
+    publish_record(ring, record, len);
+    end_record(ring);
+}
+
+void log_access(const char *method, size_t method_len, const char *uri, size_t uri_len,
+                int status, size_t bytes, double latency_us) {
+    if (!logger_enabled(LOG_INFO)) return;
+    LogRing *ring = begin_record(LOG_INFO);
+    if (!ring) return;
+    LogRecord *record = reserve_record(ring, LOG_INFO);
+    if (!record) {
+        end_record(ring);
+        return;
+    }
+    
+    if (method_len > 16) method_len = 16;
+    if (uri_len > LOG_LINE_MAX - 1 - method_len) uri_len = LOG_LINE_MAX - 1 - method_len;
+    memcpy(record->text, method, method_len);
+    memcpy(record->text + method_len, uri, uri_len);
+    record->method_len = (int)method_len;
+    record->status = status;
+    record->bytes = (unsigned long)bytes;
+    record->latency_us = latency_us;
+    publish_record(ring, record, (int)(method_len + uri_len));
+    end_record(ring);
+}
+
+size_t logger_dropped(void) {
+    registry_lock(&rings_lock);
+    uint64_t dropped = retired_dropped;
+    for (LogRing *ring = (LogRing*)atomic_load_ptr(&rings); ring; ring = ring->next) {
+        dropped += atomic_load_u64(&ring->dropped);
+    }
+    registry_unlock(&rings_lock);
+    return (size_t)dropped;
+}
+
+size_t logger_ring_count(void) {
+    size_t count = 0;
+    registry_lock(&rings_lock);
+    for (LogRing *ring = (LogRing*)atomic_load_ptr(&rings); ring; ring = ring->next) {
+        count++;
+    }
+    registry_unlock(&rings_lock);
+    return count;
+}
+
+// Appends the decimal digits of value, at least width of them
+static char* append_digits(char *out, unsigned long value, int width) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0 || n < width);
+    while (n > 0) *out++ = digits[--n];
+    return out;
+}
+
+static char* append_text(char *out, const char *text, size_t len) {
+    memcpy(out, text, len);
+    return out + len;
+}
+
+// The writer formats every line, so it keeps the date and time of the
+// second it formatted last rather than converting it again per line
+static time_t stamp_second = -1;
+static char stamp[64];
+
+// out must have room for LOG_LINE_MAX plus the fixed fields (see drain_rings)
+static size_t format_record(char *out, const LogRecord *record) {
+    if (record->time.tv_sec != stamp_second) {
+        struct tm tm;
+        time_t seconds = record->time.tv_sec;
+        utc_time(&seconds, &tm);
+        snprintf(stamp, sizeof(stamp), "%04d-%02d-%02dT%02d:%02d:%02d.",
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        stamp_second = record->time.tv_sec;
+    }
+    char *p = append_text(out, stamp, strlen(stamp));
+    p = append_digits(p, (unsigned long)(record->time.tv_nsec / 1000000L), 3);
+    p = append_text(p, "Z ", 2);
+    const char *level = level_names[record->level];
+    size_t level_len = strlen(level);
+    p = append_text(p, level, level_len);
+    p = append_text(p, "      ", 6 - level_len);
+    
+    if (record->method_len > 0) {
+        double latency = record->latency_us < 0 ? 0 : record->latency_us * 10 + 0.5;
+        unsigned long tenths = latency < 1e15 ? (unsigned long)latency : 0;
+        p = append_text(p, "method=", 7);
+        p = append_text(p, record->text, (size_t)record->method_len);
+        p = append_text(p, " uri=", 5);
+        p = append_text(p, record->text + record->method_len, (size_t)(record->len - record->method_len));
+        p = append_text(p, " status=", 8);
+        p = append_digits(p, (unsigned long)(record->status < 0 ? 0 : record->status), 1);
+        p = append_text(p, " bytes=", 7);
+        p = append_digits(p, record->bytes, 1);
+        p = append_text(p, " latency_us=", 12);
+        p = append_digits(p, tenths / 10, 1);
+        *p++ = '.';
+        *p++ = (char)('0' + tenths % 10);
+    } else {
+        p = append_text(p, record->text, (size_t)record->len);
+    }
+    *p++ = '\n';
+    return (size_t)(p - out);
+}
+
+// Unlinks and frees a drained ring whose thread has exited. The list
+// head can only be unlinked while no thread is pushing in front of it;
+// otherwise the ring is left for the next drain. Returns 1 if freed.
+static int free_retired_ring(LogRing *prev, LogRing *ring) {
+    int unlinked = 1;
+    registry_lock(&rings_lock);
+    if (prev) {
+        prev->next = ring->next;
+    } else {
+        unlinked = atomic_cas_ptr(&rings, ring, ring->next);
+    }
+    if (unlinked) retired_dropped += atomic_load_u64(&ring->dropped);
+    registry_unlock(&rings_lock);
+    if (unlinked) free(ring);
+    return unlinked;
+}
+
+// Moves queued records from every ring into batch; stops early if full
+static size_t drain_rings(char *batch, size_t capacity) {
+    // Timestamp, level and the access fields around the text, with margin
+    const size_t line_room = LOG_LINE_MAX + 160;
+    size_t used = 0;
+    LogRing *prev = NULL;
+    LogRing *next;
+    for (LogRing *ring = (LogRing*)atomic_load_ptr(&rings); ring; ring = next) {
+        next = ring->next;
+        // Read before the tail, so a retired ring's tail is its last
+        int retired = atomic_load_int_seq(&ring->retired);
+        uint64_t head = ring->head;
+        uint64_t tail = atomic_load_u64(&ring->tail);
+        while (head != tail && capacity - used >= line_room) {
+            used += format_record(batch + used, &ring->records[head & (LOG_RING_SLOTS - 1)]);
+            head++;
+        }
+        atomic_store_u64(&ring->head, head);
+        if (head == tail) atomic_store_int(&ring->wake_requested, 0);
+        if (!(retired && head == tail && free_retired_ring(prev, ring))) prev = ring;
+    }
+    return used;
+}
+
+static int rings_empty(void) {
+    for (LogRing *ring = (LogRing*)atomic_load_ptr(&rings); ring; ring = ring->next) {
+        if (atomic_load_u64(&ring->tail) != ring->head) return 0;
+    }
+    return 1;
+}
+
+static int wake_requested(void) {
+    for (LogRing *ring = (LogRing*)atomic_load_ptr(&rings); ring; ring = ring->next) {
+        if (atomic_load_int(&ring->wake_requested)) return 1;
+    }
+    return 0;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI writer_main(LPVOID arg) {
+#else
+static void* writer_main(void *arg) {
+#endif
+    static char batch[LOG_BATCH_BYTES];
+    size_t reported_drops = 0;
+    (void)arg;
+    
+    for (;;) {
+        size_t len = drain_rings(batch, sizeof(batch));
+        if (len > 0) {
+            fwrite(batch, 1, len, log_out);
+            if (len > sizeof(batch) / 2) continue;      // more is likely waiting
+            fflush(log_out);
+        }
+    
+        size_t dropped = logger_dropped();
+        if (dropped != reported_drops) {
+            fprintf(log_out, "logger: %lu lines dropped so far\n", (unsigned long)dropped);
+            fflush(log_out);
+            reported_drops = dropped;
+        }
+    
+        // A ring that asked for a wake after the drain above gets it here,
+        // since producers set the flag before taking the lock to signal.
+        // With nothing written this pass, the writer sleeps until a line
+        // arrives rather than polling empty rings.
+        pthread_mutex_lock(&writer_lock);
+        int stopping = writer_stopping;
+        if (!stopping && !wake_requested()) {
+            if (len > 0) {
+                cond_wait_ms(&writer_wake, &writer_lock, LOG_BATCH_MS);
+            } else {
+                atomic_store_int_seq(&writer_idle, 1);
+                atomic_fence();
+                if (rings_empty()) pthread_cond_wait(&writer_wake, &writer_lock);
+                atomic_store_int_seq(&writer_idle, 0);
+            }
+        }
+        pthread_mutex_unlock(&writer_lock);
+        if (stopping && len == 0) break;
+    }
+    fflush(log_out);
+    return 0;
+}
+
+int logger_start(LogLevel level, FILE *out) {
+    logger_stop();
+    if (level >= LOG_OFF || !out) return 1;
+    
+    // Rings are only registered while a writer runs, so the key that
+    // retires them on thread exit only has to exist from the first start
+    if (!ring_key_ready) ring_key_ready = ring_key_create();
+    log_out = out;
+    writer_stopping = 0;
+    writer_idle = 0;
+    pthread_mutex_init(&writer_lock, NULL);
+    pthread_cond_init(&writer_wake, NULL);
+#ifdef _WIN32
+    writer_thread = CreateThread(NULL, 0, writer_main, NULL, 0, NULL);
+    writer_running = writer_thread != NULL;
+#else
+    writer_running = pthread_create(&writer_thread, NULL, writer_main, NULL) == 0;
+#endif
+    if (!writer_running) {
+        pthread_cond_destroy(&writer_wake);
+        pthread_mutex_destroy(&writer_lock);
+        return 0;
+    }
+    atomic_store_int(&log_level, (int)level);
+    return 1;
+}
+
+void logger_stop(void) {
+    atomic_store_int_seq(&log_level, LOG_OFF);
+    if (!writer_running) return;
+    
+    // A thread that saw the old level may still be publishing, and may
+    // take writer_lock to wake the writer. Once none is, every record that
+    // will ever be published is in a ring for the writer's last drain.
+    registry_lock(&rings_lock);
+    for (LogRing *ring = (LogRing*)atomic_load_ptr(&rings); ring; ring = ring->next) {
+        while (atomic_load_int_seq(&ring->writing)) thread_yield();
+    }
+    registry_unlock(&rings_lock);
+    
+    pthread_mutex_lock(&writer_lock);
+    writer_stopping = 1;
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_lock);
+#ifdef _WIN32
+    WaitForSingleObject(writer_thread, INFINITE);
+    CloseHandle(writer_thread);
+#else
+    pthread_join(writer_thread, NULL);
+#endif
+    pthread_cond_destroy(&writer_wake);
+    pthread_mutex_destroy(&writer_lock);
+    writer_running = 0;
+}
+
+LogLevel logger_parse_level(const char *name, LogLevel fallback) {
+    static const char *names[] = { "debug", "info", "warn", "error", "off" };
+    if (!name) return fallback;
+    for (int i = 0; i <= LOG_OFF; i++) {
+        if (strcmp(name, names[i]) == 0) return (LogLevel)i;
+    }
+    return fallback;
+}
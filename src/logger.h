@@ -0,0 +1,49 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef enum LogLevel {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_OFF
+} LogLevel;
+
+// Log calls never block on I/O: each thread formats lines into its own
+// lock-free ring, and a background thread drains every ring in batches.
+// A full ring drops lines (and counts them) rather than stall a request.
+// The writer sleeps while every ring is empty, and a thread's ring is
+// freed once the thread has exited and its lines have been written.
+// Until logger_start is called the level is LOG_OFF and nothing is kept.
+
+// Start the writer thread, sending lines at or above `level` to `out`.
+// Returns 1 on success (or when level is LOG_OFF), 0 otherwise.
+int logger_start(LogLevel level, FILE *out);
+
+// Write out everything still queued and stop the writer thread
+void logger_stop(void);
+
+// Parse "debug", "info", "warn", "error" or "off"; unknown names give fallback
+LogLevel logger_parse_level(const char *name, LogLevel fallback);
+
+// Whether a line at this level would be kept; cheap enough for hot paths
+int logger_enabled(LogLevel level);
+
+// Queue a printf-style line
+void log_message(LogLevel level, const char *fmt, ...);
+
+// Queue an access-log line for a finished request (at LOG_INFO)
+void log_access(const char *method, size_t method_len, const char *uri, size_t uri_len,
+                int status, size_t bytes, double latency_us);
+
+// Lines dropped because a thread's ring was full
+size_t logger_dropped(void);
+
+// Rings currently registered: one per thread that has logged, until the
+// writer frees it after the thread exits and its lines are written out
+size_t logger_ring_count(void);
+
+#endif // LOGGER_H
@@ -2,32 +2,139 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 #include "mongoose.h"
 #include "users.h"
 #include "routes.h"
 #include "swagger.h"
+#include "logger.h"
 
 #ifdef _WIN32
 #include <windows.h>
 #define sleep(x) Sleep((x) * 1000)
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #endif
 
 #define PORT 5000
+#define DEFAULT_WORKERS 4
+#define MAX_REACTORS 64
+#define DEFAULT_WAL_SYNC_MS 50
+#define DEFAULT_SNAPSHOT_INTERVAL 300
 
 static struct mg_mgr mgr;
-static volatile int s_exit = 0;
+static volatile sig_atomic_t s_exit = 0;
 
+static const char *snapshot_path = NULL;
+static int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+static time_t last_snapshot = 0;
+static uint64_t snapshot_generation = 0;   // store generation the last snapshot holds
+
+// Polled by the thread running the first event loop
+static void maybe_snapshot(void) {
+    if (!snapshot_path || snapshot_interval <= 0) return;
+    time_t now = time(NULL);
+    if (now - last_snapshot < snapshot_interval) return;
+    last_snapshot = now;
+    // An unchanged store would only be written out again as it is
+    uint64_t generation = users_generation();
+    if (generation == snapshot_generation) return;
+    if (start_user_snapshot(snapshot_path)) snapshot_generation = generation;
+}
+
+#ifdef SO_REUSEPORT
+// With several reactors, each thread runs its own mg_mgr with its own
+// listening socket on the same port, and the kernel spreads new
+// connections across them. Requests are handled inline on each reactor.
+static struct mg_mgr reactor_mgrs[MAX_REACTORS];
+static pthread_t reactor_threads[MAX_REACTORS];
+
+// mongoose binds listeners without SO_REUSEPORT, so let it open one on an
+// ephemeral loopback port and swap in our own socket. This relies on the
+// default poll() backend, which reads the descriptor afresh every poll.
+static struct mg_connection* listen_shared(struct mg_mgr *m, int port) {
+    int on = 1;
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((uint16_t)port);
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return NULL;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+        bind(fd, (struct sockaddr*)&sin, sizeof(sin)) != 0 ||
+        listen(fd, 128) != 0 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) != 0 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    struct mg_connection *c = mg_http_listen(m, "http://127.0.0.1:0", handle_mongoose_request, NULL);
+    if (c == NULL) {
+        close(fd);
+        return NULL;
+    }
+    close((int)(size_t)c->fd);
+    c->fd = (void*)(size_t)fd;
+    return c;
+}
+
+static void* run_reactor(void *arg) {
+    struct mg_mgr *m = (struct mg_mgr*)arg;
+    while (!s_exit) {
+        mg_mgr_poll(m, 1000);
+        if (m == &reactor_mgrs[0]) maybe_snapshot();
+    }
+    return NULL;
+}
+
+// Starts reactors 1..count-1 on their own threads; the caller runs reactor 0
+static int start_reactors(int count, int port) {
+    for (int i = 0; i < count; i++) {
+        mg_mgr_init(&reactor_mgrs[i]);
+        if (listen_shared(&reactor_mgrs[i], port) == NULL) {
+            fprintf(stderr, "Failed to open reactor %d on port %d\n", i, port);
+            return 0;
+        }
+    }
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&reactor_threads[i], NULL, run_reactor, &reactor_mgrs[i]) != 0) {
+            fprintf(stderr, "Failed to start reactor thread %d\n", i);
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+// Only asks the event loops to stop: workers, reactors and the log's
+// commit thread may be holding any lock at this point, so main does the
+// actual shutdown once they have stopped
 void handle_shutdown(int sig) {
-    printf("\nShutting down server...\n");
+    (void)sig;
     s_exit = 1;
+}
+
+// Runs after every thread that handles requests has stopped
+static void shut_down(void) {
+    printf("\nShutting down server...\n");
+    close_user_log();
     shutdown_users();
-    exit(0);
+    cleanup_routes();
+    logger_stop();
 }
 
 int main(int argc, char *argv[]) {
     int port = PORT;
+    int workers = DEFAULT_WORKERS;
+    int reactors = 1;
     
     // Check for PORT environment variable
     char *env_port = getenv("PORT");
@@ -35,14 +142,99 @@ int main(int argc, char *argv[]) {
         port = atoi(env_port);
     }
     
-    // Initialize users
+    // WORKERS=0 handles every request on the event loop thread
+    char *env_workers = getenv("WORKERS");
+    if (env_workers) {
+        workers = atoi(env_workers);
+        if (workers < 0) workers = 0;
+    }
+    
+    // REACTORS=N or --reactors=N runs N event loops sharing the port
+    char *env_reactors = getenv("REACTORS");
+    if (env_reactors) {
+        reactors = atoi(env_reactors);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--reactors=", 11) == 0) {
+            reactors = atoi(argv[i] + 11);
+        }
+    }
+    if (reactors < 1) reactors = 1;
+    if (reactors > MAX_REACTORS) reactors = MAX_REACTORS;
+    
+    // LOG_LEVEL=debug|info|warn|error|off; access lines are logged at info
+    LogLevel log_level = logger_parse_level(getenv("LOG_LEVEL"), LOG_INFO);
+    if (!logger_start(log_level, stdout)) {
+        fprintf(stderr, "Failed to start the log writer, logging is disabled\n");
+    }
+    
+    // Initialize users. With USERS_SNAPSHOT=path the store starts from the
+    // last snapshot, and with USERS_WAL=path from its write-ahead log, or
+    // the part written after the snapshot. The seed users are only added
+    // when neither has anything to restore.
     init_users();
-    seed_users();
+    long loaded = -1;
+    snapshot_path = getenv("USERS_SNAPSHOT");
+    if (snapshot_path) {
+        char *env_interval = getenv("SNAPSHOT_INTERVAL");
+        if (env_interval) snapshot_interval = atoi(env_interval);
+        loaded = load_user_snapshot(snapshot_path);
+        if (loaded >= 0) {
+            printf("Loaded %ld users from snapshot %s\n", loaded, snapshot_path);
+        }
+        last_snapshot = time(NULL);
+    }
+    long replayed = 0;
+    char *wal_path = getenv("USERS_WAL");
+    if (wal_path) {
+        int sync_ms = DEFAULT_WAL_SYNC_MS;
+        char *env_sync = getenv("WAL_SYNC_MS");
+        if (env_sync) sync_ms = atoi(env_sync);
+        replayed = open_user_log(wal_path, sync_ms);
+        if (replayed < 0) {
+            fprintf(stderr, "Failed to open write-ahead log %s\n", wal_path);
+            return 1;
+        }
+        printf("Replayed %ld records from %s\n", replayed, wal_path);
+    }
+    if (loaded >= 0 && replayed == 0) {
+        snapshot_generation = users_generation();
+    }
+    if (loaded < 0 && replayed == 0) {
+        seed_users();
+    }
+    // Built once here, before any thread can serve a request
+    if (!init_routes()) {
+        fprintf(stderr, "Failed to render the Swagger responses\n");
+        return 1;
+    }
     
     // Set up signal handler
     signal(SIGINT, handle_shutdown);
     signal(SIGTERM, handle_shutdown);
     
+    if (reactors > 1) {
+#ifdef SO_REUSEPORT
+        if (!start_reactors(reactors, port)) {
+            return 1;
+        }
+        printf("Server running on http://0.0.0.0:%d with %d reactors (no worker pool)\n", port, reactors);
+        printf("Swagger UI available at http://localhost:%d/\n", port);
+        printf("Press Ctrl+C to stop...\n");
+        run_reactor(&reactor_mgrs[0]);
+        for (int i = 1; i < reactors; i++) {
+            pthread_join(reactor_threads[i], NULL);
+        }
+        for (int i = 0; i < reactors; i++) {
+            mg_mgr_free(&reactor_mgrs[i]);
+        }
+        shut_down();
+        return 0;
+#else
+        fprintf(stderr, "SO_REUSEPORT is not available; running a single event loop\n");
+#endif
+    }
+    
     // Start HTTP daemon
     // Initialize mongoose manager
     mg_mgr_init(&mgr);
@@ -59,16 +251,25 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
-    printf("Server running on http://0.0.0.0:%d\n", port);
+    // Workers hand responses back to the event loop through mg_wakeup
+    if (workers > 0 && (!mg_wakeup_init(&mgr) || !start_request_workers((size_t)workers))) {
+        fprintf(stderr, "Failed to start %d worker threads, serving on the event loop\n", workers);
+        workers = 0;
+    }
+    
+    printf("Server running on http://0.0.0.0:%d with %d worker threads\n", port, workers);
     printf("Swagger UI available at http://localhost:%d/\n", port);
     printf("Press Ctrl+C to stop...\n");
     
     // Event loop
     while (!s_exit) {
         mg_mgr_poll(&mgr, 1000);
+        maybe_snapshot();
     }
     
+    stop_request_workers();
     mg_mgr_free(&mgr);
+    shut_down();
     
     return 0;
 }
\ No newline at end of file
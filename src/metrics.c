@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#define METRICS_THREAD_LOCAL __declspec(thread)
+#define counter_load(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+#define counter_store(p, v) InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+#define atomic_load_ptr(p) InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define atomic_cas_ptr(p, expected, desired) \
+    (InterlockedCompareExchangePointer((PVOID volatile*)(p), (desired), (expected)) == (expected))
+#else
+#define METRICS_THREAD_LOCAL _Thread_local
+#define counter_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define counter_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define atomic_load_ptr(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_cas_ptr(p, expected, desired) \
+    __sync_bool_compare_and_swap((p), (expected), (desired))
+#endif
+#include "metrics.h"
+
+// Only the owning thread writes a shard, so a counter is bumped with a
+// relaxed load and store rather than a locked add
+#define counter_add(p, v) counter_store((p), counter_load(p) + (uint64_t)(v))
+
+// Log-linear latency buckets in microseconds: values below 8 get a bucket
+// each, then every power of two is split into 8 sub-buckets
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXPONENT 26     // about 67 s
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS * (LATENCY_MAX_EXPONENT - LATENCY_SUB_BITS + 2))
+
+#define STATUS_CLASSES 6            // index status / 100; 0 for anything odd
+
+typedef struct RouteMetrics {
+    uint64_t requests[STATUS_CLASSES];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t latency_sum_ns;
+    uint64_t latency[LATENCY_BUCKETS];
+} RouteMetrics;
+
+typedef struct CompressionMetrics {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t time_ns;
+} CompressionMetrics;
+
+typedef struct MetricsShard {
+    struct MetricsShard *next;      // registry link, fixed once published
+    RouteMetrics routes[METRICS_MAX_ROUTES];
+    CompressionMetrics compression;
+} MetricsShard;
+
+typedef struct RouteLabel {
+    char method[8];
+    char pattern[64];
+} RouteLabel;
+
+// Shards are registered on a thread's first request and kept for the life
+// of the process, like the counters they hold
+static MetricsShard *shards = NULL;
+static METRICS_THREAD_LOCAL MetricsShard *thread_shard = NULL;
+
+static RouteLabel route_labels[METRICS_MAX_ROUTES] = { { "*", "unmatched" } };
+static int route_label_count = 1;
+
+// Bucket bounds exported to Prometheus, in microseconds
+static const double export_bounds_us[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000
+};
+#define EXPORT_BOUNDS (sizeof(export_bounds_us) / sizeof(export_bounds_us[0]))
+
+static int highest_bit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(value);
+#else
+    int bit = 0;
+    while (value >>= 1) bit++;
+    return bit;
+#endif
+}
+
+static size_t latency_bucket(uint64_t us) {
+    if (us < LATENCY_SUB_BUCKETS) return (size_t)us;
+    int exponent = highest_bit(us);
+    if (exponent > LATENCY_MAX_EXPONENT) return LATENCY_BUCKETS - 1;
+    size_t sub = (size_t)(us >> (exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return LATENCY_SUB_BUCKETS * (size_t)(exponent - LATENCY_SUB_BITS + 1) + sub;
+}
+
+// Exclusive upper bound of a bucket, in microseconds
+static uint64_t latency_bucket_limit(size_t bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) return bucket + 1;
+    size_t exponent = bucket / LATENCY_SUB_BUCKETS - 1 + LATENCY_SUB_BITS;
+    size_t sub = bucket % LATENCY_SUB_BUCKETS;
+    return (uint64_t)(LATENCY_SUB_BUCKETS + sub + 1) << (exponent - LATENCY_SUB_BITS);
+}
+
+static MetricsShard* acquire_shard(void) {
+    MetricsShard *shard = thread_shard;
+    if (shard) return shard;
+    
+    shard = (MetricsShard*)calloc(1, sizeof(MetricsShard));
+    if (!shard) return NULL;
+    MetricsShard *first;
+    do {
+        first = (MetricsShard*)atomic_load_ptr(&shards);
+        shard->next = first;
+    } while (!atomic_cas_ptr(&shards, first, shard));
+    thread_shard = shard;
+    return shard;
+}
+
+int metrics_register_route(const char *method, const char *pattern) {
+    for (int i = 1; i < route_label_count; i++) {
+        if (strcmp(route_labels[i].method, method) == 0 && strcmp(route_labels[i].pattern, pattern) == 0) {
+            return i;
+        }
+    }
+    if (route_label_count == METRICS_MAX_ROUTES) return METRICS_UNMATCHED_ROUTE;
+    
+    RouteLabel *label = &route_labels[route_label_count];
+    snprintf(label->method, sizeof(label->method), "%s", method);
+    snprintf(label->pattern, sizeof(label->pattern), "%s", pattern);
+    return route_label_count++;
+}
+
+void metrics_record_request(int route, int status, size_t bytes_in, size_t bytes_out, double latency_us) {
+    MetricsShard *shard = acquire_shard();
+    if (!shard) return;
+    if (route < 0 || route >= METRICS_MAX_ROUTES) route = METRICS_UNMATCHED_ROUTE;
+    if (latency_us < 0) latency_us = 0;
+    
+    RouteMetrics *metrics = &shard->routes[route];
+    int status_class = status / 100;
+    counter_add(&metrics->requests[status_class > 0 && status_class < STATUS_CLASSES ? status_class : 0], 1);
+    counter_add(&metrics->bytes_in, bytes_in);
+    counter_add(&metrics->bytes_out, bytes_out);
+    counter_add(&metrics->latency_sum_ns, (uint64_t)(latency_us * 1000.0));
+    counter_add(&metrics->latency[latency_bucket((uint64_t)latency_us)], 1);
+}
+
+void metrics_record_compression(size_t bytes_in, size_t bytes_out, double seconds) {
+    MetricsShard *shard = acquire_shard();
+    if (!shard) return;
+    if (seconds < 0) seconds = 0;
+    counter_add(&shard->compression.bytes_in, bytes_in);
+    counter_add(&shard->compression.bytes_out, bytes_out);
+    counter_add(&shard->compression.time_ns, (uint64_t)(seconds * 1e9));
+}
+
+static void append(struct mg_iobuf *io, const char *fmt, ...) {
+    char line[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    mg_iobuf_add(io, io->len, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+static void sum_route(int route, RouteMetrics *total) {
+    memset(total, 0, sizeof(*total));
+    for (MetricsShard *shard = (MetricsShard*)atomic_load_ptr(&shards); shard; shard = shard->next) {
+        const RouteMetrics *metrics = &shard->routes[route];
+        for (int i = 0; i < STATUS_CLASSES; i++) total->requests[i] += counter_load(&metrics->requests[i]);
+        total->bytes_in += counter_load(&metrics->bytes_in);
+        total->bytes_out += counter_load(&metrics->bytes_out);
+        total->latency_sum_ns += counter_load(&metrics->latency_sum_ns);
+        for (size_t i = 0; i < LATENCY_BUCKETS; i++) total->latency[i] += counter_load(&metrics->latency[i]);
+    }
+}
+
+void metrics_render(struct mg_iobuf *io) {
+    static const char *status_labels[STATUS_CLASSES] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+    RouteMetrics *totals = (RouteMetrics*)malloc(sizeof(RouteMetrics) * METRICS_MAX_ROUTES);
+    if (!totals) return;
+    int routes = route_label_count;
+    for (int r = 0; r < routes; r++) sum_route(r, &totals[r]);
+    
+    append(io, "# HELP http_requests_total Requests handled, by route and status class.\n"
+               "# TYPE http_requests_total counter\n");
+    for (int r = 0; r < routes; r++) {
+        for (int s = 0; s < STATUS_CLASSES; s++) {
+            if (totals[r].requests[s] == 0) continue;
+            append(io, "http_requests_total{method=\"%s\",route=\"%s\",code=\"%s\"} %llu\n",
+                   route_labels[r].method, route_labels[r].pattern, status_labels[s],
+                   (unsigned long long)totals[r].requests[s]);
+        }
+    }
+    
+    append(io, "# HELP http_request_bytes_total Request bytes received, headers included.\n"
+               "# TYPE http_request_bytes_total counter\n");
+    for (int r = 0; r < routes; r++) {
+        append(io, "http_request_bytes_total{method=\"%s\",route=\"%s\"} %llu\n",
+               route_labels[r].method, route_labels[r].pattern, (unsigned long long)totals[r].bytes_in);
+    }
+    append(io, "# HELP http_response_bytes_total Response bytes queued, headers included.\n"
+               "# TYPE http_response_bytes_total counter\n");
+    for (int r = 0; r < routes; r++) {
+        append(io, "http_response_bytes_total{method=\"%s\",route=\"%s\"} %llu\n",
+               route_labels[r].method, route_labels[r].pattern, (unsigned long long)totals[r].bytes_out);
+    }
+    
+    // A fine bucket is counted under the first bound that covers all of it
+    append(io, "# HELP http_request_duration_seconds Time spent producing the response.\n"
+               "# TYPE http_request_duration_seconds histogram\n");
+    for (int r = 0; r < routes; r++) {
+        const RouteMetrics *total = &totals[r];
+        uint64_t count = 0;
+        size_t bucket = 0;
+        for (size_t b = 0; b < EXPORT_BOUNDS; b++) {
+            while (bucket < LATENCY_BUCKETS && (double)latency_bucket_limit(bucket) <= export_bounds_us[b]) {
+                count += total->latency[bucket++];
+            }
+            append(io, "http_request_duration_seconds_bucket{method=\"%s\",route=\"%s\",le=\"%g\"} %llu\n",
+                   route_labels[r].method, route_labels[r].pattern, export_bounds_us[b] / 1e6,
+                   (unsigned long long)count);
+        }
+        while (bucket < LATENCY_BUCKETS) count += total->latency[bucket++];
+        append(io, "http_request_duration_seconds_bucket{method=\"%s\",route=\"%s\",le=\"+Inf\"} %llu\n"
+                   "http_request_duration_seconds_sum{method=\"%s\",route=\"%s\"} %.9f\n"
+                   "http_request_duration_seconds_count{method=\"%s\",route=\"%s\"} %llu\n",
+               route_labels[r].method, route_labels[r].pattern, (unsigned long long)count,
+               route_labels[r].method, route_labels[r].pattern, (double)total->latency_sum_ns / 1e9,
+               route_labels[r].method, route_labels[r].pattern, (unsigned long long)count);
+    }
+    free(totals);
+    
+    CompressionMetrics compression = { 0, 0, 0 };
+    for (MetricsShard *shard = (MetricsShard*)atomic_load_ptr(&shards); shard; shard = shard->next) {
+        compression.bytes_in += counter_load(&shard->compression.bytes_in);
+        compression.bytes_out += counter_load(&shard->compression.bytes_out);
+        compression.time_ns += counter_load(&shard->compression.time_ns);
+    }
+    append(io, "# HELP http_compression_input_bytes_total Response bytes passed to gzip.\n"
+               "# TYPE http_compression_input_bytes_total counter\n"
+               "http_compression_input_bytes_total %llu\n"
+               "# HELP http_compression_output_bytes_total Bytes gzip produced from them.\n"
+               "# TYPE http_compression_output_bytes_total counter\n"
+               "http_compression_output_bytes_total %llu\n"
+               "# HELP http_compression_seconds_total Time spent compressing responses.\n"
+               "# TYPE http_compression_seconds_total counter\n"
+               "http_compression_seconds_total %.9f\n",
+           (unsigned long long)compression.bytes_in, (unsigned long long)compression.bytes_out,
+           (double)compression.time_ns / 1e9);
+    // Output over input, so 0.2 means responses shrank to a fifth
+    append(io, "# HELP http_compression_ratio Compressed size over original size, over all responses.\n"
+               "# TYPE http_compression_ratio gauge\n"
+               "http_compression_ratio %g\n",
+           compression.bytes_in ? (double)compression.bytes_out / (double)compression.bytes_in : 1.0);
+}
+
+void metrics_write_value(struct mg_iobuf *io, const char *name, const char *type, const char *help, double value) {
+    append(io, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
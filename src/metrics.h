@@ -0,0 +1,34 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include "mongoose.h"
+
+#define METRICS_MAX_ROUTES 64
+
+// Route 0 collects requests that matched no route (404, 405, preflight)
+#define METRICS_UNMATCHED_ROUTE 0
+
+// Each thread records into its own shard with plain stores, so recording
+// never takes a lock or a locked instruction; a scrape sums the shards.
+// Latencies go into log-linear buckets 12.5% wide and are exported as a
+// Prometheus histogram with fixed `le` bounds.
+
+// Label a route's series. Registering the same pair again returns the same
+// id; a full table returns METRICS_UNMATCHED_ROUTE. Call before serving.
+int metrics_register_route(const char *method, const char *pattern);
+
+// Record one finished request on the calling thread's shard
+void metrics_record_request(int route, int status, size_t bytes_in, size_t bytes_out, double latency_us);
+
+// Record one gzip run on the calling thread's shard: bytes in and out and
+// the time it took, which stands in for its CPU cost
+void metrics_record_compression(size_t bytes_in, size_t bytes_out, double seconds);
+
+// Append every request series in Prometheus text exposition format
+void metrics_render(struct mg_iobuf *io);
+
+// Append one unlabelled sample with its HELP and TYPE lines
+void metrics_write_value(struct mg_iobuf *io, const char *name, const char *type, const char *help, double value);
+
+#endif // METRICS_H
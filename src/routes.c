@@ -1,267 +1,1813 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
 #include "mongoose.h"
 #include "cjson/cJSON.h"
 #include "routes.h"
 #include "users.h"
 #include "swagger.h"
+#include "json_writer.h"
+#include "json_reader.h"
+#include "cached_response.h"
+#include "worker_pool.h"
+#include "logger.h"
+#include "metrics.h"
 
-static void send_json_response(struct mg_connection *c, int status_code, cJSON *json) {
-    char *response_str = cJSON_Print(json);
-    mg_printf(c, "HTTP/1.1 %d %s\r\n"
-                 "Content-Type: application/json\r\n"
-                 "Access-Control-Allow-Origin: *\r\n"
-                 "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
-                 "Access-Control-Allow-Headers: Content-Type, Authorization, X-Requested-With, Accept, Origin\r\n"
-                 "Content-Length: %d\r\n\r\n%s",
-              status_code, 
-              status_code == 200 ? "OK" : 
-              status_code == 201 ? "Created" : 
-              status_code == 404 ? "Not Found" : "Bad Request",
-              (int)strlen(response_str), response_str);
-    free(response_str);
-}
-
-static void send_text_response(struct mg_connection *c, int status_code, const char *content_type, const char *body) {
+#ifdef _WIN32
+#define ROUTES_THREAD_LOCAL __declspec(thread)
+// Slim reader/writer locks, taken exclusively, stand in for mutexes
+typedef SRWLOCK routes_mutex_t;
+#define ROUTES_MUTEX_INIT SRWLOCK_INIT
+#define routes_mutex_lock(m) AcquireSRWLockExclusive(m)
+#define routes_mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#else
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#define ROUTES_THREAD_LOCAL _Thread_local
+typedef pthread_mutex_t routes_mutex_t;
+#define ROUTES_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define routes_mutex_lock(m) pthread_mutex_lock(m)
+#define routes_mutex_unlock(m) pthread_mutex_unlock(m)
+#endif
+
+// Streamed bodies are written before their length is known, so the
+// Content-Length value is reserved as blanks and patched afterwards;
+// the trailing spaces are legal optional whitespace.
+#define CONTENT_LENGTH_BLANK "          "
+#define CONTENT_LENGTH_WIDTH (sizeof(CONTENT_LENGTH_BLANK) - 1)
+
+// A full GET /users dump is streamed in batches of this many users, each
+// written once less than the low-water mark is still waiting to be sent
+#define USERS_STREAM_BATCH 256
+#define USERS_STREAM_LOW_WATER (16 * 1024)
+
+struct UserImport;
+struct PendingBody;
+
+// Progress of a streamed dump or import, kept in the connection's user data
+typedef struct UserStream {
+    int after;
+    unsigned char active;
+    unsigned char pretty;
+    unsigned char first;
+    unsigned char ndjson;       // one user per line instead of an array
+    struct UserImport *import;  // set while a request body is being imported
+    HttpGzipStream *gzip;       // compresses the dump's chunks, if accepted
+    struct PendingBody *body;   // a cached body still being written
+} UserStream;
+_Static_assert(sizeof(UserStream) <= sizeof(((struct mg_connection*)0)->data),
+               "UserStream must fit in mg_connection data");
+
+// Page sizes for GET /users?limit=&after=
+#define USERS_PAGE_DEFAULT 100
+#define USERS_PAGE_MAX 1000
+
+// Bodies are gzipped for clients that accept it once they are large
+// enough to gain from it. Dynamic bodies are compressed per response, so
+// they use zlib's fastest level.
+#define RESPONSE_GZIP_MIN_BYTES 1024
+#define RESPONSE_GZIP_LEVEL 1
+
+// Room for an "ETag: ...\r\n" line
+#define ETAG_HEADER_SIZE 80
+
+// Set by route_request for the request being handled on this thread
+static ROUTES_THREAD_LOCAL int request_accepts_gzip = 0;
+
+static const char* status_text(int status_code) {
+    switch (status_code) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 409: return "Conflict";
+        case 500: return "Internal Server Error";
+        default: return "Error";
+    }
+}
+
+// Heads of the responses this API sends most, up to where the extra
+// headers go, so starting one is a single copy rather than formatting the
+// same lines again. Other status and type pairs are formatted as needed.
+typedef struct ResponseHead {
+    int status_code;
+    const char *content_type;
+    const char *text;
+    size_t len;
+} ResponseHead;
+
+#define RESPONSE_HEAD_TEXT(status, content_type) \
+    "HTTP/1.1 " status "\r\n" \
+    "Content-Type: " content_type "\r\n" \
+    HTTP_CORS_HEADERS \
+    "Vary: Accept-Encoding\r\n"
+#define RESPONSE_HEAD(status_code, reason, content_type) \
+    { status_code, content_type, RESPONSE_HEAD_TEXT(#status_code " " reason, content_type), \
+      sizeof(RESPONSE_HEAD_TEXT(#status_code " " reason, content_type)) - 1 }
+
+static const ResponseHead response_heads[] = {
+    RESPONSE_HEAD(200, "OK", "application/json"),
+    RESPONSE_HEAD(201, "Created", "application/json"),
+    RESPONSE_HEAD(400, "Bad Request", "application/json"),
+    RESPONSE_HEAD(404, "Not Found", "application/json"),
+    RESPONSE_HEAD(409, "Conflict", "application/json"),
+    RESPONSE_HEAD(500, "Internal Server Error", "application/json"),
+    RESPONSE_HEAD(200, "OK", "application/x-ndjson"),
+    RESPONSE_HEAD(200, "OK", "text/plain; version=0.0.4"),
+};
+
+static void write_response_head(struct mg_connection *c, int status_code, const char *content_type) {
+    for (size_t i = 0; i < sizeof(response_heads) / sizeof(response_heads[0]); i++) {
+        const ResponseHead *head = &response_heads[i];
+        if (head->status_code == status_code && strcmp(head->content_type, content_type) == 0) {
+            mg_send(c, head->text, head->len);
+            return;
+        }
+    }
     mg_printf(c, "HTTP/1.1 %d %s\r\n"
                  "Content-Type: %s\r\n"
-                 "Access-Control-Allow-Origin: *\r\n"
-                 "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
-                 "Access-Control-Allow-Headers: Content-Type, Authorization, X-Requested-With, Accept, Origin\r\n"
-                 "Content-Length: %d\r\n\r\n%s",
-              status_code,
-              status_code == 200 ? "OK" : 
-              status_code == 404 ? "Not Found" : "Error",
-              content_type, (int)strlen(body), body);
+                 HTTP_CORS_HEADERS
+                 "Vary: Accept-Encoding\r\n",
+              status_code, status_text(status_code), content_type);
+}
+
+// The head of the response begin_body_stream wrote last on this thread
+static ROUTES_THREAD_LOCAL size_t body_head_start = 0;
+
+#define CONTENT_LENGTH_LINE "Content-Length: " CONTENT_LENGTH_BLANK "\r\n\r\n"
+
+// Writes the response head and returns the offset where the body starts.
+// extra_headers is either empty or complete "Name: value\r\n" lines.
+static size_t begin_body_stream(struct mg_connection *c, int status_code, const char *content_type,
+                                const char *extra_headers) {
+    body_head_start = c->send.len;
+    write_response_head(c, status_code, content_type);
+    mg_send(c, extra_headers, strlen(extra_headers));
+    mg_send(c, CONTENT_LENGTH_LINE, sizeof(CONTENT_LENGTH_LINE) - 1);
+    return c->send.len;
+}
+
+static size_t begin_json_stream(struct mg_connection *c, int status_code, const char *extra_headers) {
+    return begin_body_stream(c, status_code, "application/json", extra_headers);
+}
+
+// The gzip variant of a quoted tag, e.g. "abc" becomes "abc-gzip"
+static void format_gzip_etag(char *gzip_etag, size_t size, const char *etag, size_t etag_len) {
+    snprintf(gzip_etag, size, "%.*s-gzip\"", (int)(etag_len - 1), etag);
+}
+
+// Replaces the body written since body_start with its gzip encoding when
+// the client accepts it and it shrinks. The head is written again with
+// Content-Encoding and the ETag of the gzip variant. Returns 1 if it did.
+static int gzip_body_stream(struct mg_connection *c, size_t body_start) {
+    size_t len = c->send.len - body_start;
+    size_t head_len = body_start - (sizeof(CONTENT_LENGTH_LINE) - 1) - body_head_start;
+    char head[1024];
+    if (!request_accepts_gzip || len < RESPONSE_GZIP_MIN_BYTES || head_len >= sizeof(head)) return 0;
+    size_t gzip_len;
+    char *gzipped = http_gzip_level((const char*)c->send.buf + body_start, len, RESPONSE_GZIP_LEVEL, &gzip_len);
+    if (!gzipped) return 0;
+    
+    memcpy(head, c->send.buf + body_head_start, head_len);
+    head[head_len] = '\0';
+    c->send.len = body_head_start;
+    char *etag = strstr(head, "\r\nETag: \"");
+    char *etag_end = etag ? strchr(etag + 9, '"') : NULL;
+    if (etag_end) {
+        char gzip_etag[ETAG_HEADER_SIZE];
+        etag += 8;
+        format_gzip_etag(gzip_etag, sizeof(gzip_etag), etag, (size_t)(etag_end - etag + 1));
+        mg_send(c, head, (size_t)(etag - head));
+        mg_send(c, gzip_etag, strlen(gzip_etag));
+        mg_send(c, etag_end + 1, strlen(etag_end + 1));
+    } else {
+        mg_send(c, head, head_len);
+    }
+    mg_printf(c, "Content-Encoding: gzip\r\nContent-Length: %lu\r\n\r\n", (unsigned long)gzip_len);
+    mg_send(c, gzipped, gzip_len);
+    free(gzipped);
+    return 1;
+}
+
+static void end_body_stream(struct mg_connection *c, size_t body_start) {
+    if (gzip_body_stream(c, body_start)) return;
+    char digits[CONTENT_LENGTH_WIDTH + 1];
+    int len = snprintf(digits, sizeof(digits), "%lu", (unsigned long)(c->send.len - body_start));
+    memcpy(c->send.buf + body_start - 4 - CONTENT_LENGTH_WIDTH, digits, (size_t)len);
+}
+
+// Size of the previous cJSON body on this thread, so the next one is
+// usually printed with a single allocation straight into the send buffer
+static ROUTES_THREAD_LOCAL size_t json_size_hint = 256;
+
+static void send_json_response(struct mg_connection *c, int status_code, cJSON *json, int pretty) {
+    size_t response_start = c->send.len;
+    size_t body_start = begin_json_stream(c, status_code, "");
+    
+    // cJSON_PrintPreallocated wants a few bytes of slack beyond the output
+    size_t room = json_size_hint + json_size_hint / 4 + 16;
+    for (;;) {
+        if (!mg_iobuf_resize(&c->send, body_start + room)) break;
+        if (cJSON_PrintPreallocated(json, (char*)c->send.buf + body_start, (int)room, pretty)) {
+            size_t len = strlen((char*)c->send.buf + body_start);
+            c->send.len = body_start + len;
+            json_size_hint = len;
+            end_body_stream(c, body_start);
+            return;
+        }
+        room *= 2;
+    }
+    
+    c->send.len = response_start;
+    mg_http_reply(c, 500, "", "Out of memory");
+}
+
+static void send_error_response(struct mg_connection *c, int status_code, const char *message, int pretty) {
+    cJSON *error = cJSON_CreateObject();
+    cJSON_AddStringToObject(error, "error", message);
+    send_json_response(c, status_code, error, pretty);
+    cJSON_Delete(error);
+}
+
+// Store-backed responses are tagged with the generation they were read
+// at: a user's version, or the whole store's for listings. Generations
+// restart with the process, so tags also carry its start time, and
+// indented bodies get their own tag.
+static unsigned long long etag_epoch = 0;
+
+static void format_etag(char *etag, size_t size, char kind, uint64_t generation, int pretty) {
+    snprintf(etag, size, "\"%llx-%c%llu%s\"", etag_epoch, kind, (unsigned long long)generation,
+             pretty ? "-pretty" : "");
+}
+
+// Writes "ETag: ...\r\n" for begin_body_stream's extra headers
+static void format_etag_header(char *header, size_t size, const char *etag) {
+    snprintf(header, size, "ETag: %s\r\n", etag);
+}
+
+// Answers 304 without rendering anything when the client already holds
+// this tag, or its gzip variant if it accepts gzip. Returns 1 if it did.
+static int send_not_modified(struct mg_connection *c, struct mg_http_message *hm, const char *etag) {
+    char gzip_etag[ETAG_HEADER_SIZE];
+    if (!http_etag_matches(hm, etag)) {
+        if (!request_accepts_gzip) return 0;
+        format_gzip_etag(gzip_etag, sizeof(gzip_etag), etag, strlen(etag));
+        if (!http_etag_matches(hm, gzip_etag)) return 0;
+        etag = gzip_etag;
+    }
+    static const char head[] = "HTTP/1.1 304 Not Modified\r\n" HTTP_CORS_HEADERS "Vary: Accept-Encoding\r\nETag: ";
+    mg_send(c, head, sizeof(head) - 1);
+    mg_send(c, etag, strlen(etag));
+    mg_send(c, "\r\n\r\n", 4);
+    return 1;
+}
+
+static void send_user_response(struct mg_connection *c, int status_code, const User *user, int pretty) {
+    char etag[64];
+    char header[ETAG_HEADER_SIZE];
+    format_etag(etag, sizeof(etag), 'u', user->version, pretty);
+    format_etag_header(header, sizeof(header), etag);
+    size_t response_start = c->send.len;
+    size_t body_start = begin_json_stream(c, status_code, header);
+    if (!json_write_user(&c->send, user, pretty, 0)) {
+        c->send.len = response_start;
+        send_error_response(c, 500, "Out of memory", pretty);
+        return;
+    }
+    end_body_stream(c, body_start);
+}
+
+// Chunk sizes are patched in after the chunk is written, like
+// Content-Length; leading zeros are allowed in a chunk-size. The blank
+// holds 8 hex digits, far more than a batch of users needs, and a chunk
+// that outgrows them fails instead of going out with a wrong size.
+#define CHUNK_SIZE_BLANK "00000000\r\n"
+#define CHUNK_MAX_BYTES 0xFFFFFFFFu
+
+static size_t begin_chunk(struct mg_connection *c) {
+    if (!json_write_raw(&c->send, CHUNK_SIZE_BLANK, sizeof(CHUNK_SIZE_BLANK) - 1)) return 0;
+    return c->send.len;
+}
+
+static int end_chunk(struct mg_connection *c, size_t chunk_start) {
+    size_t size = c->send.len - chunk_start;
+    if (size > CHUNK_MAX_BYTES) return 0;
+    char digits[17];    // room for any unsigned long, so no truncation
+    snprintf(digits, sizeof(digits), "%08lx", (unsigned long)size);
+    memcpy(c->send.buf + chunk_start - sizeof(CHUNK_SIZE_BLANK) + 1, digits, 8);
+    return json_write_raw(&c->send, "\r\n", 2);
+}
+
+static void free_pending_body(struct PendingBody *body);
+
+// Stops a dump, dropping its compressor, or a cached body being written.
+// Also used when the connection or a worker's result goes away midway.
+static void end_user_stream(UserStream *stream) {
+    stream->active = 0;
+    http_gzip_stream_free(stream->gzip);
+    stream->gzip = NULL;
+    free_pending_body(stream->body);
+    stream->body = NULL;
+}
+
+// Writes the next batch of a GET /users dump as one chunk, but only once
+// the socket has drained the previous ones, so a dump holds at most a
+// batch plus the low-water mark in memory however large the store is.
+// After the last user the array is closed and the final chunk sent.
+// Gzipped dumps render batches aside until the compressor has output
+// ready: an empty write would leave nothing for the socket to drain, and
+// the next batch would wait for the event loop's idle poll.
+static void continue_user_stream(struct mg_connection *c) {
+    UserStream *stream = (UserStream*)c->data;
+    if (!stream->active || c->send.len > USERS_STREAM_LOW_WATER) return;
+    
+    size_t chunk_start = begin_chunk(c);
+    int ok = chunk_start != 0;
+    int next_after = 0;
+    do {
+        User *batch[USERS_STREAM_BATCH];
+        size_t count = get_users_page(stream->after, USERS_STREAM_BATCH, batch, &next_after);
+        struct mg_iobuf plain = { NULL, 0, 0, 0 };
+        struct mg_iobuf *out = stream->gzip ? &plain : &c->send;
+        if (stream->ndjson) {
+            for (size_t i = 0; ok && i < count; i++) {
+                ok = json_write_user(out, batch[i], 0, 0) && json_write_raw(out, "\n", 1);
+            }
+        } else {
+            if (ok && stream->first) ok = json_write_raw(out, "[", 1);
+            if (ok) ok = json_write_list_items(out, batch, count, stream->pretty, stream->first);
+            if (ok && !next_after) ok = json_write_raw(out, "]", 1);
+        }
+        if (ok && stream->gzip) {
+            ok = http_gzip_stream_write(stream->gzip, (const char*)plain.buf, plain.len, !next_after, &c->send);
+        }
+        mg_iobuf_free(&plain);
+        
+        if (count > 0) {
+            stream->after = batch[count - 1]->id;
+            stream->first = 0;
+        }
+        for (size_t i = 0; i < count; i++) {
+            release_user(batch[i]);
+        }
+    } while (ok && stream->gzip && next_after && c->send.len == chunk_start);
+    if (ok && c->send.len == chunk_start) {
+        // An empty chunk would end the body early
+        c->send.len = chunk_start - (sizeof(CHUNK_SIZE_BLANK) - 1);
+    } else if (ok) {
+        ok = end_chunk(c, chunk_start);
+    }
+    
+    if (!ok) {
+        // Too late for an error status; drop the connection instead
+        end_user_stream(stream);
+        c->is_closing = 1;
+    } else if (!next_after) {
+        mg_http_write_chunk(c, "", 0);
+        end_user_stream(stream);
+        c->is_resp = 0;
+    }
+}
+
+// The full list is sent with chunked encoding from the event loop, so the
+// first bytes go out immediately and later batches follow as it drains.
+// etag may be NULL.
+static void start_user_stream(struct mg_connection *c, const char *content_type, const char *etag,
+                              int pretty, int ndjson) {
+    UserStream *stream = (UserStream*)c->data;
+    stream->gzip = request_accepts_gzip ? http_gzip_stream_new(RESPONSE_GZIP_LEVEL) : NULL;
+    char headers[ETAG_HEADER_SIZE + 32] = "";
+    if (stream->gzip) {
+        char gzip_etag[ETAG_HEADER_SIZE];
+        strcpy(headers, "Content-Encoding: gzip\r\n");
+        if (etag) {
+            format_gzip_etag(gzip_etag, sizeof(gzip_etag), etag, strlen(etag));
+            format_etag_header(headers + strlen(headers), sizeof(headers) - strlen(headers), gzip_etag);
+        }
+    } else if (etag) {
+        format_etag_header(headers, sizeof(headers), etag);
+    }
+    static const char chunked[] = "Transfer-Encoding: chunked\r\n\r\n";
+    write_response_head(c, 200, content_type);
+    mg_send(c, headers, strlen(headers));
+    mg_send(c, chunked, sizeof(chunked) - 1);
+    // Pipelined requests wait until the last chunk is out
+    c->is_resp = 1;
+    stream->active = 1;
+    stream->after = 0;
+    stream->pretty = pretty;
+    stream->first = 1;
+    stream->ndjson = ndjson;
+    continue_user_stream(c);
+}
+
+// The last full GET /users body, compact and indented, rendered with a
+// gzip variant and tagged with the store generation it was read at. Any
+// write moves the generation on, which is what invalidates an entry: the
+// next list read renders a new one. Until then every connection is sent
+// the same buffer, so a burst of reads renders once and then never takes
+// a store lock. Entries are immutable and refcounted, so one can be
+// replaced while other threads are still sending it.
+typedef struct ListCacheEntry {
+    CachedResponse response;    // empty if the body was over the size limit
+    uint64_t generation;
+    int refs;                   // guarded by list_cache_lock
+} ListCacheEntry;
+
+// Larger stores are streamed instead; an entry holds both encodings
+#define LIST_CACHE_MAX_BYTES (8 * 1024 * 1024)
+
+static ListCacheEntry *list_cache[2];
+static routes_mutex_t list_cache_lock = ROUTES_MUTEX_INIT;
+// Held while rendering, so readers of a stale entry wait for one render
+// rather than all doing their own
+static routes_mutex_t list_render_lock = ROUTES_MUTEX_INIT;
+
+static ListCacheEntry* acquire_fresh_list_cache(uint64_t generation, int pretty) {
+    routes_mutex_lock(&list_cache_lock);
+    ListCacheEntry *entry = list_cache[pretty];
+    if (entry && entry->generation == generation) {
+        entry->refs++;
+    } else {
+        entry = NULL;
+    }
+    routes_mutex_unlock(&list_cache_lock);
+    return entry;
+}
+
+static void release_list_cache(ListCacheEntry *entry) {
+    if (!entry) return;
+    routes_mutex_lock(&list_cache_lock);
+    int refs = --entry->refs;
+    routes_mutex_unlock(&list_cache_lock);
+    if (refs == 0) {
+        cached_response_free(&entry->response);
+        free(entry);
+    }
+}
+
+static void publish_list_cache(ListCacheEntry *entry, int pretty) {
+    routes_mutex_lock(&list_cache_lock);
+    ListCacheEntry *old = list_cache[pretty];
+    list_cache[pretty] = entry;
+    routes_mutex_unlock(&list_cache_lock);
+    release_list_cache(old);
+}
+
+// Renders the whole list into io a page at a time, as the stream would.
+// Returns 1 when done, 0 when out of memory and -1 once the body grows
+// past the cache limit.
+static int render_user_list(struct mg_iobuf *io, int pretty) {
+    User *batch[USERS_STREAM_BATCH];
+    int after = 0;
+    int ok = json_write_raw(io, "[", 1);
+    for (int first = 1; ok; first = 0) {
+        int next_after = 0;
+        size_t count = get_users_page(after, USERS_STREAM_BATCH, batch, &next_after);
+        ok = json_write_list_items(io, batch, count, pretty, first);
+        if (count > 0) after = batch[count - 1]->id;
+        for (size_t i = 0; i < count; i++) {
+            release_user(batch[i]);
+        }
+        if (ok && io->len > LIST_CACHE_MAX_BYTES) return -1;
+        if (!next_after) break;
+    }
+    return ok && json_write_raw(io, "]", 1);
+}
+
+// Returns a referenced entry for this generation, rendering it if needed,
+// or NULL if it could not be built. The body may include writes made
+// after the generation was read; tagging it with the older generation
+// only means it is replaced sooner. The gzip variant is only built when
+// the request that renders the entry accepts it, so clients that never
+// ask for gzip never pay for it; until the next write the others are
+// then sent the identity body.
+static ListCacheEntry* get_list_cache(uint64_t generation, const char *etag, int pretty, int gzip) {
+    ListCacheEntry *entry = acquire_fresh_list_cache(generation, pretty);
+    if (entry) return entry;
+    
+    routes_mutex_lock(&list_render_lock);
+    entry = acquire_fresh_list_cache(generation, pretty);
+    if (!entry && (entry = (ListCacheEntry*)calloc(1, sizeof(ListCacheEntry))) != NULL) {
+        struct mg_iobuf io = { .align = 16 * 1024 };
+        // An oversized body leaves the entry empty, so this generation is
+        // streamed without trying again
+        int ok = render_user_list(&io, pretty);
+        if (ok > 0) {
+            ok = cached_response_build_tagged(&entry->response, "application/json", (const char*)io.buf, io.len,
+                                              etag, gzip ? RESPONSE_GZIP_LEVEL : 0);
+        }
+        if (!ok) {
+            free(entry);
+            entry = NULL;
+        } else {
+            // One reference for the cache and one for the caller
+            entry->generation = generation;
+            entry->refs = 2;
+            publish_list_cache(entry, pretty);
+        }
+        mg_iobuf_free(&io);
+    }
+    routes_mutex_unlock(&list_render_lock);
+    return entry;
+}
+
+// Cached bodies at least this large are handed to the socket straight
+// from the cache behind their head; smaller ones are cheaper to copy into
+// the send buffer. While the socket is full, a slice of the body is queued
+// instead so the event loop reports when it drains.
+#define DIRECT_BODY_MIN_BYTES (64 * 1024)
+#define DIRECT_BODY_SLICE (16 * 1024)
+
+// A cached body still being written. The connection holds the list cache
+// entry it came from, if any, until the last byte is out; the static pages
+// live as long as the routes.
+typedef struct PendingBody {
+    ListCacheEntry *entry;
+    const char *data;
+    size_t len;
+    size_t sent;
+} PendingBody;
+
+static void free_pending_body(PendingBody *body) {
+    if (!body) return;
+    release_list_cache(body->entry);
+    free(body);
+}
+
+// Sends a cached response, taking over the caller's reference to entry
+// (which may be NULL). Only the head of a large body is put in the send
+// buffer; continue_pending_body writes the body itself from the event loop.
+static void send_cached_response(struct mg_connection *c, struct mg_http_message *hm,
+                                 const CachedResponse *response, ListCacheEntry *entry) {
+    const CachedVariant *variant = cached_response_variant(hm, response);
+    PendingBody *body = NULL;
+    if (variant && variant->message_len - variant->head_len >= DIRECT_BODY_MIN_BYTES &&
+        !http_etag_matches(hm, variant->etag)) {
+        body = (PendingBody*)malloc(sizeof(PendingBody));
+    }
+    if (!body) {
+        cached_response_send(c, hm, response);
+        release_list_cache(entry);
+        return;
+    }
+    
+    body->entry = entry;
+    body->data = variant->message + variant->head_len;
+    body->len = variant->message_len - variant->head_len;
+    body->sent = 0;
+    mg_send(c, variant->message, variant->head_len);
+    ((UserStream*)c->data)->body = body;
+    // Pipelined requests wait until the body is out
+    c->is_resp = 1;
+}
+
+#ifdef MSG_NOSIGNAL
+#define GATHER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define GATHER_SEND_FLAGS 0
+#endif
+
+// Hands what is queued in c->send followed by len bytes of data to the
+// socket in one gathered write. Returns the bytes taken, 0 if the socket
+// is full, or -1 if it failed.
+static long send_gathered(struct mg_connection *c, const char *data, size_t len) {
+    int skip = c->send.len == 0;
+#ifdef _WIN32
+    WSABUF bufs[2];
+    DWORD sent = 0;
+    bufs[0].buf = (char*)c->send.buf;
+    bufs[0].len = (ULONG)c->send.len;
+    bufs[1].buf = (char*)data;
+    bufs[1].len = (ULONG)len;
+    if (WSASend((SOCKET)(size_t)c->fd, bufs + skip, (DWORD)(2 - skip), &sent, 0, NULL, NULL) == 0) {
+        return (long)sent;
+    }
+    return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+#else
+    struct iovec iov[2];
+    struct msghdr msg;
+    iov[0].iov_base = c->send.buf;
+    iov[0].iov_len = c->send.len;
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov + skip;
+    msg.msg_iovlen = (size_t)(2 - skip);
+    ssize_t n = sendmsg((int)(size_t)c->fd, &msg, GATHER_SEND_FLAGS);
+    if (n >= 0) return (long)n;
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+#endif
+}
+
+// Writes as much of a pending body as the socket takes, together with
+// anything queued ahead of it. Without a plain socket to write to (TLS,
+// or a detached connection) the rest is copied into the send buffer at
+// once, as smaller bodies are.
+static void continue_pending_body(struct mg_connection *c) {
+    UserStream *stream = (UserStream*)c->data;
+    PendingBody *body = stream->body;
+    if (!body) return;
+    
+    int direct = c->fd != NULL && !c->is_tls;
+    if (direct) {
+        long n = send_gathered(c, body->data + body->sent, body->len - body->sent);
+        if (n < 0) {
+            end_user_stream(stream);
+            c->is_closing = 1;
+            return;
+        }
+        size_t queued = (size_t)n < c->send.len ? (size_t)n : c->send.len;
+        mg_iobuf_del(&c->send, 0, queued);
+        body->sent += (size_t)n - queued;
+    }
+    
+    size_t rest = body->len - body->sent;
+    if (rest > 0 && (!direct || c->send.len == 0)) {
+        size_t slice = direct && rest > DIRECT_BODY_SLICE ? DIRECT_BODY_SLICE : rest;
+        if (!mg_send(c, body->data + body->sent, slice)) {
+            end_user_stream(stream);
+            c->is_closing = 1;
+            return;
+        }
+        body->sent += slice;
+    }
+    if (body->sent == body->len) {
+        end_user_stream(stream);
+        c->is_resp = 0;
+    }
 }
 
-static void handle_get_users(struct mg_connection *c) {
-    cJSON *users = get_all_users();
-    send_json_response(c, 200, users);
-    cJSON_Delete(users);
+// Any write after the generation is read moves it on, so a matching tag
+// means the body would come out the same
+static void handle_get_users(struct mg_connection *c, struct mg_http_message *hm, int pretty) {
+    char etag[64];
+    uint64_t generation = users_generation();
+    format_etag(etag, sizeof(etag), 'g', generation, pretty);
+    if (send_not_modified(c, hm, etag)) return;
+    
+    ListCacheEntry *entry = get_list_cache(generation, etag, pretty, request_accepts_gzip);
+    if (entry && entry->response.identity.message) {
+        send_cached_response(c, hm, &entry->response, entry);
+        return;
+    }
+    release_list_cache(entry);
+    start_user_stream(c, "application/json", etag, pretty, 0);
+}
+
+// GET /users/export: the same stream as NDJSON, one compact user per line
+static void handle_export_users(struct mg_connection *c) {
+    start_user_stream(c, "application/x-ndjson", NULL, 0, 1);
+}
+
+// One page of users starting after the given id. When more remain, the
+// next page is advertised in a Link header so the body stays a plain array.
+static void handle_get_users_page(struct mg_connection *c, struct mg_http_message *hm, int after, int limit,
+                                  int pretty) {
+    char etag[64];
+    format_etag(etag, sizeof(etag), 'g', users_generation(), pretty);
+    if (send_not_modified(c, hm, etag)) return;
+    
+    User *page[USERS_PAGE_MAX];
+    int next_after = 0;
+    size_t count = get_users_page(after, (size_t)limit, page, &next_after);
+    
+    char link[128 + ETAG_HEADER_SIZE] = "";
+    int len = 0;
+    if (next_after) {
+        len = snprintf(link, sizeof(link),
+                       "Link: </users?after=%d&limit=%d%s>; rel=\"next\"\r\n"
+                       "Access-Control-Expose-Headers: Link\r\n",
+                       next_after, limit, pretty ? "&pretty=1" : "");
+    }
+    format_etag_header(link + len, sizeof(link) - (size_t)len, etag);
+    
+    size_t response_start = c->send.len;
+    size_t body_start = begin_json_stream(c, 200, link);
+    int ok = json_write_users(&c->send, page, count, pretty);
+    for (size_t i = 0; i < count; i++) {
+        release_user(page[i]);
+    }
+    if (!ok) {
+        c->send.len = response_start;
+        send_error_response(c, 500, "Out of memory", pretty);
+        return;
+    }
+    end_body_stream(c, body_start);
 }
 
-static void handle_get_user(struct mg_connection *c, int user_id) {
-    User *user = get_user_by_id(user_id);
+// Records never change once published, so a user's tag is its version
+static void send_found_user(struct mg_connection *c, struct mg_http_message *hm, User *user, int pretty) {
     if (user == NULL) {
-        cJSON *error = cJSON_CreateObject();
-        cJSON_AddStringToObject(error, "error", "User not found");
-        send_json_response(c, 404, error);
-        cJSON_Delete(error);
+        send_error_response(c, 404, "User not found", pretty);
         return;
     }
     
-    cJSON *user_json = user_to_json(user);
-    send_json_response(c, 200, user_json);
-    cJSON_Delete(user_json);
+    char etag[64];
+    format_etag(etag, sizeof(etag), 'u', user->version, pretty);
+    if (!send_not_modified(c, hm, etag)) send_user_response(c, 200, user, pretty);
+    release_user(user);
+}
+
+static void handle_get_user_by_email(struct mg_connection *c, struct mg_http_message *hm, const char *email,
+                                     int pretty) {
+    send_found_user(c, hm, get_user_by_email(email), pretty);
+}
+
+static void handle_get_user(struct mg_connection *c, struct mg_http_message *hm, int user_id, int pretty) {
+    send_found_user(c, hm, get_user_by_id(user_id), pretty);
+}
+
+// Fills in name and email from a UserInput body. Most bodies are read by
+// the allocation-free parser; the rest go through cJSON, which also decides
+// whether they are valid. Free *json once the strings are no longer used.
+static int read_user_input(struct mg_str body, UserInput *input, cJSON **json) {
+    *json = NULL;
+    if (json_read_user_input(body.buf, body.len, input)) return 1;
+    
+    *json = cJSON_ParseWithLength(body.buf, body.len);
+    if (*json == NULL) return 0;
+    cJSON *name = cJSON_GetObjectItem(*json, "name");
+    cJSON *email = cJSON_GetObjectItem(*json, "email");
+    input->name = cJSON_IsString(name) ? name->valuestring : NULL;
+    input->email = cJSON_IsString(email) ? email->valuestring : NULL;
+    return 1;
 }
 
-static void handle_create_user(struct mg_connection *c, const char *data) {
-    cJSON *json = cJSON_Parse(data);
-    if (json == NULL) {
-        cJSON *error = cJSON_CreateObject();
-        cJSON_AddStringToObject(error, "error", "Invalid JSON");
-        send_json_response(c, 400, error);
-        cJSON_Delete(error);
+static void handle_create_user(struct mg_connection *c, struct mg_str body, int pretty) {
+    UserInput input;
+    cJSON *json;
+    if (!read_user_input(body, &input, &json)) {
+        send_error_response(c, 400, "Invalid JSON", pretty);
         return;
     }
     
-    cJSON *name = cJSON_GetObjectItem(json, "name");
-    cJSON *email = cJSON_GetObjectItem(json, "email");
+    if (input.name == NULL || input.email == NULL) {
+        send_error_response(c, 400, "Missing name or email", pretty);
+        cJSON_Delete(json);
+        return;
+    }
     
-    if (!cJSON_IsString(name) || !cJSON_IsString(email)) {
-        cJSON *error = cJSON_CreateObject();
-        cJSON_AddStringToObject(error, "error", "Missing name or email");
-        send_json_response(c, 400, error);
-        cJSON_Delete(error);
+    User *user = create_user(input.name, input.email);
+    if (user == NULL) {
+        if (users_last_error() == USER_ERR_EMAIL_TAKEN) {
+            send_error_response(c, 409, "Email already in use", pretty);
+        } else {
+            send_error_response(c, 400, "Could not create user", pretty);
+        }
         cJSON_Delete(json);
         return;
     }
     
-    User *user = create_user(name->valuestring, email->valuestring);
-    cJSON *user_json = user_to_json(user);
-    send_json_response(c, 201, user_json);
-    cJSON_Delete(user_json);
+    send_user_response(c, 201, user, pretty);
+    release_user(user);
     cJSON_Delete(json);
 }
 
-static void handle_update_user(struct mg_connection *c, int user_id, const char *data) {
+static void handle_update_user(struct mg_connection *c, int user_id, struct mg_str body, int pretty) {
     User *existing_user = get_user_by_id(user_id);
     if (existing_user == NULL) {
-        cJSON *error = cJSON_CreateObject();
-        cJSON_AddStringToObject(error, "error", "User not found");
-        send_json_response(c, 404, error);
-        cJSON_Delete(error);
+        send_error_response(c, 404, "User not found", pretty);
         return;
     }
+    release_user(existing_user);
     
-    cJSON *json = cJSON_Parse(data);
-    if (json == NULL) {
-        cJSON *error = cJSON_CreateObject();
-        cJSON_AddStringToObject(error, "error", "Invalid JSON");
-        send_json_response(c, 400, error);
-        cJSON_Delete(error);
+    UserInput input;
+    cJSON *json;
+    if (!read_user_input(body, &input, &json)) {
+        send_error_response(c, 400, "Invalid JSON", pretty);
         return;
     }
     
-    cJSON *name = cJSON_GetObjectItem(json, "name");
-    cJSON *email = cJSON_GetObjectItem(json, "email");
-    
-    if (cJSON_IsString(name)) {
-        strncpy(existing_user->name, name->valuestring, sizeof(existing_user->name) - 1);
-        existing_user->name[sizeof(existing_user->name) - 1] = '\0';
-    }
-    if (cJSON_IsString(email)) {
-        strncpy(existing_user->email, email->valuestring, sizeof(existing_user->email) - 1);
-        existing_user->email[sizeof(existing_user->email) - 1] = '\0';
+    User *user = update_user(user_id, input.name, input.email);
+    if (user == NULL) {
+        UserError err = users_last_error();
+        if (err == USER_ERR_EMAIL_TAKEN) {
+            send_error_response(c, 409, "Email already in use", pretty);
+        } else if (err == USER_ERR_NOT_FOUND) {
+            send_error_response(c, 404, "User not found", pretty);
+        } else {
+            send_error_response(c, 400, "Could not update user", pretty);
+        }
+        cJSON_Delete(json);
+        return;
     }
     
-    cJSON *user_json = user_to_json(existing_user);
-    send_json_response(c, 200, user_json);
-    cJSON_Delete(user_json);
+    send_user_response(c, 200, user, pretty);
+    release_user(user);
     cJSON_Delete(json);
 }
 
-static void handle_delete_user(struct mg_connection *c, int user_id) {
+static void handle_delete_user(struct mg_connection *c, int user_id, int pretty) {
     if (!delete_user(user_id)) {
-        cJSON *error = cJSON_CreateObject();
-        cJSON_AddStringToObject(error, "error", "User not found");
-        send_json_response(c, 404, error);
-        cJSON_Delete(error);
+        send_error_response(c, 404, "User not found", pretty);
         return;
     }
     
     cJSON *success = cJSON_CreateObject();
     cJSON_AddStringToObject(success, "message", "User deleted successfully");
-    send_json_response(c, 200, success);
+    send_json_response(c, 200, success, pretty);
     cJSON_Delete(success);
 }
 
-static void handle_swagger_ui(struct mg_connection *c) {
-    char *html = get_swagger_ui();
-    send_text_response(c, 200, "text/html", html);
+// POST /users/_bulk reads operations a slice at a time: each slice goes to
+// the store as one batch and its results are written before the next is
+// parsed, so NDJSON bodies never hold more than a slice of parsed lines
+#define BULK_SLICE 256
+
+typedef struct BulkSlice {
+    UserOp ops[BULK_SLICE];
+    const char *rejected[BULK_SLICE];   // why an item never reached the store
+    UserInput inputs[BULK_SLICE];       // NDJSON lines read without cJSON
+    cJSON *lines[BULK_SLICE];           // NDJSON lines cJSON had to parse
+    size_t count;
+} BulkSlice;
+
+// Whether a JSON number names a user: a whole number in 1..INT_MAX. The
+// range is checked first, since casting a double outside it is undefined.
+static int json_number_is_user_id(double id) {
+    return id >= 1 && id <= INT_MAX && id == (double)(int)id;
 }
 
-static void handle_swagger_json(struct mg_connection *c) {
-    char *json = get_swagger_json();
-    send_text_response(c, 200, "application/json", json);
-    free(json);
+// Returns why the item is unusable, or NULL once op is filled in. Fields
+// are NULL, and has_id 0, when absent; mistyped ones never get here.
+static const char* fill_bulk_op(UserOp *op, const char *kind, int has_id, double id,
+                                const char *name, const char *email) {
+    memset(op, 0, sizeof(*op));
+    if (!kind) return "Missing op";
+    op->name = name;
+    op->email = email;
+    
+    if (strcmp(kind, "create") == 0) {
+        op->type = USER_OP_CREATE;
+        return op->name && op->email ? NULL : "Missing name or email";
+    }
+    if (!has_id || !json_number_is_user_id(id)) return "Missing id";
+    op->id = (int)id;
+    if (strcmp(kind, "update") == 0) {
+        op->type = USER_OP_UPDATE;
+        return NULL;
+    }
+    if (strcmp(kind, "delete") == 0) {
+        op->type = USER_OP_DELETE;
+        return NULL;
+    }
+    return "Unknown op";
 }
 
-void handle_mongoose_request(struct mg_connection *c, int ev, void *ev_data) {
-    if (ev == MG_EV_HTTP_MSG) {
-        struct mg_http_message *hm = (struct mg_http_message *) ev_data;
-        
-        // Log incoming request
-        printf("Incoming HTTP request received\n");
-        fflush(stdout);
-        
-        // Handle CORS preflight
-        if (mg_strcmp(hm->method, mg_str("OPTIONS")) == 0) {
-            printf("Handling OPTIONS request\n");
-            fflush(stdout);
-            mg_printf(c, "HTTP/1.1 200 OK\r\n"
-                        "Access-Control-Allow-Origin: *\r\n"
-                        "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
-                        "Access-Control-Allow-Headers: Content-Type, Authorization, X-Requested-With, Accept, Origin\r\n"
-                        "Access-Control-Max-Age: 86400\r\n"
-                        "Content-Length: 0\r\n\r\n");
+static const char* parse_bulk_op(const cJSON *item, UserOp *op) {
+    const cJSON *kind = cJSON_GetObjectItem(item, "op");
+    const cJSON *id = cJSON_GetObjectItem(item, "id");
+    const cJSON *name = cJSON_GetObjectItem(item, "name");
+    const cJSON *email = cJSON_GetObjectItem(item, "email");
+    if (!cJSON_IsObject(item) || !cJSON_IsString(kind)) return "Missing op";
+    if ((name && !cJSON_IsString(name)) || (email && !cJSON_IsString(email))) return "Invalid name or email";
+    return fill_bulk_op(op, kind->valuestring, cJSON_IsNumber(id), cJSON_IsNumber(id) ? id->valuedouble : 0,
+                        name ? name->valuestring : NULL, email ? email->valuestring : NULL);
+}
+
+// One element of the result array: the status the single-user endpoint
+// would have answered with, plus the user or an error message
+static int write_bulk_result(struct mg_iobuf *io, const UserOp *op, const char *rejected, int pretty, int first) {
+    int status = 200;
+    const char *error = rejected;
+    if (rejected) {
+        status = 400;
+    } else if (op->error == USER_OK) {
+        status = op->type == USER_OP_CREATE ? 201 : 200;
+    } else if (op->error == USER_ERR_EMAIL_TAKEN) {
+        status = 409;
+        error = "Email already in use";
+    } else if (op->error == USER_ERR_NOT_FOUND) {
+        status = 404;
+        error = "User not found";
+    } else if (op->error == USER_ERR_INVALID) {
+        status = 400;
+        error = "Missing name or email";
+    } else {
+        status = 500;
+        error = "Out of memory";
+    }
+    
+    char head[32];
+    int head_len = snprintf(head, sizeof(head), pretty ? "{\n\t\t\"status\":\t%d" : "{\"status\":%d", status);
+    int ok = 1;
+    if (!first) ok &= pretty ? json_write_raw(io, ", ", 2) : json_write_raw(io, ",", 1);
+    ok &= json_write_raw(io, head, (size_t)head_len);
+    if (error) {
+        const char *key = pretty ? ",\n\t\t\"error\":\t" : ",\"error\":";
+        ok &= json_write_raw(io, key, strlen(key));
+        ok &= json_write_string(io, error);
+    } else if (op->user) {
+        const char *key = pretty ? ",\n\t\t\"user\":\t" : ",\"user\":";
+        ok &= json_write_raw(io, key, strlen(key));
+        ok &= json_write_user(io, op->user, pretty, 2);
+    }
+    ok &= pretty ? json_write_raw(io, "\n\t}", 3) : json_write_raw(io, "}", 1);
+    return ok;
+}
+
+// Applies the valid items of a slice in one batch, writes every result and
+// empties the slice
+static int flush_bulk_slice(struct mg_iobuf *io, BulkSlice *slice, int pretty, size_t *written) {
+    UserOp batch[BULK_SLICE];
+    size_t valid = 0;
+    for (size_t i = 0; i < slice->count; i++) {
+        if (!slice->rejected[i]) batch[valid++] = slice->ops[i];
+    }
+    apply_user_batch(batch, valid);
+    
+    int ok = 1;
+    valid = 0;
+    for (size_t i = 0; i < slice->count; i++) {
+        if (!slice->rejected[i]) slice->ops[i] = batch[valid++];
+        ok &= write_bulk_result(io, &slice->ops[i], slice->rejected[i], pretty, *written == 0);
+        (*written)++;
+        release_user(slice->ops[i].user);
+        cJSON_Delete(slice->lines[i]);
+    }
+    slice->count = 0;
+    return ok;
+}
+
+static void handle_bulk_users(struct mg_connection *c, struct mg_str body, int pretty) {
+    size_t pos = 0;
+    while (pos < body.len && isspace((unsigned char)body.buf[pos])) pos++;
+    cJSON *array = NULL;
+    if (pos < body.len && body.buf[pos] == '[') {
+        array = cJSON_ParseWithLength(body.buf, body.len);
+        if (!cJSON_IsArray(array)) {
+            cJSON_Delete(array);
+            send_error_response(c, 400, "Invalid JSON", pretty);
             return;
         }
-        
-        // Swagger UI
-        if (mg_match(hm->uri, mg_str("/swagger"), NULL) || 
-            mg_match(hm->uri, mg_str("/"), NULL)) {
-            printf("Serving Swagger UI\n");
-            fflush(stdout);
-            handle_swagger_ui(c);
-            return;
+    }
+    
+    BulkSlice *slice = (BulkSlice*)malloc(sizeof(BulkSlice));
+    if (!slice) {
+        cJSON_Delete(array);
+        send_error_response(c, 500, "Out of memory", pretty);
+        return;
+    }
+    slice->count = 0;
+    size_t response_start = c->send.len;
+    size_t body_start = begin_json_stream(c, 200, "");
+    int ok = json_write_raw(&c->send, "[", 1);
+    size_t written = 0;
+    const cJSON *element = array ? array->child : NULL;
+    for (;;) {
+        size_t n = slice->count;
+        slice->lines[n] = NULL;
+        if (array) {
+            if (!element) break;
+            slice->rejected[n] = parse_bulk_op(element, &slice->ops[n]);
+            element = element->next;
+        } else {
+            // NDJSON: one object per line, blank lines ignored. Plain lines
+            // are read in place; cJSON only sees the rest.
+            if (pos >= body.len) break;
+            const char *start = body.buf + pos;
+            const char *end = (const char*)memchr(start, '\n', body.len - pos);
+            size_t len = end ? (size_t)(end - start) : body.len - pos;
+            pos += len + 1;
+            while (len > 0 && isspace((unsigned char)start[len - 1])) len--;
+            if (len == 0) continue;
+            UserInput *input = &slice->inputs[n];
+            if (json_read_user_input(start, len, input) && !input->mistyped) {
+                slice->rejected[n] = fill_bulk_op(&slice->ops[n], input->op, input->has_id, input->id,
+                                                  input->name, input->email);
+            } else {
+                slice->lines[n] = cJSON_ParseWithLength(start, len);
+                slice->rejected[n] = slice->lines[n] ? parse_bulk_op(slice->lines[n], &slice->ops[n]) : "Invalid JSON";
+            }
         }
         
-        // Simple test page
-        if (mg_match(hm->uri, mg_str("/test"), NULL)) {
-            printf("Serving test page\n");
-            fflush(stdout);
-            const char* test_html = 
-                "<!DOCTYPE html><html><head><title>API Test</title></head><body>"
-                "<h1>API Test Page</h1>"
-                "<button id=\"testBtn\" onclick=\"testAPI()\">Test GET /users</button>"
-                "<button id=\"simpleBtn\" onclick=\"window.location.href='/users'\">Direct Link Test</button>"
-                "<div id=\"result\">Click the button to test the API</div>"
-                "<script>"
-                "console.log('Test page loaded');"
-                "function testAPI() {"
-                "  console.log('Button clicked - Testing API...');"
-                "  document.getElementById('result').innerHTML = 'Making request to /users...';"
-                "  "
-                "  var xhr = new XMLHttpRequest();"
-                "  xhr.open('GET', '/users', true);"
-                "  xhr.setRequestHeader('Accept', 'application/json');"
-                "  xhr.timeout = 10000; // 10 second timeout"
-                "  "
-                "  xhr.onloadstart = function() {"
-                "    console.log('Request started');"
-                "    document.getElementById('result').innerHTML = 'Request started...';"
-                "  };"
-                "  "
-                "  xhr.onload = function() {"
-                "    console.log('Response received:', xhr.status, xhr.statusText);"
-                "    document.getElementById('result').innerHTML = 'Got response: ' + xhr.status + ' ' + xhr.statusText + '<br>Data:<br><pre>' + xhr.responseText + '</pre>';"
-                "  };"
-                "  "
-                "  xhr.onerror = function() {"
-                "    console.error('Network error');"
-                "    document.getElementById('result').innerHTML = 'Network error occurred';"
-                "  };"
-                "  "
-                "  xhr.ontimeout = function() {"
-                "    console.error('Request timed out');"
-                "    document.getElementById('result').innerHTML = 'Request timed out after 10 seconds';"
-                "  };"
-                "  "
-                "  xhr.send();"
-                "}"
-                "</script></body></html>";
-            send_text_response(c, 200, "text/html", test_html);
-            return;
+        if (slice->rejected[n]) memset(&slice->ops[n], 0, sizeof(slice->ops[n]));
+        if (++slice->count == BULK_SLICE) ok &= flush_bulk_slice(&c->send, slice, pretty, &written);
+    }
+    ok &= flush_bulk_slice(&c->send, slice, pretty, &written);
+    ok &= json_write_raw(&c->send, "]", 1);
+    free(slice);
+    cJSON_Delete(array);
+    
+    if (!ok || written == 0) {
+        c->send.len = response_start;
+        if (ok) {
+            send_error_response(c, 400, "No operations", pretty);
+        } else {
+            send_error_response(c, 500, "Out of memory", pretty);
         }
-        
-        // Swagger JSON
-        if (mg_match(hm->uri, mg_str("/swagger.json"), NULL)) {
-            handle_swagger_json(c);
+        return;
+    }
+    end_body_stream(c, body_start);
+}
+
+// POST /users/import takes NDJSON users and applies them a slice at a
+// time as lines complete. Only the slice and one partial line are held,
+// however large the body is.
+#define IMPORT_MAX_LINE (64 * 1024)
+
+typedef struct UserImport {
+    BulkSlice slice;
+    char partial[IMPORT_MAX_LINE];  // a line whose end has not arrived yet
+    size_t partial_len;
+    int overlong;                   // the current line is past IMPORT_MAX_LINE
+    int pretty;
+    size_t imported;
+    size_t failed;
+    // Set when the body is read straight off the socket
+    mg_event_handler_t http_handler;
+    size_t remaining;
+    size_t request_len;
+    int metric_id;
+    struct timespec start;
+} UserImport;
+
+static UserImport* new_user_import(int pretty) {
+    UserImport *import = (UserImport*)malloc(sizeof(UserImport));
+    if (!import) return NULL;
+    import->slice.count = 0;
+    import->partial_len = 0;
+    import->overlong = 0;
+    import->pretty = pretty;
+    import->imported = 0;
+    import->failed = 0;
+    import->http_handler = NULL;
+    import->remaining = 0;
+    return import;
+}
+
+static void apply_import_slice(UserImport *import) {
+    BulkSlice *slice = &import->slice;
+    apply_user_batch(slice->ops, slice->count);
+    for (size_t i = 0; i < slice->count; i++) {
+        if (slice->ops[i].error == USER_OK) {
+            import->imported++;
+        } else {
+            import->failed++;
+        }
+        release_user(slice->ops[i].user);
+        cJSON_Delete(slice->lines[i]);
+    }
+    slice->count = 0;
+}
+
+// A line is a user with name and email. With an id it is stored under
+// that id, replacing any user already there; without one it gets a new id.
+static void import_line(UserImport *import, const char *line, size_t len) {
+    while (len > 0 && isspace((unsigned char)line[len - 1])) len--;
+    if (len == 0) return;
+    
+    BulkSlice *slice = &import->slice;
+    UserInput *input = &slice->inputs[slice->count];
+    cJSON *item = NULL;
+    const char *name;
+    const char *email;
+    int has_id;
+    double id;
+    if (json_read_user_input(line, len, input) && !input->mistyped) {
+        name = input->name;
+        email = input->email;
+        has_id = input->has_id;
+        id = input->id;
+    } else {
+        item = cJSON_ParseWithLength(line, len);
+        const cJSON *id_item = cJSON_GetObjectItem(item, "id");
+        const cJSON *name_item = cJSON_GetObjectItem(item, "name");
+        const cJSON *email_item = cJSON_GetObjectItem(item, "email");
+        if (!cJSON_IsObject(item) || (id_item && !cJSON_IsNumber(id_item))) {
+            cJSON_Delete(item);
+            import->failed++;
             return;
         }
-        
-        // Users endpoints
-        struct mg_str caps[3];
-        
-        if (mg_match(hm->uri, mg_str("/users"), NULL)) {
-            if (mg_strcmp(hm->method, mg_str("GET")) == 0) {
-                handle_get_users(c);
-            } else if (mg_strcmp(hm->method, mg_str("POST")) == 0) {
-                handle_create_user(c, hm->body.buf);
-            } else {
-                mg_http_reply(c, 405, "", "Method not allowed");
+        name = cJSON_IsString(name_item) ? name_item->valuestring : NULL;
+        email = cJSON_IsString(email_item) ? email_item->valuestring : NULL;
+        has_id = id_item != NULL;
+        id = id_item ? id_item->valuedouble : 0;
+    }
+    if (!name || !email || (has_id && !json_number_is_user_id(id))) {
+        cJSON_Delete(item);
+        import->failed++;
+        return;
+    }
+    
+    UserOp *op = &slice->ops[slice->count];
+    memset(op, 0, sizeof(*op));
+    op->type = has_id ? USER_OP_PUT : USER_OP_CREATE;
+    op->id = has_id ? (int)id : 0;
+    op->name = name;
+    op->email = email;
+    slice->lines[slice->count++] = item;
+    if (slice->count == BULK_SLICE) apply_import_slice(import);
+}
+
+// Feeds the next piece of the body. Lines that arrive whole are parsed
+// where they lie; only a line split across pieces is copied.
+static void import_feed(UserImport *import, const char *data, size_t len) {
+    while (len > 0) {
+        const char *newline = (const char*)memchr(data, '\n', len);
+        size_t take = newline ? (size_t)(newline - data) : len;
+        if (import->overlong || import->partial_len + take > IMPORT_MAX_LINE) {
+            import->overlong = 1;
+        } else if (newline && import->partial_len == 0) {
+            import_line(import, data, take);
+        } else {
+            memcpy(import->partial + import->partial_len, data, take);
+            import->partial_len += take;
+            if (newline) import_line(import, import->partial, import->partial_len);
+        }
+        if (newline) {
+            if (import->overlong) import->failed++;
+            import->overlong = 0;
+            import->partial_len = 0;
+            take++;
+        }
+        data += take;
+        len -= take;
+    }
+}
+
+// The last line needs no newline. Answers with how many users were
+// stored and how many lines were rejected.
+static void finish_user_import(struct mg_connection *c, UserImport *import) {
+    if (import->overlong) {
+        import->failed++;
+    } else {
+        import_line(import, import->partial, import->partial_len);
+    }
+    apply_import_slice(import);
+    
+    cJSON *result = cJSON_CreateObject();
+    cJSON_AddNumberToObject(result, "imported", (double)import->imported);
+    cJSON_AddNumberToObject(result, "failed", (double)import->failed);
+    send_json_response(c, 200, result, import->pretty);
+    cJSON_Delete(result);
+}
+
+// Reads a non-negative integer query parameter. Returns 1 if it was given
+// and valid, 0 if absent, -1 if malformed.
+static int get_query_int(struct mg_http_message *hm, const char *name, int *value) {
+    char text[16];
+    int len = mg_http_get_var(&hm->query, name, text, sizeof(text));
+    if (len == -4 || len == -1) return 0;
+    if (len <= 0) return -1;
+    
+    char *end;
+    long parsed = strtol(text, &end, 10);
+    if (*end != '\0' || text[0] == '-' || text[0] == '+' || parsed > INT_MAX) return -1;
+    *value = (int)parsed;
+    return 1;
+}
+
+// JSON is compact unless the client asks for indentation with ?pretty=1
+// or an Accept parameter such as "application/json; pretty=1"
+static int wants_pretty(struct mg_http_message *hm) {
+    char value[8];
+    if (mg_http_get_var(&hm->query, "pretty", value, sizeof(value)) > 0) {
+        return strcmp(value, "1") == 0 || strcmp(value, "true") == 0;
+    }
+    struct mg_str *accept = mg_http_get_header(hm, "Accept");
+    if (accept) {
+        struct mg_str params = *accept;
+        struct mg_str param;
+        while (mg_span(params, &param, &params, ';')) {
+            while (param.len > 0 && param.buf[0] == ' ') {
+                param.buf++;
+                param.len--;
             }
-            return;
+            if (mg_strcmp(param, mg_str("pretty=1")) == 0 ||
+                mg_strcmp(param, mg_str("pretty=true")) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Simple test page
+static const char test_page_html[] =
+    "<!DOCTYPE html><html><head><title>API Test</title></head><body>"
+    "<h1>API Test Page</h1>"
+    "<button id=\"testBtn\" onclick=\"testAPI()\">Test GET /users</button>"
+    "<button id=\"simpleBtn\" onclick=\"window.location.href='/users'\">Direct Link Test</button>"
+    "<div id=\"result\">Click the button to test the API</div>"
+    "<script>"
+    "console.log('Test page loaded');"
+    "function testAPI() {"
+    "  console.log('Button clicked - Testing API...');"
+    "  document.getElementById('result').innerHTML = 'Making request to /users...';"
+    "  "
+    "  var xhr = new XMLHttpRequest();"
+    "  xhr.open('GET', '/users', true);"
+    "  xhr.setRequestHeader('Accept', 'application/json');"
+    "  xhr.timeout = 10000; // 10 second timeout"
+    "  "
+    "  xhr.onloadstart = function() {"
+    "    console.log('Request started');"
+    "    document.getElementById('result').innerHTML = 'Request started...';"
+    "  };"
+    "  "
+    "  xhr.onload = function() {"
+    "    console.log('Response received:', xhr.status, xhr.statusText);"
+    "    document.getElementById('result').innerHTML = 'Got response: ' + xhr.status + ' ' + xhr.statusText + '<br>Data:<br><pre>' + xhr.responseText + '</pre>';"
+    "  };"
+    "  "
+    "  xhr.onerror = function() {"
+    "    console.error('Network error');"
+    "    document.getElementById('result').innerHTML = 'Network error occurred';"
+    "  };"
+    "  "
+    "  xhr.ontimeout = function() {"
+    "    console.error('Request timed out');"
+    "    document.getElementById('result').innerHTML = 'Request timed out after 10 seconds';"
+    "  };"
+    "  "
+    "  xhr.send();"
+    "}"
+    "</script></body></html>";
+
+static CachedResponse swagger_ui_response;
+static CachedResponse swagger_json_response;
+static CachedResponse test_page_response;
+static int routes_initialized = 0;
+static int builtin_routes_registered = 0;
+
+static void register_builtin_routes(void);
+static void free_route_table(void);
+
+static void free_cached_responses(void) {
+    cached_response_free(&swagger_ui_response);
+    cached_response_free(&swagger_json_response);
+    cached_response_free(&test_page_response);
+    routes_initialized = 0;
+}
+
+int init_routes(void) {
+    if (!etag_epoch) etag_epoch = (unsigned long long)time(NULL);
+    if (!builtin_routes_registered) register_builtin_routes();
+    if (routes_initialized) return 1;
+    
+    const char *html = get_swagger_ui();
+    char *json = get_swagger_json();
+    int ok = cached_response_build(&swagger_ui_response, "text/html", html, strlen(html));
+    if (ok && json) {
+        ok = cached_response_build(&swagger_json_response, "application/json", json, strlen(json));
+    }
+    if (ok) {
+        ok = cached_response_build(&test_page_response, "text/html", test_page_html, sizeof(test_page_html) - 1);
+    }
+    free(json);
+    if (ok && swagger_json_response.identity.message) {
+        routes_initialized = 1;
+    } else {
+        free_cached_responses();
+    }
+    return routes_initialized;
+}
+
+void cleanup_routes(void) {
+    free_cached_responses();
+    publish_list_cache(NULL, 0);
+    publish_list_cache(NULL, 1);
+    free_route_table();
+}
+
+static void handle_swagger_ui(struct mg_connection *c, struct mg_http_message *hm) {
+    send_cached_response(c, hm, &swagger_ui_response, NULL);
+}
+
+static void handle_swagger_json(struct mg_connection *c, struct mg_http_message *hm) {
+    send_cached_response(c, hm, &swagger_json_response, NULL);
+}
+
+// Route table. Paths are split on '/' into a trie of segments; a "{name}"
+// segment matches any one segment and is handed to the handler as a
+// parameter. Lookups walk one node per segment and index the handler by
+// method, so the cost does not grow with the number of endpoints.
+typedef struct RouteNode {
+    char *segment;
+    size_t segment_len;
+    struct RouteNode *children;     // literal segments
+    struct RouteNode *sibling;
+    struct RouteNode *param;        // "{name}" segment, if any
+    RouteHandler handlers[HTTP_METHOD_COUNT];
+    int metric_ids[HTTP_METHOD_COUNT];
+} RouteNode;
+
+static RouteNode *route_root = NULL;
+
+static const char *method_names[HTTP_METHOD_COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS"
+};
+
+static void free_route_node(RouteNode *node);
+
+static void free_route_table(void) {
+    free_route_node(route_root);
+    route_root = NULL;
+    builtin_routes_registered = 0;
+}
+
+static void free_route_node(RouteNode *node) {
+    while (node) {
+        RouteNode *sibling = node->sibling;
+        free_route_node(node->children);
+        free_route_node(node->param);
+        free(node->segment);
+        free(node);
+        node = sibling;
+    }
+}
+
+// Returns the next non-empty segment of path[*pos..len), advancing *pos
+static struct mg_str next_segment(const char *path, size_t len, size_t *pos) {
+    size_t i = *pos;
+    while (i < len && path[i] == '/') i++;
+    size_t begin = i;
+    while (i < len && path[i] != '/') i++;
+    *pos = i;
+    return mg_str_n(path + begin, i - begin);
+}
+
+static RouteNode* route_child(RouteNode *node, struct mg_str segment, int create) {
+    int is_param = segment.len >= 2 && segment.buf[0] == '{' && segment.buf[segment.len - 1] == '}';
+    RouteNode **link = is_param ? &node->param : &node->children;
+    if (!is_param) {
+        for (; *link; link = &(*link)->sibling) {
+            if ((*link)->segment_len == segment.len && memcmp((*link)->segment, segment.buf, segment.len) == 0) {
+                return *link;
+            }
+        }
+    } else if (*link) {
+        return *link;
+    }
+    if (!create) return NULL;
+    
+    RouteNode *child = (RouteNode*)calloc(1, sizeof(RouteNode));
+    if (!child) return NULL;
+    child->segment = (char*)malloc(segment.len + 1);
+    if (!child->segment) {
+        free(child);
+        return NULL;
+    }
+    memcpy(child->segment, segment.buf, segment.len);
+    child->segment[segment.len] = '\0';
+    child->segment_len = segment.len;
+    *link = child;
+    return child;
+}
+
+int register_route(HttpMethod method, const char *pattern, RouteHandler handler) {
+    if (!pattern || !handler || method < HTTP_ANY || method >= HTTP_METHOD_COUNT) return 0;
+    if (!route_root && !(route_root = (RouteNode*)calloc(1, sizeof(RouteNode)))) return 0;
+    
+    RouteNode *node = route_root;
+    size_t len = strlen(pattern);
+    size_t pos = 0;
+    int params = 0;
+    for (struct mg_str segment = next_segment(pattern, len, &pos); segment.len > 0;
+         segment = next_segment(pattern, len, &pos)) {
+        if (segment.buf[0] == '{' && ++params > ROUTE_MAX_PARAMS) return 0;
+        if (!(node = route_child(node, segment, 1))) return 0;
+    }
+    
+    if (method != HTTP_ANY) {
+        if (node->handlers[method]) return 0;
+        node->handlers[method] = handler;
+        node->metric_ids[method] = metrics_register_route(method_names[method], pattern);
+        return 1;
+    }
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++) {
+        if (m != HTTP_OPTIONS && node->handlers[m]) return 0;
+    }
+    int metric_id = metrics_register_route("*", pattern);
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++) {
+        if (m == HTTP_OPTIONS) continue;
+        node->handlers[m] = handler;
+        node->metric_ids[m] = metric_id;
+    }
+    return 1;
+}
+
+static const RouteNode* find_route(struct mg_str uri, RouteParams *params) {
+    const RouteNode *node = route_root;
+    size_t pos = 0;
+    params->count = 0;
+    for (struct mg_str segment = next_segment(uri.buf, uri.len, &pos); node && segment.len > 0;
+         segment = next_segment(uri.buf, uri.len, &pos)) {
+        const RouteNode *child = node->children;
+        while (child && !(child->segment_len == segment.len &&
+                          memcmp(child->segment, segment.buf, segment.len) == 0)) {
+            child = child->sibling;
         }
+        if (!child && (child = node->param) != NULL) {
+            params->values[params->count++] = segment;
+        }
+        node = child;
+    }
+    return node;
+}
+
+// Methods are told apart by length and first letter, not by string compares
+static HttpMethod parse_method(struct mg_str method) {
+    const char *m = method.buf;
+    switch (method.len) {
+        case 3:
+            if (memcmp(m, "GET", 3) == 0) return HTTP_GET;
+            if (memcmp(m, "PUT", 3) == 0) return HTTP_PUT;
+            break;
+        case 4:
+            if (memcmp(m, "POST", 4) == 0) return HTTP_POST;
+            if (memcmp(m, "HEAD", 4) == 0) return HTTP_HEAD;
+            break;
+        case 5:
+            if (memcmp(m, "PATCH", 5) == 0) return HTTP_PATCH;
+            break;
+        case 6:
+            if (memcmp(m, "DELETE", 6) == 0) return HTTP_DELETE;
+            break;
+        case 7:
+            if (memcmp(m, "OPTIONS", 7) == 0) return HTTP_OPTIONS;
+            break;
+    }
+    return HTTP_ANY;
+}
+
+static void route_swagger_ui(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    log_message(LOG_DEBUG, "Serving Swagger UI");
+    handle_swagger_ui(c, hm);
+}
+
+static void route_swagger_json(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    handle_swagger_json(c, hm);
+}
+
+static void route_test_page(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    log_message(LOG_DEBUG, "Serving test page");
+    send_cached_response(c, hm, &test_page_response, NULL);
+}
+
+static void route_list_users(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    int pretty = wants_pretty(hm);
+    char email[256];
+    int email_len = mg_http_get_var(&hm->query, "email", email, sizeof(email));
+    if (email_len > 0) {
+        handle_get_user_by_email(c, hm, email, pretty);
+        return;
+    }
+    if (email_len == -3) {
+        send_error_response(c, 400, "Invalid email", pretty);
+        return;
+    }
+    
+    int limit = USERS_PAGE_DEFAULT;
+    int after = 0;
+    int has_limit = get_query_int(hm, "limit", &limit);
+    int has_after = get_query_int(hm, "after", &after);
+    if (has_limit < 0 || (has_limit && (limit < 1 || limit > USERS_PAGE_MAX))) {
+        send_error_response(c, 400, "Invalid limit", pretty);
+    } else if (has_after < 0) {
+        send_error_response(c, 400, "Invalid cursor", pretty);
+    } else if (has_limit || has_after) {
+        handle_get_users_page(c, hm, after, limit, pretty);
+    } else {
+        handle_get_users(c, hm, pretty);
+    }
+}
+
+static void route_create_user(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    handle_create_user(c, hm->body, wants_pretty(hm));
+}
+
+static void route_bulk_users(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    handle_bulk_users(c, hm->body, wants_pretty(hm));
+}
+
+static void route_export_users(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    handle_export_users(c);
+}
+
+// Bodies are normally read straight off the socket as they arrive (see
+// begin_streamed_import); this handles those mongoose buffered whole
+static void route_import_users(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    UserImport *import = new_user_import(wants_pretty(hm));
+    if (!import) {
+        send_error_response(c, 500, "Out of memory", wants_pretty(hm));
+        return;
+    }
+    import_feed(import, hm->body.buf, hm->body.len);
+    finish_user_import(c, import);
+    free(import);
+}
+
+static void route_get_user(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    handle_get_user(c, hm, atoi(params->values[0].buf), wants_pretty(hm));
+}
+
+static void route_update_user(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    handle_update_user(c, atoi(params->values[0].buf), hm->body, wants_pretty(hm));
+}
+
+static void route_delete_user(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    handle_delete_user(c, atoi(params->values[0].buf), wants_pretty(hm));
+}
+
+// Request series from every thread, then store gauges sampled now
+static void route_metrics(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    UserStoreStats stats;
+    get_user_store_stats(&stats);
+    size_t body_start = begin_body_stream(c, 200, "text/plain; version=0.0.4", "");
+    metrics_render(&c->send);
+    metrics_write_value(&c->send, "users_count", "gauge", "Users in the store.", (double)stats.user_count);
+    metrics_write_value(&c->send, "users_store_bytes_live", "gauge", "Record memory in use.", (double)stats.bytes_live);
+    metrics_write_value(&c->send, "users_store_bytes_reserved", "gauge", "Record memory held from the allocator.",
+                        (double)stats.bytes_reserved);
+    metrics_write_value(&c->send, "users_index_max_probe", "gauge", "Longest id index probe sequence.",
+                        (double)stats.index_max_probe);
+    metrics_write_value(&c->send, "users_lock_waits_total", "counter", "Shard lock acquisitions that blocked.",
+                        (double)stats.lock_waits);
+    metrics_write_value(&c->send, "users_lock_wait_seconds_total", "counter", "Time spent blocked on shard locks.",
+                        stats.lock_wait_seconds);
+    end_body_stream(c, body_start);
+}
+
+static void register_builtin_routes(void) {
+    register_route(HTTP_ANY, "/", route_swagger_ui);
+    register_route(HTTP_ANY, "/swagger", route_swagger_ui);
+    register_route(HTTP_ANY, "/swagger.json", route_swagger_json);
+    register_route(HTTP_ANY, "/test", route_test_page);
+    register_route(HTTP_GET, "/metrics", route_metrics);
+    register_route(HTTP_GET, "/users", route_list_users);
+    register_route(HTTP_POST, "/users", route_create_user);
+    register_route(HTTP_POST, "/users/_bulk", route_bulk_users);
+    register_route(HTTP_GET, "/users/export", route_export_users);
+    register_route(HTTP_POST, "/users/import", route_import_users);
+    register_route(HTTP_GET, "/users/{id}", route_get_user);
+    register_route(HTTP_PUT, "/users/{id}", route_update_user);
+    register_route(HTTP_DELETE, "/users/{id}", route_delete_user);
+    builtin_routes_registered = 1;
+}
+
+// Returns the metrics id of the route that answered
+static int dispatch_route(struct mg_connection *c, struct mg_http_message *hm) {
+    HttpMethod method = parse_method(hm->method);
+    
+    // Handle CORS preflight
+    if (method == HTTP_OPTIONS) {
+        log_message(LOG_DEBUG, "Handling OPTIONS request");
+        static const char preflight[] = "HTTP/1.1 200 OK\r\n"
+                                        HTTP_CORS_HEADERS
+                                        "Access-Control-Max-Age: 86400\r\n"
+                                        "Content-Length: 0\r\n\r\n";
+        mg_send(c, preflight, sizeof(preflight) - 1);
+        return METRICS_UNMATCHED_ROUTE;
+    }
+    
+    RouteParams params;
+    const RouteNode *node = find_route(hm->uri, &params);
+    if (!node) {
+        mg_http_reply(c, 404, "", "Not found");
+        return METRICS_UNMATCHED_ROUTE;
+    }
+    if (method == HTTP_ANY || !node->handlers[method]) {
+        mg_http_reply(c, 405, "", "Method not allowed");
+        return METRICS_UNMATCHED_ROUTE;
+    }
+    node->handlers[method](c, hm, &params);
+    return node->metric_ids[method];
+}
+
+static double elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)(now.tv_sec - start->tv_sec) * 1e6 + (double)(now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// Runs one parsed request. This is the only place that writes the
+// response, so it can run on the event loop or on a worker's scratch
+// connection alike. Metrics go to this thread's shard and the access line
+// is queued, so neither is written inline.
+static void route_request(struct mg_connection *c, struct mg_http_message *hm) {
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    size_t response_start = c->send.len;
+    request_accepts_gzip = http_accepts_gzip(hm);
+    int route = dispatch_route(c, hm);
+    request_accepts_gzip = 0;
+    
+    // Every response starts with "HTTP/1.1 NNN"; streamed listings only
+    // count what the first pass wrote
+    int status = 0;
+    size_t bytes = c->send.len - response_start;
+    PendingBody *body = ((UserStream*)c->data)->body;
+    if (body) bytes += body->len;
+    if (bytes > 12) status = atoi((const char*)c->send.buf + response_start + 9);
+    double latency_us = elapsed_us(&start);
+    metrics_record_request(route, status, hm->message.len, bytes, latency_us);
+    log_access(hm->method.buf, hm->method.len, hm->uri.buf, hm->uri.len, status, bytes, latency_us);
+}
+
+// A request handed to a worker. The worker routes it against `scratch`, a
+// detached connection whose send buffer and user data are moved onto the
+// real connection once the result is back on the event loop.
+//
+// conn belongs to the event loop: the connection points back at the job
+// through its fn_data, which the HTTP listener leaves to us, and clears
+// conn if it closes first. Workers only use mgr and conn_id to wake it.
+typedef struct RequestJob {
+    WorkItem item;
+    struct mg_mgr *mgr;
+    unsigned long conn_id;
+    struct mg_connection *conn;
+    struct mg_connection scratch;
+    size_t request_len;
+    char request[];
+} RequestJob;
+
+#define REQUEST_QUEUE_CAPACITY 1024
+
+static void run_request_job(WorkItem *item) {
+    RequestJob *job = (RequestJob*)item;
+    struct mg_http_message hm;
+    if (mg_http_parse(job->request, job->request_len, &hm) > 0) {
+        route_request(&job->scratch, &hm);
+    } else {
+        mg_http_reply(&job->scratch, 400, "", "Bad request");
+    }
+    
+    // The event loop may free the job as soon as it is finished
+    struct mg_mgr *mgr = job->mgr;
+    unsigned long conn_id = job->conn_id;
+    worker_pool_finish(item);
+    mg_wakeup(mgr, conn_id, "", 0);
+}
+
+int start_request_workers(size_t threads) {
+    if (threads == 0) return 1;
+    return worker_pool_start(threads, REQUEST_QUEUE_CAPACITY, run_request_job);
+}
+
+void stop_request_workers(void) {
+    worker_pool_stop();
+    for (WorkItem *item = worker_pool_take_finished(); item;) {
+        RequestJob *job = (RequestJob*)item;
+        item = item->next;
+        if (job->conn) job->conn->fn_data = NULL;
+        end_user_stream((UserStream*)job->scratch.data);
+        mg_iobuf_free(&job->scratch.send);
+        free(job);
+    }
+}
+
+// Copies the request and queues it. Returns 0 if there are no workers or
+// the queue is full, in which case the caller routes it inline.
+static int submit_request(struct mg_connection *c, struct mg_http_message *hm) {
+    if (worker_pool_size() == 0) return 0;
+    
+    RequestJob *job = (RequestJob*)calloc(1, sizeof(RequestJob) + hm->message.len);
+    if (!job) return 0;
+    job->mgr = c->mgr;
+    job->conn_id = c->id;
+    job->conn = c;
+    job->request_len = hm->message.len;
+    memcpy(job->request, hm->message.buf, hm->message.len);
+    
+    if (!worker_pool_submit(&job->item)) {
+        free(job);
+        return 0;
+    }
+    // Hold back pipelined requests on this connection until we answer
+    c->is_resp = 1;
+    c->fn_data = job;
+    return 1;
+}
+
+// The connection is going away; its job, if any, is dropped on delivery
+static void forget_request(struct mg_connection *c) {
+    RequestJob *job = (RequestJob*)c->fn_data;
+    if (job) job->conn = NULL;
+    c->fn_data = NULL;
+}
+
+// Moves finished responses onto their connections. Results for connections
+// that closed in the meantime are simply dropped.
+static void deliver_finished_requests(void) {
+    WorkItem *item = worker_pool_take_finished();
+    while (item) {
+        RequestJob *job = (RequestJob*)item;
+        item = item->next;
         
-        if (mg_match(hm->uri, mg_str("/users/#"), caps)) {
-            int user_id = atoi(caps[0].buf);
-            if (mg_strcmp(hm->method, mg_str("GET")) == 0) {
-                handle_get_user(c, user_id);
-            } else if (mg_strcmp(hm->method, mg_str("PUT")) == 0) {
-                handle_update_user(c, user_id, hm->body.buf);
-            } else if (mg_strcmp(hm->method, mg_str("DELETE")) == 0) {
-                handle_delete_user(c, user_id);
+        struct mg_connection *c = job->conn;
+        if (c) {
+            c->fn_data = NULL;
+            if (c->send.len == 0) {
+                // Adopt the worker's buffer rather than copying it
+                struct mg_iobuf rendered = job->scratch.send;
+                rendered.align = c->send.align;
+                job->scratch.send = c->send;
+                c->send = rendered;
             } else {
-                mg_http_reply(c, 405, "", "Method not allowed");
+                mg_send(c, job->scratch.send.buf, job->scratch.send.len);
             }
-            return;
+            // The connection takes over the dump, compressor included, or
+            // the cached body still to be written
+            UserStream *stream = (UserStream*)c->data;
+            memcpy(c->data, job->scratch.data, sizeof(c->data));
+            ((UserStream*)job->scratch.data)->gzip = NULL;
+            ((UserStream*)job->scratch.data)->body = NULL;
+            c->is_resp = stream->active || stream->body;
+            if (job->scratch.is_closing) c->is_closing = 1;
+            continue_pending_body(c);
         }
-        
-        // 404 for unknown routes
-        mg_http_reply(c, 404, "", "Not found");
+        end_user_stream((UserStream*)job->scratch.data);
+        mg_iobuf_free(&job->scratch.send);
+        free(job);
+    }
+}
+
+// Once the headers of a POST /users/import with a Content-Length are in,
+// mongoose's HTTP handler is switched off so the body is not buffered:
+// each read is fed to the import and dropped from the receive buffer.
+static void begin_streamed_import(struct mg_connection *c, struct mg_http_message *hm) {
+    UserStream *stream = (UserStream*)c->data;
+    if (stream->import || parse_method(hm->method) != HTTP_POST) return;
+    RouteParams params;
+    const RouteNode *node = find_route(hm->uri, &params);
+    if (!node || node->handlers[HTTP_POST] != route_import_users) return;
+    if (!mg_http_get_header(hm, "Content-Length") || mg_http_get_header(hm, "Transfer-Encoding")) return;
+    // A body that is already in whole is left to the normal route
+    if ((const unsigned char*)hm->head.buf != c->recv.buf || hm->message.len <= c->recv.len) return;
+    
+    // Without memory for the state, mongoose buffers the body as usual
+    UserImport *import = new_user_import(wants_pretty(hm));
+    if (!import) return;
+    import->http_handler = c->pfn;
+    import->remaining = hm->body.len;
+    import->request_len = hm->message.len;
+    import->metric_id = node->metric_ids[HTTP_POST];
+    timespec_get(&import->start, TIME_UTC);
+    stream->import = import;
+    c->pfn = NULL;
+    mg_iobuf_del(&c->recv, 0, hm->head.len);
+}
+
+static void end_streamed_import(struct mg_connection *c) {
+    UserStream *stream = (UserStream*)c->data;
+    c->pfn = stream->import->http_handler;
+    free(stream->import);
+    stream->import = NULL;
+}
+
+// Bytes past the body belong to the next pipelined request and are left
+// for the HTTP handler, which is back in place once the answer is written
+static void continue_streamed_import(struct mg_connection *c) {
+    UserImport *import = ((UserStream*)c->data)->import;
+    if (!import) return;
+    size_t len = c->recv.len < import->remaining ? c->recv.len : import->remaining;
+    import_feed(import, (const char*)c->recv.buf, len);
+    mg_iobuf_del(&c->recv, 0, len);
+    import->remaining -= len;
+    if (import->remaining > 0) return;
+    
+    size_t response_start = c->send.len;
+    finish_user_import(c, import);
+    size_t bytes = c->send.len - response_start;
+    int status = atoi((const char*)c->send.buf + response_start + 9);
+    double latency_us = elapsed_us(&import->start);
+    metrics_record_request(import->metric_id, status, import->request_len, bytes, latency_us);
+    log_access("POST", 4, "/users/import", 13, status, bytes, latency_us);
+    end_streamed_import(c);
+}
+
+void handle_mongoose_request(struct mg_connection *c, int ev, void *ev_data) {
+    if (ev == MG_EV_HTTP_HDRS) {
+        begin_streamed_import(c, (struct mg_http_message *) ev_data);
+    } else if (ev == MG_EV_READ) {
+        continue_streamed_import(c);
+    } else if (ev == MG_EV_CLOSE) {
+        forget_request(c);
+        if (((UserStream*)c->data)->import) end_streamed_import(c);
+        end_user_stream((UserStream*)c->data);
+    } else if (ev == MG_EV_HTTP_MSG) {
+        struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+        if (!submit_request(c, hm)) {
+            route_request(c, hm);
+            continue_pending_body(c);
+        }
+    } else if (ev == MG_EV_WAKEUP) {
+        deliver_finished_requests();
+    } else if (ev == MG_EV_POLL || ev == MG_EV_WRITE) {
+        // A wakeup can be lost if its pipe is full, or go to a connection
+        // that has closed. The listener sees one poll per loop iteration,
+        // which is enough to catch up.
+        if (ev == MG_EV_POLL && c->is_listening) deliver_finished_requests();
+        continue_user_stream(c);
+        continue_pending_body(c);
     }
 }
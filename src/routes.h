@@ -3,6 +3,54 @@
 
 #include "mongoose.h"
 
+#define ROUTE_MAX_PARAMS 4
+
+// HTTP_ANY doubles as "unrecognised method" when parsing requests
+typedef enum HttpMethod {
+    HTTP_ANY = -1,
+    HTTP_GET,
+    HTTP_HEAD,
+    HTTP_POST,
+    HTTP_PUT,
+    HTTP_DELETE,
+    HTTP_PATCH,
+    HTTP_OPTIONS,
+    HTTP_METHOD_COUNT
+} HttpMethod;
+
+// Values of the "{name}" segments in the matched path, in order. They point
+// into the request URI and are not NUL-terminated.
+typedef struct RouteParams {
+    struct mg_str values[ROUTE_MAX_PARAMS];
+    int count;
+} RouteParams;
+
+typedef void (*RouteHandler)(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params);
+
+// Render the fixed responses (Swagger UI and spec) and build the route
+// table. Call once before serving, before any worker or reactor starts;
+// requests never build them. Returns 0 if the responses could not be
+// rendered.
+int init_routes(void);
+
+// Release what init_routes built, including any registered routes
+void cleanup_routes(void);
+
+// Add an endpoint such as "/users/{id}". HTTP_ANY matches every method but
+// OPTIONS, which is always answered as a CORS preflight. Register before
+// serving; the table is not locked. Returns 0 if the method and path are
+// already taken or the pattern has more than ROUTE_MAX_PARAMS parameters.
+int register_route(HttpMethod method, const char *pattern, RouteHandler handler);
+
+// Route requests on `threads` worker threads instead of the event loop.
+// Responses come back through mg_wakeup, so call mg_wakeup_init and
+// init_routes first.
+// 0 threads keeps everything on the event loop. Returns 1 on success.
+int start_request_workers(size_t threads);
+
+// Finish queued requests and join the workers
+void stop_request_workers(void);
+
 // Main request handler for mongoose
 void handle_mongoose_request(struct mg_connection *c, int ev, void *ev_data);
 
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#define file_sync(f) _commit(_fileno(f))
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define file_sync(f) fsync(fileno(f))
+#endif
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "USNAP\0\0\0"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        // rejects snapshots from other-endian hosts
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t heap_size;
+    uint64_t log_offset;
+    uint64_t padding[2];
+} SnapshotHeader;
+
+_Static_assert(sizeof(SnapshotHeader) == 64, "snapshot header must stay 64 bytes");
+_Static_assert(sizeof(SnapshotRecord) == 16, "snapshot records must stay 16 bytes");
+
+#ifndef _WIN32
+// Makes the rename itself durable by syncing the containing directory
+static void sync_parent_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char dir[1024];
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if ((size_t)(slash - path) < sizeof(dir)) {
+        memcpy(dir, path, (size_t)(slash - path));
+        dir[slash == path ? 1 : slash - path] = '\0';
+    } else {
+        return;
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+#endif
+
+int snapshot_write(const char *path, User *const *users, size_t count, uint64_t log_offset) {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.record_size = sizeof(SnapshotRecord);
+    header.count = count;
+    header.log_offset = log_offset;
+    for (size_t i = 0; i < count; i++) {
+        header.heap_size += strlen(users[i]->name) + 1 + strlen(users[i]->email) + 1;
+    }
+    if (header.heap_size > UINT32_MAX) return 0;
+
+    size_t path_len = strlen(path);
+    char *tmp_path = (char*)malloc(path_len + 5);
+    if (!tmp_path) return 0;
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) {
+        free(tmp_path);
+        return 0;
+    }
+
+    // Record table first, then the strings in the same order
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    uint32_t offset = 0;
+    for (size_t i = 0; ok && i < count; i++) {
+        SnapshotRecord record;
+        record.id = users[i]->id;
+        record.name = offset;
+        offset += (uint32_t)strlen(users[i]->name) + 1;
+        record.email = offset;
+        offset += (uint32_t)strlen(users[i]->email) + 1;
+        record.reserved = 0;
+        ok = fwrite(&record, sizeof(record), 1, f) == 1;
+    }
+    for (size_t i = 0; ok && i < count; i++) {
+        ok = fputs(users[i]->name, f) >= 0 && fputc('\0', f) != EOF &&
+             fputs(users[i]->email, f) >= 0 && fputc('\0', f) != EOF;
+    }
+    ok = ok && fflush(f) == 0 && file_sync(f) == 0;
+    ok = fclose(f) == 0 && ok;
+
+#ifdef _WIN32
+    // Refused while the file being replaced is still mapped
+    ok = ok && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    ok = ok && rename(tmp_path, path) == 0;
+    if (ok) sync_parent_dir(path);
+#endif
+    if (!ok) remove(tmp_path);
+    free(tmp_path);
+    return ok;
+}
+
+static int snapshot_valid(const MappedSnapshot *snapshot, const SnapshotHeader *header, uint64_t heap_size) {
+    if (header->heap_size == 0) return header->count == 0;
+    if (snapshot->heap[heap_size - 1] != '\0') return 0;
+    int32_t last_id = 0;
+    for (size_t i = 0; i < snapshot->count; i++) {
+        const SnapshotRecord *record = &snapshot->records[i];
+        if (record->id <= last_id || record->name >= heap_size || record->email >= heap_size) return 0;
+        last_id = record->id;
+    }
+    return 1;
+}
+
+int snapshot_map(const char *path, MappedSnapshot *snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart >= (LONGLONG)sizeof(SnapshotHeader)) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    CloseHandle(file);
+    if (!mapping) return 0;
+    void *base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!base) {
+        CloseHandle(mapping);
+        return 0;
+    }
+    snapshot->mapping = mapping;
+    snapshot->size = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+        close(fd);
+        return 0;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return 0;
+    snapshot->size = (size_t)st.st_size;
+#endif
+    snapshot->base = base;
+
+    const SnapshotHeader *header = (const SnapshotHeader*)base;
+    uint64_t body = snapshot->size - sizeof(SnapshotHeader);
+    int ok = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+             header->version == SNAPSHOT_VERSION && header->byte_order == SNAPSHOT_BYTE_ORDER &&
+             header->record_size == sizeof(SnapshotRecord) &&
+             header->count <= body / sizeof(SnapshotRecord) &&
+             header->heap_size == body - header->count * sizeof(SnapshotRecord);
+    if (ok) {
+        snapshot->count = (size_t)header->count;
+        snapshot->log_offset = header->log_offset;
+        snapshot->records = (const SnapshotRecord*)(header + 1);
+        snapshot->heap = (const char*)(snapshot->records + snapshot->count);
+        ok = snapshot_valid(snapshot, header, header->heap_size);
+    }
+    if (!ok) {
+        snapshot_unmap(snapshot);
+        return 0;
+    }
+    return 1;
+}
+
+void snapshot_unmap(MappedSnapshot *snapshot) {
+    if (!snapshot->base) return;
+#ifdef _WIN32
+    UnmapViewOfFile(snapshot->base);
+    CloseHandle(snapshot->mapping);
+#else
+    munmap(snapshot->base, snapshot->size);
+#endif
+    memset(snapshot, 0, sizeof(*snapshot));
+}
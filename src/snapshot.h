@@ -0,0 +1,43 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "users.h"
+
+// On-disk image of the user store: a 64-byte header, a table of
+// fixed-size records, then a heap of NUL-terminated strings the records
+// point into. It is written in native byte order and mapped read-only at
+// startup, so loading copies no strings.
+
+typedef struct SnapshotRecord {
+    int32_t id;
+    uint32_t name;              // heap offsets
+    uint32_t email;
+    uint32_t reserved;
+} SnapshotRecord;
+
+typedef struct MappedSnapshot {
+    void *base;
+    size_t size;
+    size_t count;
+    uint64_t log_offset;        // write-ahead log bytes the snapshot covers
+    const SnapshotRecord *records;
+    const char *heap;
+#ifdef _WIN32
+    void *mapping;
+#endif
+} MappedSnapshot;
+
+// Write `count` users, sorted by id, to `path` through a temporary file that is synced
+// and renamed into place, so readers see the old snapshot or the new one.
+// Returns 1 on success.
+int snapshot_write(const char *path, User *const *users, size_t count, uint64_t log_offset);
+
+// Map and validate a snapshot: ids strictly ascending, every string
+// inside the heap. Returns 0 if it is missing or malformed.
+int snapshot_map(const char *path, MappedSnapshot *snapshot);
+
+void snapshot_unmap(MappedSnapshot *snapshot);
+
+#endif // SNAPSHOT_H
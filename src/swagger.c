@@ -4,7 +4,7 @@
 #include "cjson/cJSON.h"
 #include "swagger.h"
 
-char* get_swagger_ui(void) {
+const char* get_swagger_ui(void) {
     static const char *html = 
         "<!DOCTYPE html>\n"
         "<html>\n"
@@ -40,7 +40,45 @@ char* get_swagger_ui(void) {
         "                \"/users\": {\n"
         "                    \"get\": {\n"
         "                        \"summary\": \"Get all users\",\n"
-        "                        \"description\": \"Retrieve a list of all users\",\n"
+        "                        \"description\": \"Retrieve a list of all users, or the single user with a given email\",\n"
+        "                        \"parameters\": [\n"
+        "                            {\n"
+        "                                \"name\": \"email\",\n"
+        "                                \"in\": \"query\",\n"
+        "                                \"required\": false,\n"
+        "                                \"description\": \"Exact email to look up\",\n"
+        "                                \"schema\": {\n"
+        "                                    \"type\": \"string\"\n"
+        "                                }\n"
+        "                            },\n"
+        "                            {\n"
+        "                                \"name\": \"pretty\",\n"
+        "                                \"in\": \"query\",\n"
+        "                                \"required\": false,\n"
+        "                                \"description\": \"Set to 1 for indented JSON\",\n"
+        "                                \"schema\": {\n"
+        "                                    \"type\": \"integer\"\n"
+        "                                }\n"
+        "                            },\n"
+        "                            {\n"
+        "                                \"name\": \"limit\",\n"
+        "                                \"in\": \"query\",\n"
+        "                                \"required\": false,\n"
+        "                                \"description\": \"Page size (1-1000); enables paging with a Link header to the next page\",\n"
+        "                                \"schema\": {\n"
+        "                                    \"type\": \"integer\"\n"
+        "                                }\n"
+        "                            },\n"
+        "                            {\n"
+        "                                \"name\": \"after\",\n"
+        "                                \"in\": \"query\",\n"
+        "                                \"required\": false,\n"
+        "                                \"description\": \"Return users with ids greater than this cursor\",\n"
+        "                                \"schema\": {\n"
+        "                                    \"type\": \"integer\"\n"
+        "                                }\n"
+        "                            }\n"
+        "                        ],\n"
         "                        \"responses\": {\n"
         "                            \"200\": {\n"
         "                                \"description\": \"List of users\",\n"
@@ -54,6 +92,9 @@ char* get_swagger_ui(void) {
         "                                        }\n"
         "                                    }\n"
         "                                }\n"
+        "                            },\n"
+        "                            \"304\": {\n"
+        "                                \"description\": \"Not modified since the ETag sent in If-None-Match\"\n"
         "                            }\n"
         "                        }\n"
         "                    },\n"
@@ -83,6 +124,9 @@ char* get_swagger_ui(void) {
         "                            },\n"
         "                            \"400\": {\n"
         "                                \"description\": \"Invalid input\"\n"
+        "                            },\n"
+        "                            \"409\": {\n"
+        "                                \"description\": \"Email already in use\"\n"
         "                            }\n"
         "                        }\n"
         "                    }\n"
@@ -113,6 +157,9 @@ char* get_swagger_ui(void) {
         "                                    }\n"
         "                                }\n"
         "                            },\n"
+        "                            \"304\": {\n"
+        "                                \"description\": \"Not modified since the ETag sent in If-None-Match\"\n"
+        "                            },\n"
         "                            \"404\": {\n"
         "                                \"description\": \"User not found\"\n"
         "                            }\n"
@@ -158,6 +205,9 @@ char* get_swagger_ui(void) {
         "                            },\n"
         "                            \"400\": {\n"
         "                                \"description\": \"Invalid input\"\n"
+        "                            },\n"
+        "                            \"409\": {\n"
+        "                                \"description\": \"Email already in use\"\n"
         "                            }\n"
         "                        }\n"
         "                    },\n"
@@ -184,6 +234,72 @@ char* get_swagger_ui(void) {
         "                            }\n"
         "                        }\n"
         "                    }\n"
+        "                },\n"
+        "                \"/users/_bulk\": {\n"
+        "                    \"post\": {\n"
+        "                        \"summary\": \"Create, update and delete users in bulk\",\n"
+        "                        \"description\": \"Apply a JSON array of operations, or the same objects as NDJSON one per line, in order. Each item has op (create, update or delete), id for update and delete, and name and email as for the single-user endpoints. Items succeed or fail on their own.\",\n"
+        "                        \"requestBody\": {\n"
+        "                            \"required\": true,\n"
+        "                            \"content\": {\n"
+        "                                \"application/json\": {\n"
+        "                                    \"schema\": {\n"
+        "                                        \"type\": \"array\",\n"
+        "                                        \"items\": {\n"
+        "                                            \"$ref\": \"#/components/schemas/BulkOperation\"\n"
+        "                                        }\n"
+        "                                    }\n"
+        "                                }\n"
+        "                            }\n"
+        "                        },\n"
+        "                        \"responses\": {\n"
+        "                            \"200\": {\n"
+        "                                \"description\": \"One result per operation, in request order: status plus the user, or an error message\"\n"
+        "                            },\n"
+        "                            \"400\": {\n"
+        "                                \"description\": \"Invalid JSON or no operations\"\n"
+        "                            }\n"
+        "                        }\n"
+        "                    }\n"
+        "                },\n"
+        "                \"/users/export\": {\n"
+        "                    \"get\": {\n"
+        "                        \"summary\": \"Export all users as NDJSON\",\n"
+        "                        \"description\": \"Streams every user in id order, one compact JSON object per line.\",\n"
+        "                        \"responses\": {\n"
+        "                            \"200\": {\n"
+        "                                \"description\": \"One user per line\",\n"
+        "                                \"content\": {\n"
+        "                                    \"application/x-ndjson\": {\n"
+        "                                        \"schema\": {\n"
+        "                                            \"$ref\": \"#/components/schemas/User\"\n"
+        "                                        }\n"
+        "                                    }\n"
+        "                                }\n"
+        "                            }\n"
+        "                        }\n"
+        "                    }\n"
+        "                },\n"
+        "                \"/users/import\": {\n"
+        "                    \"post\": {\n"
+        "                        \"summary\": \"Import users from NDJSON\",\n"
+        "                        \"description\": \"One user per line with name and email. A line with an id stores the user under that id, replacing any user there; without one the user gets a new id. Lines are applied as they arrive.\",\n"
+        "                        \"requestBody\": {\n"
+        "                            \"required\": true,\n"
+        "                            \"content\": {\n"
+        "                                \"application/x-ndjson\": {\n"
+        "                                    \"schema\": {\n"
+        "                                        \"$ref\": \"#/components/schemas/User\"\n"
+        "                                    }\n"
+        "                                }\n"
+        "                            }\n"
+        "                        },\n"
+        "                        \"responses\": {\n"
+        "                            \"200\": {\n"
+        "                                \"description\": \"Counts of imported users and rejected lines\"\n"
+        "                            }\n"
+        "                        }\n"
+        "                    }\n"
         "                }\n"
         "            },\n"
         "            \"components\": {\n"
@@ -226,6 +342,27 @@ char* get_swagger_ui(void) {
         "                            }\n"
         "                        },\n"
         "                        \"required\": [\"name\", \"email\"]\n"
+        "                    },\n"
+        "                    \"BulkOperation\": {\n"
+        "                        \"type\": \"object\",\n"
+        "                        \"properties\": {\n"
+        "                            \"op\": {\n"
+        "                                \"type\": \"string\",\n"
+        "                                \"enum\": [\"create\", \"update\", \"delete\"]\n"
+        "                            },\n"
+        "                            \"id\": {\n"
+        "                                \"type\": \"integer\",\n"
+        "                                \"description\": \"User ID, for update and delete\"\n"
+        "                            },\n"
+        "                            \"name\": {\n"
+        "                                \"type\": \"string\"\n"
+        "                            },\n"
+        "                            \"email\": {\n"
+        "                                \"type\": \"string\",\n"
+        "                                \"format\": \"email\"\n"
+        "                            }\n"
+        "                        },\n"
+        "                        \"required\": [\"op\"]\n"
         "                    }\n"
         "                }\n"
         "            }\n"
@@ -279,13 +416,7 @@ char* get_swagger_ui(void) {
         "</body>\n"
         "</html>";
     
-    // Return a copy of the static string
-    size_t len = strlen(html);
-    char *result = (char*)malloc(len + 1);
-    if (result) {
-        strcpy(result, html);
-    }
-    return result;
+    return html;
 }
 
 char* get_swagger_json(void) {
@@ -327,7 +458,44 @@ char* get_swagger_json(void) {
     cJSON *get_200_desc = cJSON_CreateString("List of users");
     cJSON_AddItemToObject(get_200, "description", get_200_desc);
     cJSON_AddItemToObject(get_responses, "200", get_200);
+    cJSON *get_304 = cJSON_CreateObject();
+    cJSON_AddItemToObject(get_304, "description", cJSON_CreateString("Not modified since the ETag sent in If-None-Match"));
+    cJSON_AddItemToObject(get_responses, "304", get_304);
+    cJSON *get_users_parameters = cJSON_CreateArray();
+    cJSON *email_param = cJSON_CreateObject();
+    cJSON *email_param_schema = cJSON_CreateObject();
+    cJSON_AddItemToObject(email_param_schema, "type", cJSON_CreateString("string"));
+    cJSON_AddItemToObject(email_param, "name", cJSON_CreateString("email"));
+    cJSON_AddItemToObject(email_param, "in", cJSON_CreateString("query"));
+    cJSON_AddItemToObject(email_param, "required", cJSON_CreateBool(0));
+    cJSON_AddItemToObject(email_param, "schema", email_param_schema);
+    cJSON_AddItemToArray(get_users_parameters, email_param);
+    cJSON *pretty_param = cJSON_CreateObject();
+    cJSON *pretty_param_schema = cJSON_CreateObject();
+    cJSON_AddItemToObject(pretty_param_schema, "type", cJSON_CreateString("integer"));
+    cJSON_AddItemToObject(pretty_param, "name", cJSON_CreateString("pretty"));
+    cJSON_AddItemToObject(pretty_param, "in", cJSON_CreateString("query"));
+    cJSON_AddItemToObject(pretty_param, "required", cJSON_CreateBool(0));
+    cJSON_AddItemToObject(pretty_param, "schema", pretty_param_schema);
+    cJSON_AddItemToArray(get_users_parameters, pretty_param);
+    cJSON *limit_param = cJSON_CreateObject();
+    cJSON *limit_param_schema = cJSON_CreateObject();
+    cJSON_AddItemToObject(limit_param_schema, "type", cJSON_CreateString("integer"));
+    cJSON_AddItemToObject(limit_param, "name", cJSON_CreateString("limit"));
+    cJSON_AddItemToObject(limit_param, "in", cJSON_CreateString("query"));
+    cJSON_AddItemToObject(limit_param, "required", cJSON_CreateBool(0));
+    cJSON_AddItemToObject(limit_param, "schema", limit_param_schema);
+    cJSON_AddItemToArray(get_users_parameters, limit_param);
+    cJSON *after_param = cJSON_CreateObject();
+    cJSON *after_param_schema = cJSON_CreateObject();
+    cJSON_AddItemToObject(after_param_schema, "type", cJSON_CreateString("integer"));
+    cJSON_AddItemToObject(after_param, "name", cJSON_CreateString("after"));
+    cJSON_AddItemToObject(after_param, "in", cJSON_CreateString("query"));
+    cJSON_AddItemToObject(after_param, "required", cJSON_CreateBool(0));
+    cJSON_AddItemToObject(after_param, "schema", after_param_schema);
+    cJSON_AddItemToArray(get_users_parameters, after_param);
     cJSON_AddItemToObject(get_users, "summary", get_summary);
+    cJSON_AddItemToObject(get_users, "parameters", get_users_parameters);
     cJSON_AddItemToObject(get_users, "responses", get_responses);
     cJSON_AddItemToObject(users_path, "get", get_users);
     
@@ -364,6 +532,9 @@ char* get_swagger_json(void) {
     cJSON *post_201_desc = cJSON_CreateString("User created");
     cJSON_AddItemToObject(post_201, "description", post_201_desc);
     cJSON_AddItemToObject(post_responses, "201", post_201);
+    cJSON *post_409 = cJSON_CreateObject();
+    cJSON_AddItemToObject(post_409, "description", cJSON_CreateString("Email already in use"));
+    cJSON_AddItemToObject(post_responses, "409", post_409);
     
     cJSON_AddItemToObject(post_users, "summary", post_summary);
     cJSON_AddItemToObject(post_users, "requestBody", post_requestBody);
@@ -395,6 +566,9 @@ char* get_swagger_json(void) {
     cJSON *get_user_200_desc = cJSON_CreateString("User details");
     cJSON_AddItemToObject(get_user_200, "description", get_user_200_desc);
     cJSON_AddItemToObject(get_user_responses, "200", get_user_200);
+    cJSON *get_user_304 = cJSON_CreateObject();
+    cJSON_AddItemToObject(get_user_304, "description", cJSON_CreateString("Not modified since the ETag sent in If-None-Match"));
+    cJSON_AddItemToObject(get_user_responses, "304", get_user_304);
     cJSON *get_user_404 = cJSON_CreateObject();
     cJSON *get_user_404_desc = cJSON_CreateString("User not found");
     cJSON_AddItemToObject(get_user_404, "description", get_user_404_desc);
@@ -454,6 +628,9 @@ char* get_swagger_json(void) {
     cJSON *put_user_404_desc = cJSON_CreateString("User not found");
     cJSON_AddItemToObject(put_user_404, "description", put_user_404_desc);
     cJSON_AddItemToObject(put_user_responses, "404", put_user_404);
+    cJSON *put_user_409 = cJSON_CreateObject();
+    cJSON_AddItemToObject(put_user_409, "description", cJSON_CreateString("Email already in use"));
+    cJSON_AddItemToObject(put_user_responses, "409", put_user_409);
     
     cJSON_AddItemToObject(put_user, "summary", put_user_summary);
     cJSON_AddItemToObject(put_user, "parameters", put_user_parameters);
@@ -493,9 +670,81 @@ char* get_swagger_json(void) {
     cJSON_AddItemToObject(delete_user, "responses", delete_user_responses);
     cJSON_AddItemToObject(user_by_id_path, "delete", delete_user);
     
+    // POST /users/_bulk
+    cJSON *bulk_path = cJSON_CreateObject();
+    cJSON *post_bulk = cJSON_CreateObject();
+    cJSON *bulk_requestBody = cJSON_CreateObject();
+    cJSON *bulk_content = cJSON_CreateObject();
+    cJSON *bulk_json = cJSON_CreateObject();
+    cJSON *bulk_schema = cJSON_CreateObject();
+    cJSON *bulk_items = cJSON_CreateObject();
+    cJSON_AddItemToObject(bulk_items, "$ref", cJSON_CreateString("#/components/schemas/BulkOperation"));
+    cJSON_AddItemToObject(bulk_schema, "type", cJSON_CreateString("array"));
+    cJSON_AddItemToObject(bulk_schema, "items", bulk_items);
+    cJSON_AddItemToObject(bulk_json, "schema", bulk_schema);
+    cJSON_AddItemToObject(bulk_content, "application/json", bulk_json);
+    cJSON_AddItemToObject(bulk_requestBody, "content", bulk_content);
+    
+    cJSON *bulk_responses = cJSON_CreateObject();
+    cJSON *bulk_200 = cJSON_CreateObject();
+    cJSON_AddItemToObject(bulk_200, "description", cJSON_CreateString("One result per operation, in request order"));
+    cJSON_AddItemToObject(bulk_responses, "200", bulk_200);
+    cJSON *bulk_400 = cJSON_CreateObject();
+    cJSON_AddItemToObject(bulk_400, "description", cJSON_CreateString("Invalid JSON or no operations"));
+    cJSON_AddItemToObject(bulk_responses, "400", bulk_400);
+    
+    cJSON_AddItemToObject(post_bulk, "summary", cJSON_CreateString("Create, update and delete users in bulk"));
+    cJSON_AddItemToObject(post_bulk, "requestBody", bulk_requestBody);
+    cJSON_AddItemToObject(post_bulk, "responses", bulk_responses);
+    cJSON_AddItemToObject(bulk_path, "post", post_bulk);
+    
+    // GET /users/export
+    cJSON *export_path = cJSON_CreateObject();
+    cJSON *get_export = cJSON_CreateObject();
+    cJSON *export_responses = cJSON_CreateObject();
+    cJSON *export_200 = cJSON_CreateObject();
+    cJSON *export_content = cJSON_CreateObject();
+    cJSON *export_ndjson = cJSON_CreateObject();
+    cJSON *export_schema = cJSON_CreateObject();
+    cJSON_AddItemToObject(export_schema, "$ref", cJSON_CreateString("#/components/schemas/User"));
+    cJSON_AddItemToObject(export_ndjson, "schema", export_schema);
+    cJSON_AddItemToObject(export_content, "application/x-ndjson", export_ndjson);
+    cJSON_AddItemToObject(export_200, "description", cJSON_CreateString("One user per line"));
+    cJSON_AddItemToObject(export_200, "content", export_content);
+    cJSON_AddItemToObject(export_responses, "200", export_200);
+    cJSON_AddItemToObject(get_export, "summary", cJSON_CreateString("Export all users as NDJSON"));
+    cJSON_AddItemToObject(get_export, "responses", export_responses);
+    cJSON_AddItemToObject(export_path, "get", get_export);
+    
+    // POST /users/import
+    cJSON *import_path = cJSON_CreateObject();
+    cJSON *post_import = cJSON_CreateObject();
+    cJSON *import_requestBody = cJSON_CreateObject();
+    cJSON *import_content = cJSON_CreateObject();
+    cJSON *import_ndjson = cJSON_CreateObject();
+    cJSON *import_schema = cJSON_CreateObject();
+    cJSON_AddItemToObject(import_schema, "$ref", cJSON_CreateString("#/components/schemas/User"));
+    cJSON_AddItemToObject(import_ndjson, "schema", import_schema);
+    cJSON_AddItemToObject(import_content, "application/x-ndjson", import_ndjson);
+    cJSON_AddItemToObject(import_requestBody, "required", cJSON_CreateTrue());
+    cJSON_AddItemToObject(import_requestBody, "content", import_content);
+    
+    cJSON *import_responses = cJSON_CreateObject();
+    cJSON *import_200 = cJSON_CreateObject();
+    cJSON_AddItemToObject(import_200, "description", cJSON_CreateString("Counts of imported users and rejected lines"));
+    cJSON_AddItemToObject(import_responses, "200", import_200);
+    
+    cJSON_AddItemToObject(post_import, "summary", cJSON_CreateString("Import users from NDJSON"));
+    cJSON_AddItemToObject(post_import, "requestBody", import_requestBody);
+    cJSON_AddItemToObject(post_import, "responses", import_responses);
+    cJSON_AddItemToObject(import_path, "post", post_import);
+    
     // Add paths to main object
     cJSON_AddItemToObject(paths, "/users", users_path);
     cJSON_AddItemToObject(paths, "/users/{id}", user_by_id_path);
+    cJSON_AddItemToObject(paths, "/users/_bulk", bulk_path);
+    cJSON_AddItemToObject(paths, "/users/export", export_path);
+    cJSON_AddItemToObject(paths, "/users/import", import_path);
     cJSON_AddItemToObject(root, "paths", paths);
     
     // Add components section with schemas
@@ -534,6 +783,27 @@ char* get_swagger_json(void) {
     cJSON_AddItemToObject(user_schema, "properties", user_schema_properties);
     cJSON_AddItemToObject(schemas, "User", user_schema);
     
+    // Bulk operation schema
+    cJSON *bulk_op_schema = cJSON_CreateObject();
+    cJSON *bulk_op_properties = cJSON_CreateObject();
+    cJSON *bulk_op_prop = cJSON_CreateObject();
+    const char *bulk_op_names[] = { "create", "update", "delete" };
+    cJSON_AddItemToObject(bulk_op_prop, "type", cJSON_CreateString("string"));
+    cJSON_AddItemToObject(bulk_op_prop, "enum", cJSON_CreateStringArray(bulk_op_names, 3));
+    cJSON_AddItemToObject(bulk_op_properties, "op", bulk_op_prop);
+    cJSON *bulk_id_prop = cJSON_CreateObject();
+    cJSON_AddItemToObject(bulk_id_prop, "type", cJSON_CreateString("integer"));
+    cJSON_AddItemToObject(bulk_op_properties, "id", bulk_id_prop);
+    cJSON *bulk_name_prop = cJSON_CreateObject();
+    cJSON_AddItemToObject(bulk_name_prop, "type", cJSON_CreateString("string"));
+    cJSON_AddItemToObject(bulk_op_properties, "name", bulk_name_prop);
+    cJSON *bulk_email_prop = cJSON_CreateObject();
+    cJSON_AddItemToObject(bulk_email_prop, "type", cJSON_CreateString("string"));
+    cJSON_AddItemToObject(bulk_op_properties, "email", bulk_email_prop);
+    cJSON_AddItemToObject(bulk_op_schema, "type", cJSON_CreateString("object"));
+    cJSON_AddItemToObject(bulk_op_schema, "properties", bulk_op_properties);
+    cJSON_AddItemToObject(schemas, "BulkOperation", bulk_op_schema);
+    
     cJSON_AddItemToObject(components, "schemas", schemas);
     cJSON_AddItemToObject(root, "components", components);
     
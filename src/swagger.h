@@ -2,7 +2,9 @@
 #define SWAGGER_H
 
 // Function declarations for mongoose
-char* get_swagger_ui(void);
+// The UI page is a static string; the JSON spec is malloc'd and the caller
+// frees it. Both are rendered once by init_routes, not per request.
+const char* get_swagger_ui(void);
 char* get_swagger_json(void);
 
 #endif // SWAGGER_H
\ No newline at end of file
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+// Windows threading
+typedef CRITICAL_SECTION pthread_mutex_t;
+static inline int pthread_mutex_init(pthread_mutex_t *mutex, void *attr) {
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_lock(pthread_mutex_t *mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_destroy(pthread_mutex_t *mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+#else
+#include <pthread.h>
+#endif
+#include "user_pool.h"
+
+// Blocks are carved out of 64 KiB slabs. Size classes step by roughly
+// 25% so a record wastes little space however long its strings are;
+// anything bigger than the largest class goes straight to malloc.
+#define POOL_SLAB_BYTES (64 * 1024)
+
+static const size_t pool_class_sizes[] = {
+    64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+#define POOL_CLASS_COUNT (sizeof(pool_class_sizes) / sizeof(pool_class_sizes[0]))
+
+typedef struct PoolSlab {
+    struct PoolSlab *next;
+} PoolSlab;
+
+// Header reserved at the start of every slab; keeps blocks 16-byte aligned
+#define POOL_SLAB_HEADER 16
+
+typedef struct PoolClass {
+    pthread_mutex_t lock;
+    size_t block_size;
+    PoolSlab *slabs;
+    void *free_list;            // freed blocks, linked through their first word
+    char *bump;                 // uncarved tail of the newest slab
+    char *bump_end;
+    size_t bytes_live;
+    size_t blocks_live;
+    size_t blocks_free;
+    size_t bytes_reserved;
+} PoolClass;
+
+static PoolClass pool_classes[POOL_CLASS_COUNT];
+static pthread_mutex_t large_lock;
+static size_t large_bytes_live = 0;
+static size_t large_blocks_live = 0;
+static int pool_initialized = 0;
+
+void user_pool_init(void) {
+    if (pool_initialized) return;
+    for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+        pthread_mutex_init(&pool_classes[i].lock, NULL);
+        pool_classes[i].block_size = pool_class_sizes[i];
+    }
+    pthread_mutex_init(&large_lock, NULL);
+    pool_initialized = 1;
+}
+
+void user_pool_shutdown(void) {
+    if (!pool_initialized) return;
+    // Someone still holds a record; keep the slabs rather than free under them
+    UserPoolStats stats;
+    user_pool_stats(&stats);
+    if (stats.blocks_live > 0) return;
+    
+    for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+        PoolClass *cls = &pool_classes[i];
+        PoolSlab *slab = cls->slabs;
+        while (slab) {
+            PoolSlab *next = slab->next;
+            free(slab);
+            slab = next;
+        }
+        pthread_mutex_destroy(&cls->lock);
+        memset(cls, 0, sizeof(*cls));
+    }
+    pthread_mutex_destroy(&large_lock);
+    large_bytes_live = 0;
+    large_blocks_live = 0;
+    pool_initialized = 0;
+}
+
+static PoolClass* pool_class_for(size_t size) {
+    for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+        if (size <= pool_class_sizes[i]) return &pool_classes[i];
+    }
+    return NULL;
+}
+
+void* user_pool_alloc(size_t size) {
+    PoolClass *cls = pool_class_for(size);
+    if (!cls) {
+        void *block = malloc(size);
+        if (block) {
+            pthread_mutex_lock(&large_lock);
+            large_bytes_live += size;
+            large_blocks_live++;
+            pthread_mutex_unlock(&large_lock);
+        }
+        return block;
+    }
+    
+    pthread_mutex_lock(&cls->lock);
+    
+    void *block = cls->free_list;
+    if (block) {
+        cls->free_list = *(void**)block;
+        cls->blocks_free--;
+    } else {
+        if (cls->bump == NULL || cls->bump + cls->block_size > cls->bump_end) {
+            PoolSlab *slab = (PoolSlab*)malloc(POOL_SLAB_BYTES);
+            if (!slab) {
+                pthread_mutex_unlock(&cls->lock);
+                return NULL;
+            }
+            slab->next = cls->slabs;
+            cls->slabs = slab;
+            cls->bytes_reserved += POOL_SLAB_BYTES;
+            cls->bump = (char*)slab + POOL_SLAB_HEADER;
+            cls->bump_end = (char*)slab + POOL_SLAB_BYTES;
+        }
+        block = cls->bump;
+        cls->bump += cls->block_size;
+    }
+    cls->bytes_live += size;
+    cls->blocks_live++;
+    
+    pthread_mutex_unlock(&cls->lock);
+    return block;
+}
+
+void user_pool_free(void *block, size_t size) {
+    if (!block) return;
+    
+    PoolClass *cls = pool_class_for(size);
+    if (!cls) {
+        pthread_mutex_lock(&large_lock);
+        large_bytes_live -= size;
+        large_blocks_live--;
+        pthread_mutex_unlock(&large_lock);
+        free(block);
+        return;
+    }
+    
+    pthread_mutex_lock(&cls->lock);
+    *(void**)block = cls->free_list;
+    cls->free_list = block;
+    cls->blocks_free++;
+    cls->bytes_live -= size;
+    cls->blocks_live--;
+    pthread_mutex_unlock(&cls->lock);
+}
+
+void user_pool_stats(UserPoolStats *stats) {
+    if (!stats) return;
+    memset(stats, 0, sizeof(*stats));
+    if (!pool_initialized) return;
+    
+    for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+        PoolClass *cls = &pool_classes[i];
+        pthread_mutex_lock(&cls->lock);
+        stats->bytes_live += cls->bytes_live;
+        stats->bytes_reserved += cls->bytes_reserved;
+        stats->blocks_live += cls->blocks_live;
+        stats->blocks_free += cls->blocks_free;
+        pthread_mutex_unlock(&cls->lock);
+    }
+    pthread_mutex_lock(&large_lock);
+    stats->bytes_live += large_bytes_live;
+    stats->bytes_reserved += large_bytes_live;
+    stats->blocks_live += large_blocks_live;
+    pthread_mutex_unlock(&large_lock);
+    
+    if (stats->bytes_reserved > 0) {
+        stats->fragmentation = 1.0 - (double)stats->bytes_live / (double)stats->bytes_reserved;
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef USER_POOL_H
+#define USER_POOL_H
+
+#include <stddef.h>
+
+typedef struct UserPoolStats {
+    size_t bytes_live;          // bytes requested by blocks currently in use
+    size_t bytes_reserved;      // bytes obtained from the system allocator
+    size_t blocks_live;
+    size_t blocks_free;         // carved blocks waiting on a free list
+    double fragmentation;       // 1 - live / reserved
+} UserPoolStats;
+
+// Prepare the size-class locks (safe to call repeatedly)
+void user_pool_init(void);
+
+// Give every slab back to the system; only valid once no block is live
+void user_pool_shutdown(void);
+
+// Allocate a block of at least `size` bytes from the matching size class
+void* user_pool_alloc(size_t size);
+
+// Return a block; `size` must be the value passed to user_pool_alloc
+void user_pool_free(void *block, size_t size);
+
+// Snapshot of allocator usage
+void user_pool_stats(UserPoolStats *stats);
+
+#endif // USER_POOL_H
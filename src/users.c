@@ -1,189 +1,1397 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #ifdef _WIN32
 #include <windows.h>
-// Windows threading
-typedef CRITICAL_SECTION pthread_mutex_t;
-#define PTHREAD_MUTEX_INITIALIZER {0}
-static inline int pthread_mutex_init(pthread_mutex_t *mutex, void *attr) {
-    InitializeCriticalSection(mutex);
+// Windows threading: slim reader/writer locks stand in for pthread rwlocks
+typedef SRWLOCK pthread_rwlock_t;
+typedef HANDLE pthread_t;
+static inline int pthread_rwlock_init(pthread_rwlock_t *lock, void *attr) {
+    InitializeSRWLock(lock);
     return 0;
 }
-static inline int pthread_mutex_lock(pthread_mutex_t *mutex) {
-    EnterCriticalSection(mutex);
+static inline int pthread_rwlock_rdlock(pthread_rwlock_t *lock) {
+    AcquireSRWLockShared(lock);
     return 0;
 }
-static inline int pthread_mutex_unlock(pthread_mutex_t *mutex) {
-    LeaveCriticalSection(mutex);
+static inline int pthread_rwlock_wrlock(pthread_rwlock_t *lock) {
+    AcquireSRWLockExclusive(lock);
     return 0;
 }
-static inline int pthread_mutex_destroy(pthread_mutex_t *mutex) {
-    DeleteCriticalSection(mutex);
+static inline int pthread_rwlock_tryrdlock(pthread_rwlock_t *lock) {
+    return TryAcquireSRWLockShared(lock) ? 0 : 1;
+}
+static inline int pthread_rwlock_trywrlock(pthread_rwlock_t *lock) {
+    return TryAcquireSRWLockExclusive(lock) ? 0 : 1;
+}
+static inline int pthread_rwlock_unlock_shared(pthread_rwlock_t *lock) {
+    ReleaseSRWLockShared(lock);
+    return 0;
+}
+static inline int pthread_rwlock_unlock_exclusive(pthread_rwlock_t *lock) {
+    ReleaseSRWLockExclusive(lock);
+    return 0;
+}
+static inline int pthread_rwlock_destroy(pthread_rwlock_t *lock) {
     return 0;
 }
+#define read_unlock(lock) pthread_rwlock_unlock_shared(lock)
+#define write_unlock(lock) pthread_rwlock_unlock_exclusive(lock)
+#define refcount_inc(p) InterlockedIncrement(p)
+#define refcount_dec(p) InterlockedDecrement(p)
+#define counter_load(p) InterlockedCompareExchange((p), 0, 0)
+// Moves *p from expected to expected + 1; fails if another thread got there first
+#define counter_advance(p, expected) (InterlockedCompareExchange((p), (expected) + 1, (expected)) == (expected))
+#define stat_add(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+#define stat_load(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+#define flag_store(p, v) InterlockedExchange((p), (v))
+#define flag_load(p) InterlockedCompareExchange((p), 0, 0)
+#define pointer_load(p) InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+// Stores desired if *p is still NULL; returns what *p held before
+#define pointer_set_once(p, desired) InterlockedCompareExchangePointer((PVOID volatile*)(p), (desired), NULL)
 #else
 #include <pthread.h>
+#define read_unlock(lock) pthread_rwlock_unlock(lock)
+#define write_unlock(lock) pthread_rwlock_unlock(lock)
+#define refcount_inc(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define refcount_dec(p) __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define counter_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+// Moves *p from expected to expected + 1; fails if another thread got there first
+static inline int counter_advance(long *p, long expected) {
+    return __atomic_compare_exchange_n(p, &expected, expected + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+#define stat_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define stat_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define flag_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define flag_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define pointer_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+static inline void* pointer_set_once(void **p, void *desired) {
+    void *expected = NULL;
+    __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return expected;
+}
 #endif
 #include "users.h"
+#include "user_pool.h"
+#include "wal.h"
+#include "snapshot.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define USERS_THREAD_LOCAL __declspec(thread)
+#else
+#define USERS_THREAD_LOCAL _Thread_local
+#endif
+
+#define USERS_DEFAULT_SHARDS 16
+#define USERS_MAX_SHARDS 256
+
+#define INDEX_MIN_CAPACITY 64
+#define INDEX_MIGRATE_STEP 64
+
+// Open-addressing hash table of User records. Slots hold either NULL
+// (never used), INDEX_TOMBSTONE (deleted) or a live User*.
+typedef struct IndexTable {
+    User **slots;
+    size_t capacity;    // always a power of two
+    size_t count;       // live entries
+    size_t used;        // live entries + tombstones
+} IndexTable;
+
+// While a resize is in progress, entries are moved from old to active a
+// few slots at a time on every write so no single insert stalls.
+typedef struct UserIndex {
+    IndexTable active;
+    IndexTable old;
+    size_t migrate_pos;
+    size_t (*hash)(const User *user);
+} UserIndex;
+
+typedef int (*IndexMatch)(const User *user, const void *key);
+
+static User index_tombstone_sentinel;
+#define INDEX_TOMBSTONE (&index_tombstone_sentinel)
+
+// Time spent blocked on shard locks. Uncontended acquisitions cost one
+// trylock; only a failed trylock reads the clock.
+static uint64_t lock_waits = 0;
+static uint64_t lock_wait_ns = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void read_lock(pthread_rwlock_t *lock) {
+    if (pthread_rwlock_tryrdlock(lock) == 0) return;
+    uint64_t start = now_ns();
+    pthread_rwlock_rdlock(lock);
+    stat_add(&lock_waits, 1);
+    stat_add(&lock_wait_ns, now_ns() - start);
+}
+
+static void write_lock(pthread_rwlock_t *lock) {
+    if (pthread_rwlock_trywrlock(lock) == 0) return;
+    uint64_t start = now_ns();
+    pthread_rwlock_wrlock(lock);
+    stat_add(&lock_waits, 1);
+    stat_add(&lock_wait_ns, now_ns() - start);
+}
+
+static size_t hash_id(int id) {
+    uint64_t h = (uint64_t)(uint32_t)id * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32);
+}
+
+// FNV-1a, finished with the same multiplicative mix as ids
+static size_t hash_email(const char *email) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const unsigned char *p = (const unsigned char*)email; *p; p++) {
+        h = (h ^ *p) * 0x100000001b3ull;
+    }
+    h *= 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32);
+}
+
+static size_t user_id_hash(const User *user) {
+    return hash_id(user->id);
+}
+
+static size_t user_email_hash(const User *user) {
+    return hash_email(user->email);
+}
+
+static int match_id(const User *user, const void *key) {
+    return user->id == *(const int*)key;
+}
+
+static int match_email(const User *user, const void *key) {
+    return strcmp(user->email, (const char*)key) == 0;
+}
+
+static int match_record(const User *user, const void *key) {
+    return user == (const User*)key;
+}
+
+// Sorted ids of one shard, so a listing can seek straight to a cursor.
+// Deleted ids are negated in place (keeping the array sorted by absolute
+// value) and swept out once they make up half of it.
+typedef struct IdOrder {
+    int *ids;
+    size_t len;
+    size_t cap;
+    size_t holes;
+} IdOrder;
+
+// Users are striped across shards by id. Each shard owns its records, its
+// id index, an id-ordered list used to build listings and the sorted ids
+// used to start a page mid-list. Readers share
+// the shard lock; only create/update/delete take it exclusively. Records
+// are immutable once published: update_user swaps in a new copy, so a
+// reference obtained from a reader stays valid until released.
+typedef struct IdShard {
+    pthread_rwlock_t lock;
+    UserIndex id_index;
+    IdOrder order;
+    User *head;
+    User *tail;
+} IdShard;
+
+// Emails are striped independently by hash, so uniqueness checks only
+// contend with writers touching the same stripe. Lock order is email
+// stripes (lowest first) before the id shard.
+typedef struct EmailShard {
+    pthread_rwlock_t lock;
+    UserIndex email_index;
+} EmailShard;
+
+static IdShard *id_shards = NULL;
+static EmailShard *email_shards = NULL;
+static size_t shard_count = 0;
+static long next_id = 1;
+static int store_initialized = 0;
+// Not reset by cleanup_users, so versions stay unique for the process
+static uint64_t store_generation = 0;
 
-static User *users_head = NULL;
-static int next_id = 1;
-static pthread_mutex_t users_mutex;
-static int mutex_initialized = 0;
+static USERS_THREAD_LOCAL UserError last_error = USER_OK;
+
+// Users restored from a snapshot share one array and keep their strings
+// in the read-only mapping, so they never come from the pool
+static MappedSnapshot loaded_snapshot;
+static User *mapped_users = NULL;
+static size_t mapped_user_count = 0;
+static long snapshot_log_offset = 0;
+
+static int table_alloc(IndexTable *table, size_t capacity) {
+    table->slots = (User**)calloc(capacity, sizeof(User*));
+    if (!table->slots) return 0;
+    table->capacity = capacity;
+    table->count = 0;
+    table->used = 0;
+    return 1;
+}
+
+static void table_free(IndexTable *table) {
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// Returns the slot holding a record matching key, or NULL.
+static User** table_find(const IndexTable *table, size_t hash, IndexMatch match, const void *key) {
+    if (!table->slots) return NULL;
+    size_t mask = table->capacity - 1;
+    size_t pos = hash & mask;
+    for (size_t i = 0; i < table->capacity; i++) {
+        User *slot = table->slots[pos];
+        if (slot == NULL) return NULL;
+        if (slot != INDEX_TOMBSTONE && match(slot, key)) return &table->slots[pos];
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+// Caller guarantees there is room and that the record is not present.
+static void table_put(IndexTable *table, User *user, size_t hash) {
+    size_t mask = table->capacity - 1;
+    size_t pos = hash & mask;
+    while (table->slots[pos] != NULL && table->slots[pos] != INDEX_TOMBSTONE) {
+        pos = (pos + 1) & mask;
+    }
+    if (table->slots[pos] == NULL) table->used++;
+    table->slots[pos] = user;
+    table->count++;
+}
+
+static void index_free(UserIndex *idx) {
+    table_free(&idx->active);
+    table_free(&idx->old);
+    idx->migrate_pos = 0;
+}
+
+static size_t index_count(const UserIndex *idx) {
+    return idx->active.count + idx->old.count;
+}
+
+static void index_migrate(UserIndex *idx, size_t steps) {
+    if (!idx->old.slots) return;
+    while (steps-- > 0 && idx->migrate_pos < idx->old.capacity) {
+        User *slot = idx->old.slots[idx->migrate_pos++];
+        if (slot != NULL && slot != INDEX_TOMBSTONE) {
+            table_put(&idx->active, slot, idx->hash(slot));
+            idx->old.count--;
+        }
+    }
+    if (idx->migrate_pos >= idx->old.capacity) {
+        table_free(&idx->old);
+        idx->migrate_pos = 0;
+    }
+}
+
+// Makes room for one more entry, starting an incremental resize when the
+// active table passes 75% occupancy (tombstones included).
+static int index_reserve(UserIndex *idx) {
+    index_migrate(idx, INDEX_MIGRATE_STEP);
+    IndexTable *active = &idx->active;
+    if (active->slots && (active->used + 1) * 4 <= active->capacity * 3) {
+        return 1;
+    }
+    // A previous resize must be drained before the next one can start
+    index_migrate(idx, (size_t)-1);
+
+    size_t live = active->count + 1;
+    size_t capacity = INDEX_MIN_CAPACITY;
+    while (capacity * 3 < live * 2 * 4) capacity <<= 1;
+
+    IndexTable grown;
+    if (!table_alloc(&grown, capacity)) return 0;
+    if (active->slots && active->count > 0) {
+        idx->old = *active;
+        idx->migrate_pos = 0;
+    } else {
+        table_free(active);
+    }
+    idx->active = grown;
+    return 1;
+}
+
+// Sizes an empty index so that `entries` inserts never start a resize
+static int index_presize(UserIndex *idx, size_t entries) {
+    size_t capacity = INDEX_MIN_CAPACITY;
+    while (capacity * 3 < (entries + 1) * 4) capacity <<= 1;
+    index_free(idx);
+    return table_alloc(&idx->active, capacity);
+}
+
+static User* index_find(const UserIndex *idx, size_t hash, IndexMatch match, const void *key) {
+    User **slot = table_find(&idx->active, hash, match, key);
+    if (!slot) slot = table_find(&idx->old, hash, match, key);
+    return slot ? *slot : NULL;
+}
+
+static void index_put(UserIndex *idx, User *user) {
+    table_put(&idx->active, user, idx->hash(user));
+}
+
+static void index_remove(UserIndex *idx, User *user) {
+    size_t hash = idx->hash(user);
+    IndexTable *table = &idx->active;
+    User **slot = table_find(table, hash, match_record, user);
+    if (!slot) {
+        table = &idx->old;
+        slot = table_find(table, hash, match_record, user);
+    }
+    if (slot) {
+        *slot = INDEX_TOMBSTONE;
+        table->count--;
+    }
+    index_migrate(idx, INDEX_MIGRATE_STEP);
+}
+
+static IdShard* shard_for_id(int id) {
+    return &id_shards[(size_t)(unsigned int)id & (shard_count - 1)];
+}
+
+// Table positions come from the low hash bits, so stripe on the high ones
+static EmailShard* shard_for_email(const char *email) {
+    return &email_shards[(hash_email(email) >> 24) & (shard_count - 1)];
+}
+
+static User* find_by_id(IdShard *shard, int id) {
+    return index_find(&shard->id_index, hash_id(id), match_id, &id);
+}
+
+static User* find_by_email(EmailShard *shard, const char *email) {
+    return index_find(&shard->email_index, hash_email(email), match_email, email);
+}
+
+static void lock_email_shards(EmailShard *a, EmailShard *b) {
+    if (b < a) {
+        EmailShard *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    write_lock(&a->lock);
+    if (b != a) write_lock(&b->lock);
+}
+
+static void unlock_email_shards(EmailShard *a, EmailShard *b) {
+    if (b != a) write_unlock(&b->lock);
+    write_unlock(&a->lock);
+}
+
+static int order_grow(IdOrder *order, size_t cap) {
+    int *ids = (int*)realloc(order->ids, cap * sizeof(int));
+    if (!ids) return 0;
+    order->ids = ids;
+    order->cap = cap;
+    return 1;
+}
+
+static int order_reserve(IdOrder *order) {
+    if (order->len < order->cap) return 1;
+    return order_grow(order, order->cap ? order->cap * 2 : INDEX_MIN_CAPACITY);
+}
+
+// First position whose id (live or deleted) is greater than after
+static size_t order_upper_bound(const IdOrder *order, int after) {
+    size_t lo = 0;
+    size_t hi = order->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (abs(order->ids[mid]) <= after) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Ids nearly always arrive in order, so this is an append in practice.
+// An id put back after a delete takes over its deleted entry, so each id
+// has at most one entry and order_remove always finds the live one.
+static void order_insert(IdOrder *order, int id) {
+    size_t pos = order_upper_bound(order, id);
+    if (pos > 0 && order->ids[pos - 1] == -id) {
+        order->ids[pos - 1] = id;
+        order->holes--;
+        return;
+    }
+    memmove(order->ids + pos + 1, order->ids + pos, (order->len - pos) * sizeof(int));
+    order->ids[pos] = id;
+    order->len++;
+}
+
+static void order_remove(IdOrder *order, int id) {
+    size_t pos = order_upper_bound(order, id - 1);
+    if (pos == order->len || order->ids[pos] != id) return;
+    order->ids[pos] = -id;
+    order->holes++;
+    
+    if (order->holes * 2 > order->len) {
+        size_t kept = 0;
+        for (size_t i = 0; i < order->len; i++) {
+            if (order->ids[i] > 0) order->ids[kept++] = order->ids[i];
+        }
+        order->len = kept;
+        order->holes = 0;
+    }
+}
+
+// Smallest live id greater than after, or 0 if there is none
+static int order_seek(const IdOrder *order, int after) {
+    for (size_t i = order_upper_bound(order, after); i < order->len; i++) {
+        if (order->ids[i] > 0) return order->ids[i];
+    }
+    return 0;
+}
+
+static void order_free(IdOrder *order) {
+    free(order->ids);
+    memset(order, 0, sizeof(*order));
+}
+
+// Ids are allocated before the shard lock is taken, so a racing create can
+// arrive slightly out of order; walk back from the tail to keep id order.
+static void shard_link(IdShard *shard, User *user) {
+    User *after = shard->tail;
+    while (after && after->id > user->id) after = after->prev;
+    user->prev = after;
+    user->next = after ? after->next : shard->head;
+    if (user->next) {
+        user->next->prev = user;
+    } else {
+        shard->tail = user;
+    }
+    if (after) {
+        after->next = user;
+    } else {
+        shard->head = user;
+    }
+}
+
+static void shard_unlink(IdShard *shard, User *user) {
+    if (user->prev) {
+        user->prev->next = user->next;
+    } else {
+        shard->head = user->next;
+    }
+    if (user->next) {
+        user->next->prev = user->prev;
+    } else {
+        shard->tail = user->prev;
+    }
+}
+
+static void shard_replace(IdShard *shard, User *current, User *replacement) {
+    replacement->prev = current->prev;
+    replacement->next = current->next;
+    if (current->prev) {
+        current->prev->next = replacement;
+    } else {
+        shard->head = replacement;
+    }
+    if (current->next) {
+        current->next->prev = replacement;
+    } else {
+        shard->tail = replacement;
+    }
+}
+
+static void set_error(UserError error) {
+    last_error = error;
+}
+
+UserError users_last_error(void) {
+    return last_error;
+}
+
+// A record and both of its strings live in one pool block:
+// [User][name\0][email\0]. The size is recomputed on free.
+static size_t user_record_size(size_t name_len, size_t email_len) {
+    return sizeof(User) + name_len + 1 + email_len + 1;
+}
+
+static int is_mapped_user(const User *user) {
+    uintptr_t first = (uintptr_t)mapped_users;
+    return mapped_users && (uintptr_t)user >= first && (uintptr_t)user < first + mapped_user_count * sizeof(User);
+}
+
+// Fragments come from the same pool as records
+static size_t user_fragment_size(size_t len) {
+    return sizeof(UserFragment) + len;
+}
+
+static void free_fragment(UserFragment *fragment) {
+    if (fragment) user_pool_free(fragment, user_fragment_size(fragment->len));
+}
+
+static void free_user(User *user) {
+    // Snapshot records are reclaimed all at once by cleanup_users
+    if (is_mapped_user(user)) return;
+    free_fragment(user->fragment);
+    user_pool_free(user, user_record_size(strlen(user->name), strlen(user->email)));
+}
+
+static User* new_user_record(int id, const char *name, const char *email) {
+    size_t name_len = strlen(name);
+    size_t email_len = strlen(email);
+    User *user = (User*)user_pool_alloc(user_record_size(name_len, email_len));
+    if (!user) return NULL;
+    user->id = id;
+    user->name = (char*)(user + 1);
+    user->email = user->name + name_len + 1;
+    memcpy(user->name, name, name_len + 1);
+    memcpy(user->email, email, email_len + 1);
+    user->next = NULL;
+    user->prev = NULL;
+    user->refcount = 1;
+    user->version = 0;
+    user->fragment = NULL;
+    return user;
+}
+
+const UserFragment* user_fragment(const User *user) {
+    return (const UserFragment*)pointer_load(&user->fragment);
+}
+
+UserFragment* user_fragment_alloc(size_t len) {
+    UserFragment *fragment = (UserFragment*)user_pool_alloc(user_fragment_size(len));
+    if (fragment) fragment->len = len;
+    return fragment;
+}
+
+// Records are shared between threads without locks once published, so the
+// fragment is the one field that changes after that, and only once
+const UserFragment* user_attach_fragment(const User *user, UserFragment *fragment) {
+    User *record = (User*)user;
+    UserFragment *attached = (UserFragment*)pointer_set_once((void**)&record->fragment, fragment);
+    if (!attached) return fragment;
+    free_fragment(fragment);
+    return attached;
+}
+
+static uint64_t next_generation(void) {
+    return (uint64_t)stat_add(&store_generation, 1) + 1;
+}
+
+uint64_t users_generation(void) {
+    return (uint64_t)stat_load(&store_generation);
+}
+
+static User* retain_user(User *user) {
+    if (user) refcount_inc(&user->refcount);
+    return user;
+}
+
+void release_user(User *user) {
+    if (user && refcount_dec(&user->refcount) == 0) {
+        free_user(user);
+    }
+}
 
 void init_users(void) {
-    if (!mutex_initialized) {
-        pthread_mutex_init(&users_mutex, NULL);
-        mutex_initialized = 1;
+    init_users_sharded(USERS_DEFAULT_SHARDS);
+}
+
+void init_users_sharded(size_t shards) {
+    size_t count = 1;
+    while (count < shards && count < USERS_MAX_SHARDS) count <<= 1;
+    
+    if (store_initialized) {
+        if (count == shard_count) {
+            cleanup_users();
+            return;
+        }
+        shutdown_users();
+    }
+    
+    user_pool_init();
+    id_shards = (IdShard*)calloc(count, sizeof(IdShard));
+    email_shards = (EmailShard*)calloc(count, sizeof(EmailShard));
+    if (!id_shards || !email_shards) {
+        free(id_shards);
+        free(email_shards);
+        id_shards = NULL;
+        email_shards = NULL;
+        return;
     }
-    pthread_mutex_lock(&users_mutex);
-    users_head = NULL;
+    for (size_t i = 0; i < count; i++) {
+        pthread_rwlock_init(&id_shards[i].lock, NULL);
+        id_shards[i].id_index.hash = user_id_hash;
+        pthread_rwlock_init(&email_shards[i].lock, NULL);
+        email_shards[i].email_index.hash = user_email_hash;
+    }
+    shard_count = count;
     next_id = 1;
-    pthread_mutex_unlock(&users_mutex);
+    store_initialized = 1;
 }
 
 void cleanup_users(void) {
-    if (mutex_initialized) {
-        pthread_mutex_lock(&users_mutex);
-        User *current = users_head;
+    if (!store_initialized) return;
+    
+    wait_user_snapshot();
+    for (size_t i = 0; i < shard_count; i++) {
+        EmailShard *shard = &email_shards[i];
+        write_lock(&shard->lock);
+        index_free(&shard->email_index);
+        write_unlock(&shard->lock);
+    }
+    for (size_t i = 0; i < shard_count; i++) {
+        IdShard *shard = &id_shards[i];
+        write_lock(&shard->lock);
+        User *current = shard->head;
         while (current) {
             User *next = current->next;
-            free(current->name);
-            free(current->email);
-            free(current);
+            release_user(current);
             current = next;
         }
-        users_head = NULL;
-        next_id = 1;
-        pthread_mutex_unlock(&users_mutex);
-        // Don't destroy mutex in tests - let it persist for multiple test runs
-        // pthread_mutex_destroy(&users_mutex);
-        // mutex_initialized = 0;
+        shard->head = NULL;
+        shard->tail = NULL;
+        index_free(&shard->id_index);
+        order_free(&shard->order);
+        write_unlock(&shard->lock);
+    }
+    next_id = 1;
+    for (size_t i = 0; i < mapped_user_count; i++) {
+        free_fragment(mapped_users[i].fragment);
     }
+    free(mapped_users);
+    mapped_users = NULL;
+    mapped_user_count = 0;
+    snapshot_unmap(&loaded_snapshot);
+    snapshot_log_offset = 0;
+    // Shards and their locks persist so tests can re-run init_users
 }
 
 void shutdown_users(void) {
+    wait_user_snapshot();
+    close_user_log();
     cleanup_users();
-    if (mutex_initialized) {
-        pthread_mutex_destroy(&users_mutex);
-        mutex_initialized = 0;
+    if (store_initialized) {
+        for (size_t i = 0; i < shard_count; i++) {
+            pthread_rwlock_destroy(&id_shards[i].lock);
+            pthread_rwlock_destroy(&email_shards[i].lock);
+        }
+        free(id_shards);
+        free(email_shards);
+        id_shards = NULL;
+        email_shards = NULL;
+        shard_count = 0;
+        store_initialized = 0;
+    }
+    user_pool_shutdown();
+}
+
+// Write-ahead log records are a kind byte and the id, then for LOG_PUT the
+// full record: name and email, each prefixed by its length. Integers are
+// little-endian u32. Records are appended with the id shard locked, so the
+// changes to one user reach the log in the order they were applied.
+#define LOG_PUT 'P'
+#define LOG_DELETE 'D'
+#define LOG_PUT_HEADER 13
+
+static void put_u32(unsigned char *out, uint32_t value) {
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+    out[2] = (unsigned char)(value >> 16);
+    out[3] = (unsigned char)(value >> 24);
+}
+
+static uint32_t get_u32(const unsigned char *in) {
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static void log_put(const User *user) {
+    if (!wal_is_open()) return;
+    
+    unsigned char stack[512];
+    size_t name_len = strlen(user->name);
+    size_t email_len = strlen(user->email);
+    size_t len = LOG_PUT_HEADER + name_len + email_len;
+    unsigned char *record = len <= sizeof(stack) ? stack : (unsigned char*)malloc(len);
+    if (!record) return;
+    
+    record[0] = LOG_PUT;
+    put_u32(record + 1, (uint32_t)user->id);
+    put_u32(record + 5, (uint32_t)name_len);
+    memcpy(record + 9, user->name, name_len);
+    put_u32(record + 9 + name_len, (uint32_t)email_len);
+    memcpy(record + LOG_PUT_HEADER + name_len, user->email, email_len);
+    wal_append(record, len);
+    if (record != stack) free(record);
+}
+
+static void log_delete(int id) {
+    if (!wal_is_open()) return;
+    
+    unsigned char record[5];
+    record[0] = LOG_DELETE;
+    put_u32(record + 1, (uint32_t)id);
+    wal_append(record, sizeof(record));
+}
+
+static User* insert_user(User *new_user);
+
+// Replays one record. The log is not open yet, so nothing is re-logged.
+static void apply_log_record(const unsigned char *record, size_t len, void *ctx) {
+    if (len < 5) return;
+    int id = (int)get_u32(record + 1);
+    if (record[0] == LOG_DELETE) {
+        delete_user(id);
+        return;
+    }
+    if (record[0] != LOG_PUT || len < LOG_PUT_HEADER || id <= 0) return;
+    size_t name_len = get_u32(record + 5);
+    if (name_len > len - LOG_PUT_HEADER) return;
+    size_t email_len = get_u32(record + 9 + name_len);
+    if (email_len != len - LOG_PUT_HEADER - name_len) return;
+    
+    char *name = (char*)malloc(name_len + email_len + 2);
+    if (!name) return;
+    char *email = name + name_len + 1;
+    memcpy(name, record + 9, name_len);
+    name[name_len] = '\0';
+    memcpy(email, record + LOG_PUT_HEADER + name_len, email_len);
+    email[email_len] = '\0';
+    
+    User *existing = get_user_by_id(id);
+    if (existing) {
+        release_user(existing);
+        release_user(update_user(id, name, email));
+    } else {
+        User *user = new_user_record(id, name, email);
+        if (user) release_user(insert_user(user));
+    }
+    free(name);
+}
+
+long open_user_log(const char *path, int sync_interval_ms) {
+    if (!store_initialized) init_users();
+    return wal_open(path, snapshot_log_offset, sync_interval_ms, apply_log_record, NULL);
+}
+
+int sync_user_log(void) {
+    return wal_sync();
+}
+
+void close_user_log(void) {
+    // A snapshot still being written syncs and rotates the log
+    wait_user_snapshot();
+    wal_close();
+}
+
+long load_user_snapshot(const char *path) {
+    if (!store_initialized) init_users();
+    if (!path || mapped_users || wal_is_open()) return -1;
+    for (size_t i = 0; i < shard_count; i++) {
+        if (index_count(&id_shards[i].id_index) > 0) return -1;
+    }
+    if (!snapshot_map(path, &loaded_snapshot)) return -1;
+    
+    size_t count = loaded_snapshot.count;
+    mapped_users = (User*)calloc(count ? count : 1, sizeof(User));
+    if (!mapped_users) {
+        snapshot_unmap(&loaded_snapshot);
+        return -1;
+    }
+    mapped_user_count = count;
+    
+    // Size every table up front instead of growing it a step at a time.
+    // Emails hash evenly over the stripes, so theirs get some slack.
+    size_t per_shard[USERS_MAX_SHARDS] = {0};
+    for (size_t i = 0; i < count; i++) {
+        per_shard[shard_for_id(loaded_snapshot.records[i].id) - id_shards]++;
+    }
+    size_t per_stripe = count / shard_count + count / (shard_count * 8) + 1;
+    for (size_t i = 0; i < shard_count; i++) {
+        if (!index_presize(&id_shards[i].id_index, per_shard[i]) ||
+            !order_grow(&id_shards[i].order, per_shard[i] + 1) ||
+            !index_presize(&email_shards[i].email_index, per_stripe)) {
+            cleanup_users();
+            return -1;
+        }
+    }
+    
+    // Nothing else can reach the store yet, so records go in without
+    // locks. snapshot_map checked that ids are unique and ascending, so
+    // every shard_link appends at the tail.
+    long loaded = 0;
+    uint64_t version = next_generation();
+    for (size_t i = 0; i < count; i++) {
+        const SnapshotRecord *record = &loaded_snapshot.records[i];
+        User *user = &mapped_users[i];
+        user->id = record->id;
+        user->name = (char*)loaded_snapshot.heap + record->name;
+        user->email = (char*)loaded_snapshot.heap + record->email;
+        user->refcount = 1;
+        user->version = version;
+        
+        IdShard *shard = shard_for_id(user->id);
+        EmailShard *email_shard = shard_for_email(user->email);
+        if (find_by_email(email_shard, user->email)) continue;
+        if (!index_reserve(&shard->id_index) || !index_reserve(&email_shard->email_index) ||
+            !order_reserve(&shard->order)) {
+            cleanup_users();
+            return -1;
+        }
+        index_put(&shard->id_index, user);
+        order_insert(&shard->order, user->id);
+        shard_link(shard, user);
+        index_put(&email_shard->email_index, user);
+        if (user->id >= next_id) next_id = user->id + 1;
+        loaded++;
+    }
+    snapshot_log_offset = (long)loaded_snapshot.log_offset;
+    return loaded;
+}
+
+// One background snapshot at a time; only the thread that starts them
+// touches this state, apart from the finished flag
+typedef struct SnapshotJob {
+    char *path;
+    User **users;
+    size_t count;
+    uint64_t log_offset;
+    int ok;
+} SnapshotJob;
+
+static SnapshotJob snapshot_job;
+static pthread_t snapshot_thread;
+static int snapshot_started = 0;
+static long snapshot_finished = 0;
+
+static int compare_user_ids(const void *a, const void *b) {
+    int left = (*(User *const *)a)->id;
+    int right = (*(User *const *)b)->id;
+    return (left > right) - (left < right);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI snapshot_main(LPVOID arg) {
+#else
+static void* snapshot_main(void *arg) {
+#endif
+    SnapshotJob *job = (SnapshotJob*)arg;
+    
+    // The snapshot stands in for the log up to log_offset, so that much of
+    // the log has to be on disk before the snapshot can replace the last one
+    int ok = !wal_is_open() || wal_sync();
+    qsort(job->users, job->count, sizeof(User*), compare_user_ids);
+    ok = ok && snapshot_write(job->path, job->users, job->count, job->log_offset);
+    if (!ok) fprintf(stderr, "users: failed to write snapshot %s\n", job->path);
+    // Once the snapshot is in place the log before it is dead weight
+    if (ok && wal_is_open() && !wal_rotate((long long)job->log_offset)) {
+        fprintf(stderr, "users: failed to rotate the log after snapshot %s\n", job->path);
+    }
+    for (size_t i = 0; i < job->count; i++) {
+        release_user(job->users[i]);
+    }
+    job->ok = ok;
+    flag_store(&snapshot_finished, 1);
+    return 0;
+}
+
+int start_user_snapshot(const char *path) {
+    if (!path || !store_initialized) return 0;
+    if (snapshot_started) {
+        if (!flag_load(&snapshot_finished)) return 0;
+        wait_user_snapshot();
+    }
+    
+    size_t path_len = strlen(path);
+    char *path_copy = (char*)malloc(path_len + 1);
+    if (!path_copy) return 0;
+    memcpy(path_copy, path, path_len + 1);
+    
+    // Holding every shard's read lock pins the store and the log position
+    // together. Writers only wait for the references to be taken; sorting
+    // and writing happen on the snapshot thread.
+    size_t count = 0;
+    for (size_t i = 0; i < shard_count; i++) {
+        read_lock(&id_shards[i].lock);
+        count += index_count(&id_shards[i].id_index);
+    }
+    User **users = (User**)malloc((count ? count : 1) * sizeof(User*));
+    size_t taken = 0;
+    for (size_t i = 0; users && i < shard_count; i++) {
+        for (User *user = id_shards[i].head; user && taken < count; user = user->next) {
+            users[taken++] = retain_user(user);
+        }
+    }
+    long long position = wal_position();
+    for (size_t i = shard_count; i-- > 0;) {
+        read_unlock(&id_shards[i].lock);
     }
+    if (!users) {
+        free(path_copy);
+        return 0;
+    }
+    
+    snapshot_job.path = path_copy;
+    snapshot_job.users = users;
+    snapshot_job.count = taken;
+    snapshot_job.log_offset = position > 0 ? (uint64_t)position : 0;
+    snapshot_job.ok = 0;
+    snapshot_finished = 0;
+#ifdef _WIN32
+    snapshot_thread = CreateThread(NULL, 0, snapshot_main, &snapshot_job, 0, NULL);
+    int started = snapshot_thread != NULL;
+#else
+    int started = pthread_create(&snapshot_thread, NULL, snapshot_main, &snapshot_job) == 0;
+#endif
+    if (!started) {
+        for (size_t i = 0; i < taken; i++) {
+            release_user(users[i]);
+        }
+        free(users);
+        free(path_copy);
+        return 0;
+    }
+    snapshot_started = 1;
+    return 1;
+}
+
+int wait_user_snapshot(void) {
+    if (!snapshot_started) return 0;
+    
+#ifdef _WIN32
+    WaitForSingleObject(snapshot_thread, INFINITE);
+    CloseHandle(snapshot_thread);
+#else
+    pthread_join(snapshot_thread, NULL);
+#endif
+    snapshot_started = 0;
+    free(snapshot_job.users);
+    free(snapshot_job.path);
+    snapshot_job.users = NULL;
+    snapshot_job.path = NULL;
+    return snapshot_job.ok;
 }
 
 void seed_users(void) {
-    create_user("Alice", "alice@example.com");
-    create_user("Bob", "bob@example.com");
-    create_user("Charlie", "charlie@example.com");
+    release_user(create_user("Alice", "alice@example.com"));
+    release_user(create_user("Bob", "bob@example.com"));
+    release_user(create_user("Charlie", "charlie@example.com"));
 }
 
-User* create_user(const char *name, const char *email) {
-    if (!name || !email) return NULL;
+// Puts replacement wherever current sits in idx; both records share the key
+static void index_swap(UserIndex *idx, User *current, User *replacement) {
+    size_t hash = idx->hash(current);
+    User **slot = table_find(&idx->active, hash, match_record, current);
+    if (!slot) slot = table_find(&idx->old, hash, match_record, current);
+    if (slot) *slot = replacement;
+}
+
+// The *_locked helpers make one change with the id shard and the email
+// stripes it touches already held exclusively
+
+// Links a fresh record into the store, which takes its own reference
+static UserError publish_locked(IdShard *shard, EmailShard *email_shard, User *user) {
+    if (!index_reserve(&shard->id_index) || !index_reserve(&email_shard->email_index) ||
+        !order_reserve(&shard->order)) {
+        return USER_ERR_NO_MEMORY;
+    }
+    user->version = next_generation();
+    index_put(&shard->id_index, user);
+    order_insert(&shard->order, user->id);
+    shard_link(shard, user);
+    index_put(&email_shard->email_index, user);
+    retain_user(user);
+    log_put(user);
+    return USER_OK;
+}
+
+// Publishes the new version in place of the old one and drops the store's
+// reference to the old one
+static UserError replace_locked(IdShard *shard, EmailShard *old_email_shard, EmailShard *new_email_shard,
+                                User *user, User *replacement) {
+    int email_changed = strcmp(user->email, replacement->email) != 0;
+    if (email_changed && find_by_email(new_email_shard, replacement->email)) return USER_ERR_EMAIL_TAKEN;
+    if (email_changed && !index_reserve(&new_email_shard->email_index)) return USER_ERR_NO_MEMORY;
     
-    pthread_mutex_lock(&users_mutex);
+    replacement->version = next_generation();
+    index_swap(&shard->id_index, user, replacement);
+    if (email_changed) {
+        index_remove(&old_email_shard->email_index, user);
+        index_put(&new_email_shard->email_index, replacement);
+    } else {
+        index_swap(&old_email_shard->email_index, user, replacement);
+    }
+    shard_replace(shard, user, replacement);
+    release_user(user);
+    retain_user(replacement);
+    log_put(replacement);
+    return USER_OK;
+}
+
+static void remove_locked(IdShard *shard, EmailShard *email_shard, User *user) {
+    int id = user->id;
+    index_remove(&shard->id_index, user);
+    index_remove(&email_shard->email_index, user);
+    order_remove(&shard->order, id);
+    shard_unlink(shard, user);
+    next_generation();
+    // Readers still holding a reference keep the record alive
+    release_user(user);
+    log_delete(id);
+}
+
+// Hands out the next free id, or 0 once the id space is used up. Ids stop
+// short of INT_MAX so next_id, a 32-bit long on Windows, never wraps.
+static int allocate_id(void) {
+    for (;;) {
+        long id = counter_load(&next_id);
+        if (id >= INT_MAX) return 0;
+        if (counter_advance(&next_id, id)) return (int)id;
+    }
+}
+
+// Takes an id the caller chose. Only log replay, before anything else
+// runs, and batches, which hold the whole store, do that, so no create
+// moves next_id underneath it.
+static int claim_id(int id) {
+    if (id <= 0 || id >= INT_MAX) return 0;
+    if (id >= next_id) next_id = id + 1;
+    return id;
+}
+
+// Publishes a fresh record, giving it the next id unless it already has one
+static User* insert_user(User *new_user) {
+    const char *email = new_user->email;
+    EmailShard *email_shard = shard_for_email(email);
+    write_lock(&email_shard->lock);
     
-    User *new_user = (User*)malloc(sizeof(User));
-    if (!new_user) {
-        pthread_mutex_unlock(&users_mutex);
+    if (find_by_email(email_shard, email)) {
+        write_unlock(&email_shard->lock);
+        free_user(new_user);
+        set_error(USER_ERR_EMAIL_TAKEN);
         return NULL;
     }
     
-    new_user->id = next_id++;
-    new_user->name = strdup(name);
-    new_user->email = strdup(email);
-    new_user->next = users_head;
-    users_head = new_user;
+    // Replay restores records under their logged ids
+    new_user->id = new_user->id == 0 ? allocate_id() : claim_id(new_user->id);
+    if (new_user->id == 0) {
+        write_unlock(&email_shard->lock);
+        free_user(new_user);
+        set_error(USER_ERR_INVALID);
+        return NULL;
+    }
+    IdShard *shard = shard_for_id(new_user->id);
+    write_lock(&shard->lock);
+    UserError error = publish_locked(shard, email_shard, new_user);
+    write_unlock(&shard->lock);
+    write_unlock(&email_shard->lock);
     
-    pthread_mutex_unlock(&users_mutex);
+    set_error(error);
+    if (error != USER_OK) {
+        free_user(new_user);
+        return NULL;
+    }
     return new_user;
 }
 
-cJSON* get_all_users(void) {
-    pthread_mutex_lock(&users_mutex);
+User* create_user(const char *name, const char *email) {
+    if (!name || !email) {
+        set_error(USER_ERR_INVALID);
+        return NULL;
+    }
     
-    cJSON *array = cJSON_CreateArray();
-    User *current = users_head;
+    if (!store_initialized) init_users();
     
-    while (current) {
-        cJSON *user_json = user_to_json(current);
-        cJSON_AddItemToArray(array, user_json);
-        current = current->next;
+    // Copy the strings before taking any lock
+    User *new_user = new_user_record(0, name, email);
+    if (!new_user) {
+        set_error(USER_ERR_NO_MEMORY);
+        return NULL;
     }
-    
-    pthread_mutex_unlock(&users_mutex);
-    return array;
+    return insert_user(new_user);
 }
 
-User* get_user_by_id(int id) {
-    pthread_mutex_lock(&users_mutex);
+size_t for_each_user(UserVisitor visit, void *ctx) {
+    User *cursors[USERS_MAX_SHARDS];
+    size_t visited = 0;
     
-    User *current = users_head;
-    while (current) {
-        if (current->id == id) {
-            pthread_mutex_unlock(&users_mutex);
-            return current;
+    for (size_t i = 0; i < shard_count; i++) {
+        read_lock(&id_shards[i].lock);
+        cursors[i] = id_shards[i].head;
+    }
+    
+    // Each shard list is id-ordered; merge them into one ascending walk
+    for (;;) {
+        size_t pick = shard_count;
+        for (size_t i = 0; i < shard_count; i++) {
+            if (cursors[i] && (pick == shard_count || cursors[i]->id < cursors[pick]->id)) {
+                pick = i;
+            }
         }
-        current = current->next;
+        if (pick == shard_count) break;
+        visit(cursors[pick], ctx);
+        cursors[pick] = cursors[pick]->next;
+        visited++;
     }
     
-    pthread_mutex_unlock(&users_mutex);
-    return NULL;
+    for (size_t i = shard_count; i-- > 0;) {
+        read_unlock(&id_shards[i].lock);
+    }
+    return visited;
 }
 
-User* update_user(int id, const char *name, const char *email) {
-    pthread_mutex_lock(&users_mutex);
+size_t get_users_page(int after, size_t limit, User **page, int *next_after) {
+    User *cursors[USERS_MAX_SHARDS];
+    size_t count = 0;
     
-    User *user = NULL;
-    User *current = users_head;
+    for (size_t i = 0; i < shard_count; i++) {
+        IdShard *shard = &id_shards[i];
+        read_lock(&shard->lock);
+        int first = order_seek(&shard->order, after);
+        cursors[i] = first ? find_by_id(shard, first) : NULL;
+    }
     
-    while (current) {
-        if (current->id == id) {
-            user = current;
+    // Same merge as for_each_user, but starting at the cursor and stopping
+    // after one page, so the cost follows the page size, not the store size
+    int more = 0;
+    for (;;) {
+        size_t pick = shard_count;
+        for (size_t i = 0; i < shard_count; i++) {
+            if (cursors[i] && (pick == shard_count || cursors[i]->id < cursors[pick]->id)) {
+                pick = i;
+            }
+        }
+        if (pick == shard_count) break;
+        if (count == limit) {
+            more = 1;
             break;
         }
-        current = current->next;
+        page[count++] = retain_user(cursors[pick]);
+        cursors[pick] = cursors[pick]->next;
     }
     
-    if (user) {
-        if (name) {
-            free(user->name);
-            user->name = strdup(name);
-        }
-        if (email) {
-            free(user->email);
-            user->email = strdup(email);
-        }
+    for (size_t i = shard_count; i-- > 0;) {
+        read_unlock(&id_shards[i].lock);
     }
+    if (next_after) *next_after = more && count > 0 ? page[count - 1]->id : 0;
+    return count;
+}
+
+static void add_user_to_array(const User *user, void *ctx) {
+    cJSON_AddItemToArray((cJSON*)ctx, user_to_json((User*)user));
+}
+
+cJSON* get_all_users(void) {
+    cJSON *array = cJSON_CreateArray();
+    for_each_user(add_user_to_array, array);
+    return array;
+}
+
+User* get_user_by_id(int id) {
+    if (!store_initialized) return NULL;
     
-    pthread_mutex_unlock(&users_mutex);
+    IdShard *shard = shard_for_id(id);
+    read_lock(&shard->lock);
+    User *user = retain_user(find_by_id(shard, id));
+    read_unlock(&shard->lock);
     return user;
 }
 
+User* get_user_by_email(const char *email) {
+    if (!email || !store_initialized) return NULL;
+    
+    EmailShard *shard = shard_for_email(email);
+    read_lock(&shard->lock);
+    User *user = retain_user(find_by_email(shard, email));
+    read_unlock(&shard->lock);
+    return user;
+}
+
+User* update_user(int id, const char *name, const char *email) {
+    for (;;) {
+        // The email stripes to lock depend on the current record, so look
+        // it up first and retry if another writer replaces it meanwhile.
+        User *user = get_user_by_id(id);
+        if (!user) {
+            set_error(USER_ERR_NOT_FOUND);
+            return NULL;
+        }
+        
+        int email_changed = email && strcmp(email, user->email) != 0;
+        User *replacement = new_user_record(id, name ? name : user->name,
+                                            email ? email : user->email);
+        if (!replacement) {
+            release_user(user);
+            set_error(USER_ERR_NO_MEMORY);
+            return NULL;
+        }
+        
+        EmailShard *old_email_shard = shard_for_email(user->email);
+        EmailShard *new_email_shard = email_changed ? shard_for_email(email) : old_email_shard;
+        IdShard *shard = shard_for_id(id);
+        lock_email_shards(old_email_shard, new_email_shard);
+        write_lock(&shard->lock);
+        
+        if (find_by_id(shard, id) != user) {
+            write_unlock(&shard->lock);
+            unlock_email_shards(old_email_shard, new_email_shard);
+            free_user(replacement);
+            release_user(user);
+            continue;
+        }
+        UserError error = replace_locked(shard, old_email_shard, new_email_shard, user, replacement);
+        
+        write_unlock(&shard->lock);
+        unlock_email_shards(old_email_shard, new_email_shard);
+        release_user(user);
+        set_error(error);
+        if (error != USER_OK) {
+            free_user(replacement);
+            return NULL;
+        }
+        return replacement;
+    }
+}
+
 int delete_user(int id) {
-    pthread_mutex_lock(&users_mutex);
+    for (;;) {
+        User *user = get_user_by_id(id);
+        if (!user) return 0;
+        
+        EmailShard *email_shard = shard_for_email(user->email);
+        IdShard *shard = shard_for_id(id);
+        write_lock(&email_shard->lock);
+        write_lock(&shard->lock);
+        
+        int deleted = find_by_id(shard, id) == user;
+        if (deleted) remove_locked(shard, email_shard, user);
+        
+        write_unlock(&shard->lock);
+        write_unlock(&email_shard->lock);
+        release_user(user);
+        if (deleted) return 1;
+    }
+}
+
+// A batch holds every lock in the store for one slice of operations at a
+// time, so readers wait for at most a slice rather than the whole batch
+#define USER_BATCH_SLICE 256
+
+static void lock_store(void) {
+    for (size_t i = 0; i < shard_count; i++) write_lock(&email_shards[i].lock);
+    for (size_t i = 0; i < shard_count; i++) write_lock(&id_shards[i].lock);
+}
+
+static void unlock_store(void) {
+    for (size_t i = shard_count; i-- > 0;) write_unlock(&id_shards[i].lock);
+    for (size_t i = shard_count; i-- > 0;) write_unlock(&email_shards[i].lock);
+}
+
+// Creates a user under `id`, or under the next free id if it is 0
+static UserError create_locked(UserOp *op, int id) {
+    if (!op->name || !op->email) return USER_ERR_INVALID;
+    EmailShard *email_shard = shard_for_email(op->email);
+    if (find_by_email(email_shard, op->email)) return USER_ERR_EMAIL_TAKEN;
+    id = id == 0 ? allocate_id() : claim_id(id);
+    if (id == 0) return USER_ERR_INVALID;
+    User *user = new_user_record(id, op->name, op->email);
+    if (!user) return USER_ERR_NO_MEMORY;
+    UserError error = publish_locked(shard_for_id(user->id), email_shard, user);
+    if (error != USER_OK) {
+        free_user(user);
+        return error;
+    }
+    op->user = user;
+    return USER_OK;
+}
+
+static UserError apply_op_locked(UserOp *op) {
+    if (op->type == USER_OP_CREATE) return create_locked(op, 0);
+    if (op->id <= 0) return USER_ERR_NOT_FOUND;
     
-    User *current = users_head;
-    User *prev = NULL;
+    IdShard *shard = shard_for_id(op->id);
+    User *user = find_by_id(shard, op->id);
+    if (op->type == USER_OP_PUT) {
+        if (!op->name || !op->email) return USER_ERR_INVALID;
+        if (!user) return create_locked(op, op->id);
+    }
+    if (!user) return USER_ERR_NOT_FOUND;
+    EmailShard *email_shard = shard_for_email(user->email);
+    if (op->type == USER_OP_DELETE) {
+        remove_locked(shard, email_shard, user);
+        return USER_OK;
+    }
+    if (op->type != USER_OP_UPDATE && op->type != USER_OP_PUT) return USER_ERR_INVALID;
     
-    while (current) {
-        if (current->id == id) {
-            if (prev) {
-                prev->next = current->next;
-            } else {
-                users_head = current->next;
-            }
-            free(current->name);
-            free(current->email);
-            free(current);
-            pthread_mutex_unlock(&users_mutex);
-            return 1;
+    User *replacement = new_user_record(op->id, op->name ? op->name : user->name,
+                                        op->email ? op->email : user->email);
+    if (!replacement) return USER_ERR_NO_MEMORY;
+    UserError error = replace_locked(shard, email_shard, shard_for_email(replacement->email), user, replacement);
+    if (error != USER_OK) {
+        free_user(replacement);
+        return error;
+    }
+    op->user = replacement;
+    return USER_OK;
+}
+
+size_t apply_user_batch(UserOp *ops, size_t count) {
+    if (!store_initialized) init_users();
+    
+    size_t succeeded = 0;
+    for (size_t start = 0; start < count; start += USER_BATCH_SLICE) {
+        size_t end = count - start > USER_BATCH_SLICE ? start + USER_BATCH_SLICE : count;
+        lock_store();
+        for (size_t i = start; i < end; i++) {
+            ops[i].user = NULL;
+            ops[i].error = apply_op_locked(&ops[i]);
+            if (ops[i].error == USER_OK) succeeded++;
         }
-        prev = current;
-        current = current->next;
+        unlock_store();
+    }
+    return succeeded;
+}
+
+static void table_accumulate_stats(const UserIndex *idx, const IndexTable *table, size_t *probes, size_t *max_probe) {
+    if (!table->slots) return;
+    size_t mask = table->capacity - 1;
+    for (size_t pos = 0; pos < table->capacity; pos++) {
+        User *slot = table->slots[pos];
+        if (slot == NULL || slot == INDEX_TOMBSTONE) continue;
+        size_t home = idx->hash(slot) & mask;
+        size_t distance = ((pos - home) & mask) + 1;
+        *probes += distance;
+        if (distance > *max_probe) *max_probe = distance;
+    }
+}
+
+void get_user_store_stats(UserStoreStats *stats) {
+    if (!stats) return;
+    memset(stats, 0, sizeof(*stats));
+    
+    size_t probes = 0;
+    stats->shard_count = shard_count;
+    for (size_t i = 0; i < shard_count; i++) {
+        IdShard *shard = &id_shards[i];
+        read_lock(&shard->lock);
+        stats->user_count += index_count(&shard->id_index);
+        stats->index_capacity += shard->id_index.active.capacity;
+        stats->index_resizing |= shard->id_index.old.slots != NULL;
+        table_accumulate_stats(&shard->id_index, &shard->id_index.active, &probes, &stats->index_max_probe);
+        table_accumulate_stats(&shard->id_index, &shard->id_index.old, &probes, &stats->index_max_probe);
+        read_unlock(&shard->lock);
+    }
+    if (stats->user_count > 0) {
+        stats->index_avg_probe = (double)probes / (double)stats->user_count;
     }
     
-    pthread_mutex_unlock(&users_mutex);
-    return 0;
+    UserPoolStats pool;
+    user_pool_stats(&pool);
+    stats->bytes_live = pool.bytes_live;
+    stats->bytes_reserved = pool.bytes_reserved;
+    stats->fragmentation = pool.fragmentation;
+    stats->lock_waits = (size_t)stat_load(&lock_waits);
+    stats->lock_wait_seconds = (double)stat_load(&lock_wait_ns) / 1e9;
 }
 
 cJSON* user_to_json(User *user) {
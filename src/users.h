@@ -1,18 +1,59 @@
 #ifndef USERS_H
 #define USERS_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <cjson/cJSON.h>
 
+// A record's compact JSON, e.g. {"id":1,"name":"Alice","email":"..."}.
+// It is rendered the first time the record is read and then kept with it.
+typedef struct UserFragment {
+    size_t len;
+    char json[];                // not NUL-terminated
+} UserFragment;
+
+// Records are immutable once returned: update_user publishes a new copy.
+// Every User* handed out by this API is a counted reference that the
+// caller must give back with release_user().
 typedef struct User {
     int id;
     char *name;
     char *email;
     struct User *next;
+    struct User *prev;
+    long refcount;
+    uint64_t version;           // store generation that published this record
+    UserFragment *fragment;     // attached on first read; see user_fragment()
 } User;
 
-// Initialize user system
+typedef enum UserError {
+    USER_OK = 0,
+    USER_ERR_INVALID,
+    USER_ERR_NOT_FOUND,
+    USER_ERR_EMAIL_TAKEN,
+    USER_ERR_NO_MEMORY
+} UserError;
+
+typedef struct UserStoreStats {
+    size_t user_count;
+    size_t shard_count;
+    size_t index_capacity;      // slots summed over all shards
+    size_t index_max_probe;     // longest probe sequence for any live id
+    double index_avg_probe;     // average slots inspected per successful lookup
+    int index_resizing;         // 1 while entries are migrating to a grown table
+    size_t bytes_live;          // record memory in use, strings included
+    size_t bytes_reserved;      // record memory held from the system allocator
+    double fragmentation;       // 1 - live / reserved
+    size_t lock_waits;          // shard lock acquisitions that had to block
+    double lock_wait_seconds;   // total time spent blocked on them
+} UserStoreStats;
+
+// Initialize user system with the default number of lock stripes
 void init_users(void);
 
+// Initialize user system striped over `shards` locks (rounded up to a power of two)
+void init_users_sharded(size_t shards);
+
 // Cleanup user system
 void cleanup_users(void);
 
@@ -22,21 +63,113 @@ void shutdown_users(void);
 // Seed initial users
 void seed_users(void);
 
-// Create a new user
+// Replay the write-ahead log at `path` into the empty store, then append
+// every create, update and delete to it. Writes are committed together
+// every sync_interval_ms with one fsync, so a crash loses at most that
+// window. Returns the number of records replayed, or -1 on failure.
+long open_user_log(const char *path, int sync_interval_ms);
+
+// Wait until every change made so far is on disk. Returns 0 on failure.
+int sync_user_log(void);
+
+// Commit outstanding changes and close the log (shutdown_users does this)
+void close_user_log(void);
+
+// Load a snapshot written by start_user_snapshot into the empty store,
+// before open_user_log, which then replays only the log records written
+// after it. Users are read straight from the mapped file; an update
+// publishes a pooled copy as usual. Returns the number of users loaded,
+// or -1 if the file is missing or invalid or the store is not empty.
+long load_user_snapshot(const char *path);
+
+// Start writing the store to `path` on a background thread, replacing
+// the file atomically. Returns 0 if a snapshot is still being written or
+// one cannot be started. Call from one thread only.
+int start_user_snapshot(const char *path);
+
+// Wait for the snapshot started last. Returns 1 if it was written.
+int wait_user_snapshot(void);
+
+// Create a new user (NULL if the email is already in use)
 User* create_user(const char *name, const char *email);
 
-// Get all users as JSON array
+// Get all users as JSON array, ordered by id
 cJSON* get_all_users(void);
 
+// Visit every user in ascending id order under the store's read locks.
+// The visitor must not call back into the store. Returns users visited.
+typedef void (*UserVisitor)(const User *user, void *ctx);
+size_t for_each_user(UserVisitor visit, void *ctx);
+
+// The fragment attached to this record, or NULL if none has been yet.
+// A record's fragment never changes, and an update publishes a new record
+// without one, so a fragment can never describe stale values.
+const UserFragment* user_fragment(const User *user);
+
+// Allocate a fragment for len bytes of JSON, which the caller fills in
+UserFragment* user_fragment_alloc(size_t len);
+
+// Attach a fragment from user_fragment_alloc to the record. If another
+// thread attached one first, the given one is freed and theirs returned.
+// The record owns the result and frees it along with itself.
+const UserFragment* user_attach_fragment(const User *user, UserFragment *fragment);
+
+// Fill page with up to limit users whose id is greater than after, in
+// ascending order. Each entry is a reference the caller must release.
+// next_after receives the cursor for the following page, or 0 if this
+// page reached the end. Returns the number of users stored.
+size_t get_users_page(int after, size_t limit, User **page, int *next_after);
+
 // Get user by ID
 User* get_user_by_id(int id);
 
-// Update user
+// Get user by exact email match
+User* get_user_by_email(const char *email);
+
+// Update user (NULL if not found or the new email belongs to someone else)
 User* update_user(int id, const char *name, const char *email);
 
 // Delete user
 int delete_user(int id);
 
+typedef enum UserOpType {
+    USER_OP_CREATE,
+    USER_OP_UPDATE,
+    USER_OP_DELETE,
+    USER_OP_PUT                 // create under the given id, or replace it
+} UserOpType;
+
+// One write in a batch. Creates and puts need name and email; an update
+// keeps the current value of either one left NULL. apply_user_batch fills in error
+// and, for a create or update that succeeded, user, which is a reference
+// the caller must release.
+typedef struct UserOp {
+    UserOpType type;
+    int id;
+    const char *name;
+    const char *email;
+    UserError error;
+    User *user;
+} UserOp;
+
+// Apply ops in order, taking the store's locks once per slice of ops
+// instead of once per op. Each op succeeds or fails on its own, with the
+// same checks as the single-op calls. Returns the number that succeeded.
+size_t apply_user_batch(UserOp *ops, size_t count);
+
+// Counter bumped by every change to the store; it never goes backwards
+// while the process runs. Equal values mean nothing was written in between.
+uint64_t users_generation(void);
+
+// Reason the last create_user/update_user on this thread returned NULL
+UserError users_last_error(void);
+
+// Snapshot of store size and id index health
+void get_user_store_stats(UserStoreStats *stats);
+
+// Drop a reference returned by create/get/update
+void release_user(User *user);
+
 // Convert user to JSON
 cJSON* user_to_json(User *user);
 
@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+// Windows threading
+typedef CRITICAL_SECTION pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+typedef HANDLE pthread_t;
+static inline int pthread_mutex_init(pthread_mutex_t *mutex, void *attr) {
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_lock(pthread_mutex_t *mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_destroy(pthread_mutex_t *mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_cond_init(pthread_cond_t *cond, void *attr) {
+    InitializeConditionVariable(cond);
+    return 0;
+}
+static inline int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+    return 0;
+}
+static inline int pthread_cond_signal(pthread_cond_t *cond) {
+    WakeConditionVariable(cond);
+    return 0;
+}
+static inline int pthread_cond_broadcast(pthread_cond_t *cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
+static inline int pthread_cond_destroy(pthread_cond_t *cond) {
+    return 0;
+}
+static void cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, int ms) {
+    SleepConditionVariableCS(cond, mutex, (DWORD)ms);
+}
+#define file_sync(f) _commit(_fileno(f))
+#define file_truncate(f, size) _chsize_s(_fileno(f), (__int64)(size))
+#define replace_file(from, to) MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+static void cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, int ms) {
+    struct timespec until;
+    timespec_get(&until, TIME_UTC);
+    until.tv_nsec += (long)ms * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(cond, mutex, &until);
+}
+#define file_sync(f) fsync(fileno(f))
+#define file_truncate(f, size) ftruncate(fileno(f), (off_t)(size))
+#define replace_file(from, to) (rename(from, to) == 0)
+
+// Makes a rename durable by syncing the containing directory
+static void sync_parent_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char dir[1024];
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if ((size_t)(slash - path) < sizeof(dir)) {
+        memcpy(dir, path, (size_t)(slash - path));
+        dir[slash == path ? 1 : slash - path] = '\0';
+    } else {
+        return;
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+#endif
+#include "wal.h"
+
+#define WAL_FRAME_HEADER 8              // u32 length, u32 crc32, both little-endian
+#define WAL_MAX_RECORD (16u << 20)
+#define WAL_EAGER_COMMIT_BYTES (1 << 20) // commit early rather than buffer more
+// A rotated log opens with one frame holding this magic and the log
+// offset of the record after it; positions count from the first log
+#define WAL_SEGMENT_MAGIC "UWALSEG\0"
+#define WAL_SEGMENT_RECORD 16
+
+static FILE *log_file = NULL;
+static char *log_path = NULL;
+static int log_open = 0;
+static int commit_interval_ms = 0;
+// Where the file's first record sits in the log and in the file. Only
+// wal_open and then the commit thread touch these.
+static uint64_t segment_base = 0;
+static long segment_start = 0;
+
+// Appenders fill `pending` under log_lock; the commit thread swaps it with
+// `spare` and writes the batch without holding the lock
+static pthread_mutex_t log_lock;
+static pthread_cond_t commit_wake;
+static pthread_cond_t commit_done;
+static unsigned char *pending = NULL;
+static size_t pending_len = 0;
+static size_t pending_cap = 0;
+static unsigned char *spare = NULL;
+static size_t spare_cap = 0;
+static uint64_t appended_bytes = 0;
+static uint64_t base_bytes = 0;         // file length when the log was opened
+static uint64_t synced_bytes = 0;
+static int sync_waiters = 0;
+static int commit_stopping = 0;
+static int commit_failed = 0;
+static int rotate_requested = 0;        // set by wal_rotate, done by the commit thread
+static uint64_t rotate_to = 0;
+static int rotate_ok = 0;
+static pthread_t commit_thread;
+
+static uint32_t crc_table[256];
+
+// Filled by wal_open, before any appender can run
+static void init_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_of(const unsigned char *data, size_t len) {
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static void put_u32(unsigned char *out, uint32_t value) {
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+    out[2] = (unsigned char)(value >> 16);
+    out[3] = (unsigned char)(value >> 24);
+}
+
+static uint32_t get_u32(const unsigned char *in) {
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static void put_u64(unsigned char *out, uint64_t value) {
+    put_u32(out, (uint32_t)value);
+    put_u32(out + 4, (uint32_t)(value >> 32));
+}
+
+static uint64_t get_u64(const unsigned char *in) {
+    return (uint64_t)get_u32(in) | (uint64_t)get_u32(in + 4) << 32;
+}
+
+// Reads the segment frame a rotated log starts with. A log that was never
+// rotated has none and starts at log offset 0.
+static void read_segment_header(FILE *f, uint64_t *base, long *start) {
+    unsigned char frame[WAL_FRAME_HEADER + WAL_SEGMENT_RECORD];
+    const unsigned char *record = frame + WAL_FRAME_HEADER;
+    *base = 0;
+    *start = 0;
+    if (fseek(f, 0, SEEK_SET) != 0 || fread(frame, 1, sizeof(frame), f) != sizeof(frame)) return;
+    if (get_u32(frame) != WAL_SEGMENT_RECORD || memcmp(record, WAL_SEGMENT_MAGIC, 8) != 0 ||
+        crc32_of(record, WAL_SEGMENT_RECORD) != get_u32(frame + 4)) {
+        return;
+    }
+    *base = get_u64(record + 8);
+    *start = (long)sizeof(frame);
+}
+
+// Applies intact frames from offset `start` on and returns how many;
+// *valid_end receives the offset just past the last one
+static long replay(FILE *f, long start, WalApply apply, void *ctx, long *valid_end) {
+    unsigned char header[WAL_FRAME_HEADER];
+    unsigned char *record = NULL;
+    size_t record_cap = 0;
+    long records = 0;
+    *valid_end = start;
+    
+    if (fseek(f, start, SEEK_SET) != 0) return 0;
+    while (fread(header, 1, sizeof(header), f) == sizeof(header)) {
+        uint32_t len = get_u32(header);
+        if (len == 0 || len > WAL_MAX_RECORD) break;
+        if (len > record_cap) {
+            unsigned char *grown = (unsigned char*)realloc(record, len);
+            if (!grown) break;
+            record = grown;
+            record_cap = len;
+        }
+        if (fread(record, 1, len, f) != len || crc32_of(record, len) != get_u32(header + 4)) break;
+        if (apply) apply(record, len, ctx);
+        *valid_end += (long)(WAL_FRAME_HEADER + len);
+        records++;
+    }
+    free(record);
+    return records;
+}
+
+// Rewrites the log as a fresh segment holding only the records from log
+// offset `to` on: they are copied behind a segment frame into a synced
+// temporary file that is renamed over the log. Runs on the commit thread,
+// the only writer of the file, once everything before `to` is written.
+static int rotate_segment(uint64_t to) {
+    if (to <= segment_base) return 1;
+    if (fseek(log_file, 0, SEEK_END) != 0) return 0;
+    long file_len = ftell(log_file);
+    if (to - segment_base > (uint64_t)(file_len - segment_start)) return 0;
+    long from = segment_start + (long)(to - segment_base);
+    
+    size_t path_len = strlen(log_path);
+    char *tmp_path = (char*)malloc(path_len + 5);
+    unsigned char *buffer = (unsigned char*)malloc(64 * 1024);
+    FILE *tmp = NULL;
+    int ok = tmp_path && buffer;
+    if (ok) {
+        memcpy(tmp_path, log_path, path_len);
+        memcpy(tmp_path + path_len, ".tmp", 5);
+        tmp = fopen(tmp_path, "wb");
+        ok = tmp != NULL;
+    }
+    
+    unsigned char frame[WAL_FRAME_HEADER + WAL_SEGMENT_RECORD];
+    unsigned char *record = frame + WAL_FRAME_HEADER;
+    memcpy(record, WAL_SEGMENT_MAGIC, 8);
+    put_u64(record + 8, to);
+    put_u32(frame, WAL_SEGMENT_RECORD);
+    put_u32(frame + 4, crc32_of(record, WAL_SEGMENT_RECORD));
+    ok = ok && fwrite(frame, 1, sizeof(frame), tmp) == sizeof(frame) && fseek(log_file, from, SEEK_SET) == 0;
+    while (ok) {
+        size_t got = fread(buffer, 1, 64 * 1024, log_file);
+        if (got == 0) {
+            ok = !ferror(log_file);
+            break;
+        }
+        ok = fwrite(buffer, 1, got, tmp) == got;
+    }
+    if (tmp) {
+        ok = ok && fflush(tmp) == 0 && file_sync(tmp) == 0;
+        ok = fclose(tmp) == 0 && ok;
+    }
+    
+    if (ok) {
+        // Windows will not replace a file that is still open
+        fclose(log_file);
+        ok = replace_file(tmp_path, log_path);
+#ifndef _WIN32
+        if (ok) sync_parent_dir(log_path);
+#endif
+        log_file = fopen(log_path, "ab+");
+    } else {
+        // Appends follow, and a stream needs a seek between reads and writes
+        fseek(log_file, 0, SEEK_END);
+    }
+    if (!ok && tmp_path) remove(tmp_path);
+    if (ok && log_file) {
+        segment_base = to;
+        segment_start = (long)sizeof(frame);
+    }
+    free(tmp_path);
+    free(buffer);
+    return ok && log_file;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI commit_main(LPVOID arg) {
+#else
+static void* commit_main(void *arg) {
+#endif
+    (void)arg;
+    pthread_mutex_lock(&log_lock);
+    for (;;) {
+        if (!commit_stopping && sync_waiters == 0 && !rotate_requested && pending_len < WAL_EAGER_COMMIT_BYTES) {
+            cond_wait_ms(&commit_wake, &log_lock, commit_interval_ms);
+        }
+    
+        unsigned char *batch = pending;
+        size_t batch_cap = pending_cap;
+        size_t len = pending_len;
+        uint64_t upto = appended_bytes;
+        int stopping = commit_stopping;
+        int rotate = rotate_requested;
+        uint64_t to = rotate_to;
+        pending = spare;
+        pending_cap = spare_cap;
+        pending_len = 0;
+        pthread_mutex_unlock(&log_lock);
+    
+        // One write and one fsync for everything appended since last time
+        int ok = log_file != NULL;
+        if (ok && len > 0) {
+            ok = fwrite(batch, 1, len, log_file) == len && fflush(log_file) == 0 && file_sync(log_file) == 0;
+        }
+        spare = batch;
+        spare_cap = batch_cap;
+        int rotated = 0;
+        if (rotate) {
+            rotated = ok && to <= base_bytes + upto && rotate_segment(to);
+            ok = ok && log_file != NULL;
+        }
+    
+        pthread_mutex_lock(&log_lock);
+        if (!ok && !commit_failed) {
+            fprintf(stderr, "wal: write failed, later changes are not durable\n");
+            commit_failed = 1;
+        }
+        if (rotate) {
+            rotate_requested = 0;
+            rotate_ok = rotated;
+        }
+        synced_bytes = upto;
+        pthread_cond_broadcast(&commit_done);
+        if (stopping && pending_len == 0) break;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return 0;
+}
+
+long wal_open(const char *path, long skip_bytes, int sync_interval_ms, WalApply apply, void *ctx) {
+    if (log_open || !path || skip_bytes < 0) return -1;
+    
+    size_t path_len = strlen(path);
+    log_path = (char*)malloc(path_len + 1);
+    if (!log_path) return -1;
+    memcpy(log_path, path, path_len + 1);
+    FILE *f = fopen(path, "ab+");
+    if (!f || fseek(f, 0, SEEK_END) != 0) {
+        if (f) fclose(f);
+        free(log_path);
+        log_path = NULL;
+        return -1;
+    }
+    long file_len = ftell(f);
+    init_crc_table();
+    uint64_t base;
+    long start;
+    read_segment_header(f, &base, &start);
+    // A log that starts after the snapshot it belongs to, or ends before
+    // it, is some other log
+    if ((uint64_t)skip_bytes < base || (uint64_t)skip_bytes - base > (uint64_t)(file_len - start)) {
+        fclose(f);
+        free(log_path);
+        log_path = NULL;
+        return -1;
+    }
+    long valid_end = 0;
+    long records = replay(f, start + (long)((uint64_t)skip_bytes - base), apply, ctx, &valid_end);
+    if (fseek(f, 0, SEEK_END) != 0 || (ftell(f) > valid_end && file_truncate(f, valid_end) != 0)) {
+        fclose(f);
+        free(log_path);
+        log_path = NULL;
+        return -1;
+    }
+    
+    log_file = f;
+    segment_base = base;
+    segment_start = start;
+    commit_interval_ms = sync_interval_ms > 0 ? sync_interval_ms : 1;
+    pending_len = 0;
+    appended_bytes = 0;
+    base_bytes = base + (uint64_t)(valid_end - start);
+    synced_bytes = 0;
+    sync_waiters = 0;
+    commit_stopping = 0;
+    commit_failed = 0;
+    rotate_requested = 0;
+    pthread_mutex_init(&log_lock, NULL);
+    pthread_cond_init(&commit_wake, NULL);
+    pthread_cond_init(&commit_done, NULL);
+#ifdef _WIN32
+    commit_thread = CreateThread(NULL, 0, commit_main, NULL, 0, NULL);
+    int started = commit_thread != NULL;
+#else
+    int started = pthread_create(&commit_thread, NULL, commit_main, NULL) == 0;
+#endif
+    if (!started) {
+        pthread_cond_destroy(&commit_done);
+        pthread_cond_destroy(&commit_wake);
+        pthread_mutex_destroy(&log_lock);
+        fclose(f);
+        log_file = NULL;
+        free(log_path);
+        log_path = NULL;
+        return -1;
+    }
+    log_open = 1;
+    return records;
+}
+
+int wal_append(const void *record, size_t len) {
+    if (!log_open || len == 0 || len > WAL_MAX_RECORD) return 0;
+    
+    unsigned char header[WAL_FRAME_HEADER];
+    put_u32(header, (uint32_t)len);
+    put_u32(header + 4, crc32_of((const unsigned char*)record, len));
+    
+    pthread_mutex_lock(&log_lock);
+    size_t needed = pending_len + sizeof(header) + len;
+    if (needed > pending_cap) {
+        size_t cap = pending_cap ? pending_cap : 4096;
+        while (cap < needed) cap *= 2;
+        unsigned char *grown = (unsigned char*)realloc(pending, cap);
+        if (!grown) {
+            pthread_mutex_unlock(&log_lock);
+            return 0;
+        }
+        pending = grown;
+        pending_cap = cap;
+    }
+    memcpy(pending + pending_len, header, sizeof(header));
+    memcpy(pending + pending_len + sizeof(header), record, len);
+    pending_len = needed;
+    appended_bytes += sizeof(header) + len;
+    if (pending_len >= WAL_EAGER_COMMIT_BYTES) pthread_cond_signal(&commit_wake);
+    pthread_mutex_unlock(&log_lock);
+    return 1;
+}
+
+int wal_sync(void) {
+    if (!log_open) return 0;
+    
+    pthread_mutex_lock(&log_lock);
+    uint64_t target = appended_bytes;
+    sync_waiters++;
+    pthread_cond_signal(&commit_wake);
+    while (synced_bytes < target) {
+        pthread_cond_wait(&commit_done, &log_lock);
+    }
+    sync_waiters--;
+    int ok = !commit_failed;
+    pthread_mutex_unlock(&log_lock);
+    return ok;
+}
+
+void wal_close(void) {
+    if (!log_open) return;
+    
+    pthread_mutex_lock(&log_lock);
+    commit_stopping = 1;
+    pthread_cond_signal(&commit_wake);
+    pthread_mutex_unlock(&log_lock);
+#ifdef _WIN32
+    WaitForSingleObject(commit_thread, INFINITE);
+    CloseHandle(commit_thread);
+#else
+    pthread_join(commit_thread, NULL);
+#endif
+    log_open = 0;
+    
+    pthread_cond_destroy(&commit_done);
+    pthread_cond_destroy(&commit_wake);
+    pthread_mutex_destroy(&log_lock);
+    if (log_file) fclose(log_file);
+    log_file = NULL;
+    free(log_path);
+    log_path = NULL;
+    free(pending);
+    free(spare);
+    pending = NULL;
+    spare = NULL;
+    pending_cap = 0;
+    spare_cap = 0;
+}
+
+int wal_rotate(long long upto) {
+    if (!log_open || upto < 0) return 0;
+    
+    pthread_mutex_lock(&log_lock);
+    while (rotate_requested) {
+        pthread_cond_wait(&commit_done, &log_lock);
+    }
+    rotate_to = (uint64_t)upto;
+    rotate_requested = 1;
+    pthread_cond_signal(&commit_wake);
+    while (rotate_requested) {
+        pthread_cond_wait(&commit_done, &log_lock);
+    }
+    int ok = rotate_ok;
+    pthread_mutex_unlock(&log_lock);
+    return ok;
+}
+
+long long wal_position(void) {
+    if (!log_open) return -1;
+    
+    pthread_mutex_lock(&log_lock);
+    long long position = (long long)(base_bytes + appended_bytes);
+    pthread_mutex_unlock(&log_lock);
+    return position;
+}
+
+int wal_is_open(void) {
+    return log_open;
+}
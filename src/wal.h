@@ -0,0 +1,50 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+
+// Append-only write-ahead log. Each record is framed with its length and
+// a CRC32, so a crash mid-write leaves a torn tail that replay detects and
+// cuts off. Appends only copy into memory; a commit thread writes what has
+// accumulated and fsyncs it once per interval (group commit), so at most
+// one interval of acknowledged writes can be lost in a crash.
+//
+// Positions count bytes of log from its very first record. Rotating
+// drops the records before a position by rewriting the file as a fresh
+// segment, so positions taken earlier keep their meaning.
+
+typedef void (*WalApply)(const unsigned char *record, size_t len, void *ctx);
+
+// Replay every intact record in `path` that starts at or after
+// skip_bytes through apply, drop a torn tail, then keep the file open for
+// appends with a commit every sync_interval_ms. skip_bytes is a position
+// from wal_position, for records already covered by a snapshot. Returns
+// the number of records replayed, or -1 if the log cannot be opened, does
+// not hold every record from skip_bytes on, or the commit thread cannot
+// start.
+long wal_open(const char *path, long skip_bytes, int sync_interval_ms, WalApply apply, void *ctx);
+
+// Queue one record. Returns 0 if the log is not open or out of memory.
+int wal_append(const void *record, size_t len);
+
+// Block until everything appended so far is on disk. Returns 0 if a write
+// or fsync has failed since the log was opened.
+int wal_sync(void);
+
+// Commit what is queued, stop the commit thread and close the file
+void wal_close(void);
+
+// Drop the records before position `upto`, which must already be on disk,
+// through the commit thread: the rest is copied into a fresh segment that
+// is synced and renamed over the log. Later opens need a skip_bytes of at
+// least upto. Returns 0 if the log was left as it was.
+int wal_rotate(long long upto);
+
+// Position just past the last record appended, or -1 if no log is open.
+// Records appended later all start at or after it.
+long long wal_position(void);
+
+// Whether a log is open
+int wal_is_open(void);
+
+#endif // WAL_H
@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+// Windows threading
+typedef CRITICAL_SECTION pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+typedef HANDLE pthread_t;
+static inline int pthread_mutex_init(pthread_mutex_t *mutex, void *attr) {
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_lock(pthread_mutex_t *mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_mutex_destroy(pthread_mutex_t *mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+static inline int pthread_cond_init(pthread_cond_t *cond, void *attr) {
+    InitializeConditionVariable(cond);
+    return 0;
+}
+static inline int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+    return 0;
+}
+static inline int pthread_cond_signal(pthread_cond_t *cond) {
+    WakeConditionVariable(cond);
+    return 0;
+}
+static inline int pthread_cond_broadcast(pthread_cond_t *cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
+static inline int pthread_cond_destroy(pthread_cond_t *cond) {
+    return 0;
+}
+#define atomic_load_u64(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+#define atomic_store_u64(p, v) InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+#define atomic_cas_u64(p, expected, desired) \
+    (InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(desired), (LONG64)(expected)) == (LONG64)(expected))
+#define atomic_load_ptr(p) InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define atomic_cas_ptr(p, expected, desired) \
+    (InterlockedCompareExchangePointer((PVOID volatile*)(p), (desired), (expected)) == (expected))
+#define atomic_swap_ptr(p, v) InterlockedExchangePointer((PVOID volatile*)(p), (v))
+#define atomic_inc_long(p) InterlockedIncrement(p)
+#define atomic_dec_long(p) InterlockedDecrement(p)
+#define atomic_load_long(p) InterlockedCompareExchange((p), 0, 0)
+#define full_fence() MemoryBarrier()
+#else
+#include <pthread.h>
+#define atomic_load_u64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_u64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_cas_u64(p, expected, desired) \
+    __sync_bool_compare_and_swap((p), (expected), (desired))
+#define atomic_load_ptr(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_cas_ptr(p, expected, desired) \
+    __sync_bool_compare_and_swap((p), (expected), (desired))
+#define atomic_swap_ptr(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define atomic_inc_long(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_long(p) __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define atomic_load_long(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define full_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+#include "worker_pool.h"
+
+// Bounded multi-producer/multi-consumer ring. Each slot carries a sequence
+// number telling producers and consumers whose turn it is, so neither side
+// takes a lock; head and tail sit on separate cache lines.
+typedef struct QueueSlot {
+    uint64_t sequence;
+    WorkItem *item;
+} QueueSlot;
+
+static QueueSlot *queue_slots = NULL;
+static uint64_t queue_mask = 0;
+static struct {
+    uint64_t head;
+    char pad[64 - sizeof(uint64_t)];
+    uint64_t tail;
+    char pad2[64 - sizeof(uint64_t)];
+} queue_cursor;
+
+// Finished jobs, pushed by workers and taken in one swap by the event loop
+static WorkItem *finished_jobs = NULL;
+
+// Workers only block when the queue is empty. Producers skip the lock
+// entirely unless a worker has announced it is about to sleep.
+static pthread_mutex_t idle_lock;
+static pthread_cond_t idle_cond;
+static long idle_workers = 0;
+static int stopping = 0;
+
+static pthread_t *workers = NULL;
+static size_t worker_count = 0;
+static WorkHandler work_handler = NULL;
+
+static int queue_push(WorkItem *item) {
+    uint64_t pos = atomic_load_u64(&queue_cursor.tail);
+    for (;;) {
+        QueueSlot *slot = &queue_slots[pos & queue_mask];
+        int64_t lag = (int64_t)(atomic_load_u64(&slot->sequence) - pos);
+        if (lag == 0 && atomic_cas_u64(&queue_cursor.tail, pos, pos + 1)) {
+            slot->item = item;
+            atomic_store_u64(&slot->sequence, pos + 1);
+            return 1;
+        }
+        if (lag < 0) return 0;          // a full lap behind: queue is full
+        pos = atomic_load_u64(&queue_cursor.tail);
+    }
+}
+
+static WorkItem* queue_pop(void) {
+    uint64_t pos = atomic_load_u64(&queue_cursor.head);
+    for (;;) {
+        QueueSlot *slot = &queue_slots[pos & queue_mask];
+        int64_t lag = (int64_t)(atomic_load_u64(&slot->sequence) - (pos + 1));
+        if (lag == 0 && atomic_cas_u64(&queue_cursor.head, pos, pos + 1)) {
+            WorkItem *item = slot->item;
+            atomic_store_u64(&slot->sequence, pos + queue_mask + 1);
+            return item;
+        }
+        if (lag < 0) return NULL;       // slot not filled yet: queue is empty
+        pos = atomic_load_u64(&queue_cursor.head);
+    }
+}
+
+// Returns NULL once the pool is stopping and the queue has drained
+static WorkItem* next_job(void) {
+    WorkItem *item = queue_pop();
+    if (item) return item;
+    
+    pthread_mutex_lock(&idle_lock);
+    atomic_inc_long(&idle_workers);
+    // Re-check after announcing: a producer that missed the announcement
+    // must have published its job before we look again
+    while (!(item = queue_pop()) && !stopping) {
+        pthread_cond_wait(&idle_cond, &idle_lock);
+    }
+    atomic_dec_long(&idle_workers);
+    pthread_mutex_unlock(&idle_lock);
+    return item;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg) {
+#else
+static void* worker_main(void *arg) {
+#endif
+    (void)arg;
+    WorkItem *item;
+    while ((item = next_job()) != NULL) {
+        work_handler(item);
+    }
+    return 0;
+}
+
+static int start_thread(pthread_t *thread) {
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, worker_main, NULL, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, worker_main, NULL) == 0;
+#endif
+}
+
+static void join_thread(pthread_t thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+int worker_pool_start(size_t threads, size_t capacity, WorkHandler handler) {
+    if (worker_count > 0 || threads == 0 || !handler) return 0;
+    
+    size_t slots = 2;
+    while (slots < capacity) slots <<= 1;
+    queue_slots = (QueueSlot*)calloc(slots, sizeof(QueueSlot));
+    workers = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    if (!queue_slots || !workers) {
+        free(queue_slots);
+        free(workers);
+        queue_slots = NULL;
+        workers = NULL;
+        return 0;
+    }
+    for (size_t i = 0; i < slots; i++) {
+        queue_slots[i].sequence = i;
+    }
+    queue_mask = slots - 1;
+    queue_cursor.head = 0;
+    queue_cursor.tail = 0;
+    work_handler = handler;
+    stopping = 0;
+    pthread_mutex_init(&idle_lock, NULL);
+    pthread_cond_init(&idle_cond, NULL);
+    
+    for (size_t i = 0; i < threads; i++) {
+        if (!start_thread(&workers[i])) break;
+        worker_count++;
+    }
+    if (worker_count < threads) {
+        worker_pool_stop();
+        return 0;
+    }
+    return 1;
+}
+
+void worker_pool_stop(void) {
+    if (!workers) return;
+    
+    pthread_mutex_lock(&idle_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+    for (size_t i = 0; i < worker_count; i++) {
+        join_thread(workers[i]);
+    }
+    
+    pthread_cond_destroy(&idle_cond);
+    pthread_mutex_destroy(&idle_lock);
+    free(workers);
+    free(queue_slots);
+    workers = NULL;
+    queue_slots = NULL;
+    worker_count = 0;
+}
+
+size_t worker_pool_size(void) {
+    return worker_count;
+}
+
+int worker_pool_submit(WorkItem *item) {
+    if (worker_count == 0 || !queue_push(item)) return 0;
+    
+    // Pairs with the re-check in next_job: either that worker sees the job
+    // or we see it waiting and wake it
+    full_fence();
+    if (atomic_load_long(&idle_workers) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return 1;
+}
+
+void worker_pool_finish(WorkItem *item) {
+    WorkItem *head;
+    do {
+        head = (WorkItem*)atomic_load_ptr(&finished_jobs);
+        item->next = head;
+    } while (!atomic_cas_ptr(&finished_jobs, head, item));
+}
+
+WorkItem* worker_pool_take_finished(void) {
+    WorkItem *newest = (WorkItem*)atomic_swap_ptr(&finished_jobs, NULL);
+    
+    // The stack hands them back newest first; reverse to completion order
+    WorkItem *oldest = NULL;
+    while (newest) {
+        WorkItem *next = newest->next;
+        newest->next = oldest;
+        oldest = newest;
+        newest = next;
+    }
+    return oldest;
+}
@@ -0,0 +1,33 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+
+// Intrusive link; embed as the first member of a caller-defined job struct
+typedef struct WorkItem {
+    struct WorkItem *next;
+} WorkItem;
+
+typedef void (*WorkHandler)(WorkItem *item);
+
+// Start `threads` workers pulling from a bounded queue of `capacity` jobs
+// (rounded up to a power of two). Returns 1 on success, 0 otherwise.
+int worker_pool_start(size_t threads, size_t capacity, WorkHandler handler);
+
+// Let the workers finish every queued job, then join them
+void worker_pool_stop(void);
+
+// Number of running workers (0 when the pool is not started)
+size_t worker_pool_size(void);
+
+// Queue a job without blocking. Returns 0 if the queue is full or the pool
+// is not running, in which case the caller still owns the item.
+int worker_pool_submit(WorkItem *item);
+
+// Called by the handler to hand a finished job back to the event loop
+void worker_pool_finish(WorkItem *item);
+
+// Take every finished job, oldest first, as a list linked through next
+WorkItem* worker_pool_take_finished(void);
+
+#endif // WORKER_POOL_H
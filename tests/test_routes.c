@@ -30,20 +30,73 @@ static int mutex_destroy(mutex_t *mutex) {
     DeleteCriticalSection(&mutex->cs);
     return 0;
 }
+
+typedef HANDLE thread_t;
+typedef struct {
+    void (*fn)(void*);
+    void *arg;
+} ThreadStart;
+static DWORD WINAPI thread_main(LPVOID arg) {
+    ThreadStart *start = (ThreadStart*)arg;
+    start->fn(start->arg);
+    free(start);
+    return 0;
+}
+static void thread_start(thread_t *thread, void (*fn)(void*), void *arg) {
+    ThreadStart *start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    start->fn = fn;
+    start->arg = arg;
+    *thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+}
+static void thread_join(thread_t thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
 #else
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 typedef pthread_mutex_t mutex_t;
 #define mutex_init(m) pthread_mutex_init(m, NULL)
 #define mutex_lock(m) pthread_mutex_lock(m)
 #define mutex_unlock(m) pthread_mutex_unlock(m)
 #define mutex_destroy(m) pthread_mutex_destroy(m)
+
+typedef pthread_t thread_t;
+typedef struct {
+    void (*fn)(void*);
+    void *arg;
+} ThreadStart;
+static void* thread_main(void *arg) {
+    ThreadStart *start = (ThreadStart*)arg;
+    start->fn(start->arg);
+    free(start);
+    return NULL;
+}
+static void thread_start(thread_t *thread, void (*fn)(void*), void *arg) {
+    ThreadStart *start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    start->fn = fn;
+    start->arg = arg;
+    pthread_create(thread, NULL, thread_main, start);
+}
+static void thread_join(thread_t thread) {
+    pthread_join(thread, NULL);
+}
+#endif
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
 #endif
 #include "users.h"
 #include "routes.h"
+#include "json_writer.h"
+#include "json_reader.h"
+#include "logger.h"
 
 void setUp(void) {
     // Initialize users storage before each test
+    TEST_ASSERT_TRUE(init_routes());
 }
 
 void tearDown(void) {
@@ -59,12 +112,12 @@ void test_users_basic_functionality(void) {
     TEST_ASSERT_EQUAL_STRING("test@example.com", user->email);
     
     // Test finding user by ID
-    User *found = find_user_by_id(1);
+    User *found = get_user_by_id(1);
     TEST_ASSERT_NOT_NULL(found);
     TEST_ASSERT_EQUAL_STRING("Test User", found->name);
     
     // Test user not found
-    User *not_found = find_user_by_id(999);
+    User *not_found = get_user_by_id(999);
     TEST_ASSERT_NULL(not_found);
 }
 
@@ -75,7 +128,7 @@ void test_user_deletion(void) {
     int user_id = user->id;
     
     // Verify user exists
-    User *found = find_user_by_id(user_id);
+    User *found = get_user_by_id(user_id);
     TEST_ASSERT_NOT_NULL(found);
     
     // Delete user
@@ -83,7 +136,7 @@ void test_user_deletion(void) {
     TEST_ASSERT_TRUE(result);
     
     // Verify user is gone
-    User *not_found = find_user_by_id(user_id);
+    User *not_found = get_user_by_id(user_id);
     TEST_ASSERT_NULL(not_found);
     
     // Try to delete non-existent user
@@ -107,9 +160,9 @@ void test_multiple_users(void) {
     TEST_ASSERT_NOT_EQUAL(user1->id, user3->id);
     
     // Test finding each user
-    User *found1 = find_user_by_id(user1->id);
-    User *found2 = find_user_by_id(user2->id);
-    User *found3 = find_user_by_id(user3->id);
+    User *found1 = get_user_by_id(user1->id);
+    User *found2 = get_user_by_id(user2->id);
+    User *found3 = get_user_by_id(user3->id);
     
     TEST_ASSERT_NOT_NULL(found1);
     TEST_ASSERT_NOT_NULL(found2);
@@ -165,6 +218,1665 @@ void test_get_all_users_json(void) {
     cJSON_Delete(users_json);
 }
 
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Creates "User <i>" <user<i>@example.com> for every i from first to last
+static void seed_numbered_users(int first, int last) {
+    char name[50];
+    char email[50];
+    for (int i = first; i <= last; i++) {
+        sprintf(name, "User %d", i);
+        sprintf(email, "user%d@example.com", i);
+        release_user(create_user(name, email));
+    }
+}
+
+static char* iobuf_to_string(struct mg_iobuf *io) {
+    char *str = (char*)malloc(io->len + 1);
+    if (io->len > 0) memcpy(str, io->buf, io->len);
+    str[io->len] = '\0';
+    return str;
+}
+
+// Writes every user in id order a page at a time, the way GET /users does
+static int write_all_users(struct mg_iobuf *io, int pretty) {
+    User *page[256];
+    int after = 0;
+    int ok = json_write_raw(io, "[", 1);
+    for (int first = 1; ok; first = 0) {
+        size_t count = get_users_page(after, 256, page, &after);
+        ok = json_write_list_items(io, page, count, pretty, first);
+        for (size_t i = 0; i < count; i++) {
+            release_user(page[i]);
+        }
+        if (after == 0) break;
+    }
+    return ok && json_write_raw(io, "]", 1);
+}
+// Runs one request through the router on a detached connection, leaving
+// the raw response in c->send. header may be NULL.
+static void send_request(struct mg_connection *c, const char *method, const char *uri, const char *query,
+                         const char *header, const char *value) {
+    struct mg_http_message hm;
+    memset(c, 0, sizeof(*c));
+    memset(&hm, 0, sizeof(hm));
+    hm.method = mg_str(method);
+    hm.uri = mg_str(uri);
+    hm.query = mg_str(query ? query : "");
+    if (header) {
+        hm.headers[0].name = mg_str(header);
+        hm.headers[0].value = mg_str(value);
+    }
+    handle_mongoose_request(c, MG_EV_HTTP_MSG, &hm);
+}
+
+// Runs one request given as raw HTTP, leaving the response in c->send
+static void send_raw_request(struct mg_connection *c, const char *request) {
+    struct mg_http_message hm;
+    memset(c, 0, sizeof(*c));
+    TEST_ASSERT_TRUE(mg_http_parse(request, strlen(request), &hm) > 0);
+    handle_mongoose_request(c, MG_EV_HTTP_MSG, &hm);
+}
+
+// Takes the body of the response in c->send, draining a chunked one like
+// the event loop would, and frees the send buffer. The body is returned
+// NUL-terminated, with its length in len if that is not NULL.
+static char* response_body(struct mg_connection *c, size_t *len) {
+    char *response = iobuf_to_string(&c->send);
+    char *body = strstr(response, "\r\n\r\n");
+    TEST_ASSERT_NOT_NULL(body);
+    body += 4;
+    size_t consumed = (size_t)(body - response);
+    if (!strstr(response, "Transfer-Encoding: chunked")) {
+        if (len) *len = c->send.len - consumed;
+        memmove(response, body, c->send.len - consumed + 1);
+        mg_iobuf_free(&c->send);
+        return response;
+    }
+    
+    // Poll until the final chunk arrives, then join the chunk payloads
+    struct mg_iobuf wire = {0};
+    mg_iobuf_add(&wire, 0, c->send.buf + consumed, c->send.len - consumed);
+    c->send.len = 0;
+    for (int polls = 0; polls < 100000; polls++) {
+        if (wire.len >= 5 && memcmp(wire.buf + wire.len - 5, "0\r\n\r\n", 5) == 0) break;
+        handle_mongoose_request(c, MG_EV_WRITE, NULL);
+        TEST_ASSERT_TRUE(c->send.len > 0);
+        mg_iobuf_add(&wire, wire.len, c->send.buf, c->send.len);
+        c->send.len = 0;
+    }
+    free(response);
+    mg_iobuf_free(&c->send);
+    
+    struct mg_iobuf joined = {0};
+    size_t pos = 0;
+    for (;;) {
+        unsigned long size = strtoul((char*)wire.buf + pos, NULL, 16);
+        pos = (size_t)((char*)memchr(wire.buf + pos, '\n', wire.len - pos) - (char*)wire.buf) + 1;
+        if (size == 0) break;
+        mg_iobuf_add(&joined, joined.len, wire.buf + pos, size);
+        pos += size + 2;
+    }
+    mg_iobuf_free(&wire);
+    if (len) *len = joined.len;
+    response = iobuf_to_string(&joined);
+    mg_iobuf_free(&joined);
+    return response;
+}
+
+// Runs one request and returns the response body
+static char* dispatch_request(const char *method, const char *uri, const char *query, const char *accept) {
+    struct mg_connection c;
+    send_request(&c, method, uri, query, accept ? "Accept" : NULL, accept);
+    return response_body(&c, NULL);
+}
+
+void test_responses_should_be_compact_unless_pretty_requested(void) {
+    cleanup_users();
+    init_users();
+    release_user(create_user("Alice", "alice@example.com"));
+    
+    char *body = dispatch_request("GET", "/users/1", NULL, NULL);
+    TEST_ASSERT_EQUAL_STRING("{\"id\":1,\"name\":\"Alice\",\"email\":\"alice@example.com\"}", body);
+    free(body);
+    
+    body = dispatch_request("GET", "/users/9", NULL, NULL);
+    TEST_ASSERT_EQUAL_STRING("{\"error\":\"User not found\"}", body);
+    free(body);
+    
+    body = dispatch_request("GET", "/users", "pretty=1", NULL);
+    TEST_ASSERT_EQUAL_STRING("[{\n\t\t\"id\":\t1,\n\t\t\"name\":\t\"Alice\",\n"
+                             "\t\t\"email\":\t\"alice@example.com\"\n\t}]", body);
+    free(body);
+    
+    body = dispatch_request("GET", "/users/9", NULL, "application/json; pretty=1");
+    TEST_ASSERT_EQUAL_STRING("{\n\t\"error\":\t\"User not found\"\n}", body);
+    free(body);
+    
+    cleanup_users();
+}
+
+void test_full_listing_should_stream_in_chunks(void) {
+    
+    cleanup_users();
+    init_users();
+    char *body = dispatch_request("GET", "/users", NULL, NULL);
+    TEST_ASSERT_EQUAL_STRING("[]", body);
+    free(body);
+    
+    // Several batches, with gaps left by deletes
+    seed_numbered_users(1, 1000);
+    for (int i = 1; i <= 1000; i += 7) {
+        delete_user(i);
+    }
+    
+    for (int pretty = 0; pretty <= 1; pretty++) {
+        cJSON *users = get_all_users();
+        char *expected = pretty ? cJSON_Print(users) : cJSON_PrintUnformatted(users);
+        body = dispatch_request("GET", "/users", pretty ? "pretty=1" : NULL, NULL);
+        TEST_ASSERT_EQUAL_STRING(expected, body);
+        free(body);
+        free(expected);
+        cJSON_Delete(users);
+    }
+    cleanup_users();
+}
+
+void test_swagger_spec_should_be_served_from_cache(void) {
+    struct mg_connection c;
+    init_routes();
+    
+    send_request(&c, "GET", "/swagger.json", NULL, NULL, NULL);
+    char *first = iobuf_to_string(&c.send);
+    size_t first_len = c.send.len;
+    mg_iobuf_free(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(first, "HTTP/1.1 200 OK"));
+    TEST_ASSERT_NOT_NULL(strstr(first, "\"openapi\""));
+    char *etag = strstr(first, "ETag: ");
+    TEST_ASSERT_NOT_NULL(etag);
+    etag += 6;
+    *strstr(etag, "\r\n") = '\0';
+    
+    // A matching validator gets an empty 304
+    send_request(&c, "GET", "/swagger.json", NULL, "If-None-Match", etag);
+    char *revalidated = iobuf_to_string(&c.send);
+    mg_iobuf_free(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(revalidated, "HTTP/1.1 304 Not Modified"));
+    TEST_ASSERT_NOT_NULL(strstr(revalidated, etag));
+    TEST_ASSERT_EQUAL_STRING("\r\n\r\n", revalidated + strlen(revalidated) - 4);
+    free(revalidated);
+    
+#ifdef HAVE_ZLIB
+    send_request(&c, "GET", "/swagger.json", NULL, "Accept-Encoding", "deflate, gzip;q=0.8");
+    char *gzipped = iobuf_to_string(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(gzipped, "Content-Encoding: gzip"));
+    TEST_ASSERT_TRUE(c.send.len < first_len / 2);
+    mg_iobuf_free(&c.send);
+    free(gzipped);
+    
+    send_request(&c, "GET", "/swagger.json", NULL, "Accept-Encoding", "gzip;q=0");
+    TEST_ASSERT_EQUAL_INT((int)first_len, (int)c.send.len);
+    mg_iobuf_free(&c.send);
+#endif
+    
+    free(first);
+    cleanup_routes();
+}
+
+void test_requests_should_round_trip_through_worker_pool(void) {
+    enum { CONNECTIONS = 64, CLOSED = 5 };
+    static struct mg_connection conns[CONNECTIONS];
+    struct mg_connection listener;
+    struct mg_mgr mgr;
+    char email[64];
+    char request[128];
+    
+    cleanup_users();
+    init_users();
+    seed_numbered_users(1, CONNECTIONS);
+    
+    memset(&mgr, 0, sizeof(mgr));
+    memset(&listener, 0, sizeof(listener));
+    memset(conns, 0, sizeof(conns));
+    listener.mgr = &mgr;
+    listener.is_listening = 1;
+    for (int i = 0; i < CONNECTIONS; i++) {
+        conns[i].mgr = &mgr;
+        conns[i].id = (unsigned long)(i + 1);
+    }
+    TEST_ASSERT_TRUE(start_request_workers(4));
+    
+    // Every connection asks for a different user at once, and one hangs
+    // up before its answer is back
+    for (int i = 0; i < CONNECTIONS; i++) {
+        struct mg_http_message hm;
+        int len = sprintf(request, "GET /users/%d HTTP/1.1\r\nHost: localhost\r\n\r\n", i + 1);
+        TEST_ASSERT_TRUE(mg_http_parse(request, (size_t)len, &hm) > 0);
+        handle_mongoose_request(&conns[i], MG_EV_HTTP_MSG, &hm);
+    }
+    handle_mongoose_request(&conns[CLOSED], MG_EV_CLOSE, NULL);
+    
+    // The listener's poll picks finished responses up
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    int answered = 0;
+    while (answered < CONNECTIONS - 1 && elapsed_seconds(&start) < 10.0) {
+        handle_mongoose_request(&listener, MG_EV_POLL, NULL);
+        answered = 0;
+        for (int i = 0; i < CONNECTIONS; i++) {
+            if (conns[i].send.len > 0 && !conns[i].is_resp) answered++;
+        }
+    }
+    stop_request_workers();
+    TEST_ASSERT_EQUAL_INT(CONNECTIONS - 1, answered);
+    TEST_ASSERT_EQUAL_INT(0, (int)conns[CLOSED].send.len);
+    
+    for (int i = 0; i < CONNECTIONS; i++) {
+        if (i == CLOSED) continue;
+        char *response = iobuf_to_string(&conns[i].send);
+        sprintf(email, "\"email\":\"user%d@example.com\"", i + 1);
+        TEST_ASSERT_NOT_NULL(strstr(response, "HTTP/1.1 200 OK"));
+        TEST_ASSERT_NOT_NULL(strstr(response, email));
+        free(response);
+        mg_iobuf_free(&conns[i].send);
+    }
+    cleanup_users();
+}
+
+static double time_user_requests(int count, FILE *sync_log) {
+    struct mg_connection c;
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < count; i++) {
+        send_request(&c, "GET", "/users/1", NULL, NULL, NULL);
+        if (sync_log) {
+            // What every request used to pay: a formatted write and a flush
+            fprintf(sync_log, "Incoming HTTP request received\n");
+            fflush(sync_log);
+        }
+        mg_iobuf_free(&c.send);
+    }
+    return elapsed_seconds(&start);
+}
+
+void test_access_log_should_be_written_in_batches(void) {
+    enum { REQUESTS = 20000 };
+    char line[512];
+    
+    cleanup_users();
+    init_users();
+    release_user(create_user("Logged User", "logged@example.com"));
+    
+    FILE *async_log = tmpfile();
+    TEST_ASSERT_NOT_NULL(async_log);
+    size_t dropped_before = logger_dropped();
+    TEST_ASSERT_TRUE(logger_start(LOG_INFO, async_log));
+    time_user_requests(REQUESTS, NULL);
+    logger_stop();
+    size_t dropped = logger_dropped() - dropped_before;
+    
+    // Every request is either in the log or accounted for as dropped
+    int logged = 0;
+    rewind(async_log);
+    while (fgets(line, sizeof(line), async_log)) {
+        if (strstr(line, " INFO  method=GET uri=/users/1 status=200 bytes=")) logged++;
+    }
+    TEST_ASSERT_EQUAL_INT(REQUESTS, logged + (int)dropped);
+    // The writer keeps up with one busy thread, even on a single core
+    TEST_ASSERT_TRUE(dropped * 100 <= REQUESTS);
+    
+    // Nothing is queued once the logger is stopped
+    time_user_requests(10, NULL);
+    TEST_ASSERT_EQUAL_INT((int)dropped, (int)(logger_dropped() - dropped_before));
+    fclose(async_log);
+    cleanup_users();
+}
+
+void test_access_log_benchmark(void) {
+    enum { REQUESTS = 20000 };
+    
+    cleanup_users();
+    init_users();
+    release_user(create_user("Logged User", "logged@example.com"));
+    
+    FILE *sync_log = tmpfile();
+    FILE *async_log = tmpfile();
+    TEST_ASSERT_NOT_NULL(sync_log);
+    TEST_ASSERT_NOT_NULL(async_log);
+    double quiet_seconds = time_user_requests(REQUESTS, NULL);
+    double sync_seconds = time_user_requests(REQUESTS, sync_log);
+    size_t dropped_before = logger_dropped();
+    TEST_ASSERT_TRUE(logger_start(LOG_INFO, async_log));
+    double async_seconds = time_user_requests(REQUESTS, NULL);
+    logger_stop();
+    size_t dropped = logger_dropped() - dropped_before;
+    
+    printf("  %d requests: no logging %.2f us/req, printf+fflush %.2f us/req, async logger %.2f us/req (%d dropped)\n",
+           REQUESTS, quiet_seconds * 1e6 / REQUESTS, sync_seconds * 1e6 / REQUESTS,
+           async_seconds * 1e6 / REQUESTS, (int)dropped);
+    fclose(sync_log);
+    fclose(async_log);
+    cleanup_users();
+}
+
+static mutex_t log_spam_lock;
+static int log_spam_running = 0;
+
+static int log_spam_should_run(void) {
+    mutex_lock(&log_spam_lock);
+    int running = log_spam_running;
+    mutex_unlock(&log_spam_lock);
+    return running;
+}
+
+static void log_spam(void *arg) {
+    unsigned long *lines = (unsigned long*)arg;
+    while (log_spam_should_run()) {
+        log_message(LOG_INFO, "spam %lu", *lines);
+        (*lines)++;
+    }
+}
+
+void test_logger_should_stop_while_threads_are_logging(void) {
+    enum { THREADS = 4, CYCLES = 50 };
+    thread_t threads[THREADS];
+    unsigned long lines[THREADS] = {0};
+    char line[512];
+    
+    mutex_init(&log_spam_lock);
+    log_spam_running = 1;
+    for (int i = 0; i < THREADS; i++) {
+        thread_start(&threads[i], log_spam, &lines[i]);
+    }
+    // Every cycle tears the writer down under the producers' feet; what
+    // was published must still come out as whole lines
+    for (int cycle = 0; cycle < CYCLES; cycle++) {
+        FILE *out = tmpfile();
+        TEST_ASSERT_NOT_NULL(out);
+        TEST_ASSERT_TRUE(logger_start(LOG_INFO, out));
+        logger_stop();
+        rewind(out);
+        while (fgets(line, sizeof(line), out)) {
+            TEST_ASSERT_TRUE(strchr(line, '\n') != NULL);
+            TEST_ASSERT_TRUE(strstr(line, " INFO  spam ") != NULL || strstr(line, "logger: ") != NULL);
+        }
+        fclose(out);
+    }
+    mutex_lock(&log_spam_lock);
+    log_spam_running = 0;
+    mutex_unlock(&log_spam_lock);
+    for (int i = 0; i < THREADS; i++) {
+        thread_join(threads[i]);
+    }
+    mutex_destroy(&log_spam_lock);
+    TEST_ASSERT_TRUE(lines[0] > 0);
+}
+
+static void log_one_line(void *arg) {
+    log_message(LOG_INFO, "exiting thread %d", *(int*)arg);
+}
+
+void test_logger_should_free_rings_of_exited_threads(void) {
+    enum { THREADS = 8 };
+    thread_t threads[THREADS];
+    int ids[THREADS];
+    char line[512];
+    
+    FILE *out = tmpfile();
+    TEST_ASSERT_NOT_NULL(out);
+    // A first run frees whatever rings earlier tests' threads left behind
+    TEST_ASSERT_TRUE(logger_start(LOG_INFO, out));
+    logger_stop();
+    size_t rings_before = logger_ring_count();
+    TEST_ASSERT_TRUE(logger_start(LOG_INFO, out));
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        thread_start(&threads[i], log_one_line, &ids[i]);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        thread_join(threads[i]);
+    }
+    logger_stop();
+    
+    // Every line made it out before its ring was freed
+    TEST_ASSERT_EQUAL_INT((int)rings_before, (int)logger_ring_count());
+    int logged = 0;
+    rewind(out);
+    while (fgets(line, sizeof(line), out)) {
+        if (strstr(line, " INFO  exiting thread ")) logged++;
+    }
+    TEST_ASSERT_EQUAL_INT(THREADS, logged);
+    fclose(out);
+}
+
+void test_logger_should_wake_from_idle_for_one_line(void) {
+    FILE *out = tmpfile();
+    TEST_ASSERT_NOT_NULL(out);
+    TEST_ASSERT_TRUE(logger_start(LOG_INFO, out));
+    
+    // The writer finds nothing to do and sleeps; a single line, far below
+    // the wake watermark, must still get it writing without a stop
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    while (elapsed_seconds(&start) < 0.05) {
+    }
+    log_message(LOG_INFO, "after idle");
+    timespec_get(&start, TIME_UTC);
+    while (ftell(out) <= 0 && elapsed_seconds(&start) < 5.0) {
+    }
+    TEST_ASSERT_TRUE(ftell(out) > 0);
+    logger_stop();
+    fclose(out);
+}
+
+static int bench_route_hits = 0;
+static struct mg_str bench_route_param;
+
+static void bench_route(struct mg_connection *c, struct mg_http_message *hm, const RouteParams *params) {
+    bench_route_hits++;
+    if (params->count > 0) bench_route_param = params->values[params->count - 1];
+}
+
+void test_registered_routes_should_dispatch_by_method_and_path(void) {
+    struct mg_connection c;
+    init_routes();
+    TEST_ASSERT_TRUE(register_route(HTTP_GET, "/bench/{id}/items/{item}", bench_route));
+    TEST_ASSERT_TRUE(register_route(HTTP_PATCH, "/bench", bench_route));
+    TEST_ASSERT_FALSE(register_route(HTTP_GET, "/users/{id}", bench_route));
+    TEST_ASSERT_FALSE(register_route(HTTP_GET, "/a/{b}/{c}/{d}/{e}/{f}", bench_route));
+    
+    bench_route_hits = 0;
+    send_request(&c, "GET", "/bench/7/items/abc", NULL, NULL, NULL);
+    TEST_ASSERT_EQUAL_INT(1, bench_route_hits);
+    TEST_ASSERT_EQUAL_INT(0, mg_strcmp(bench_route_param, mg_str("abc")));
+    send_request(&c, "PATCH", "/bench/", NULL, NULL, NULL);
+    TEST_ASSERT_EQUAL_INT(2, bench_route_hits);
+    
+    send_request(&c, "POST", "/bench", NULL, NULL, NULL);
+    char *response = iobuf_to_string(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(response, "HTTP/1.1 405"));
+    free(response);
+    mg_iobuf_free(&c.send);
+    send_request(&c, "GET", "/bench/7/other/abc", NULL, NULL, NULL);
+    response = iobuf_to_string(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(response, "HTTP/1.1 404"));
+    free(response);
+    mg_iobuf_free(&c.send);
+    
+    // Built-in routes still answer alongside the new ones
+    cleanup_users();
+    init_users();
+    release_user(create_user("Routed User", "routed@example.com"));
+    char *body = dispatch_request("GET", "/users/1", NULL, NULL);
+    TEST_ASSERT_NOT_NULL(strstr(body, "routed@example.com"));
+    free(body);
+    cleanup_users();
+    
+    // cleanup_routes drops registered routes; init_routes brings back
+    // only the built-ins
+    cleanup_routes();
+    TEST_ASSERT_TRUE(init_routes());
+    send_request(&c, "GET", "/bench/7/items/abc", NULL, NULL, NULL);
+    TEST_ASSERT_EQUAL_INT(2, bench_route_hits);
+    mg_iobuf_free(&c.send);
+    cleanup_routes();
+}
+
+void test_route_dispatch_benchmark(void) {
+    enum { LOOKUPS = 200000 };
+    static const char *patterns[] = { "/users", "/users/{id}", "/bench/{id}/items/{item}" };
+    static const char *paths[] = { "/users", "/users/12345", "/bench/12345/items/42" };
+    struct mg_connection c;
+    struct mg_http_message hm;
+    
+    init_routes();
+    for (int r = 0; r < 3; r++) {
+        TEST_ASSERT_TRUE(register_route(HTTP_HEAD, patterns[r], bench_route));
+    }
+    
+    // HEAD on these paths reaches a no-op handler, so the time is the
+    // dispatcher's own: method parse, path walk and the handler call
+    memset(&c, 0, sizeof(c));
+    for (int r = 0; r < 3; r++) {
+        memset(&hm, 0, sizeof(hm));
+        hm.method = mg_str("HEAD");
+        hm.uri = mg_str(paths[r]);
+        bench_route_hits = 0;
+        struct timespec start;
+        timespec_get(&start, TIME_UTC);
+        for (int i = 0; i < LOOKUPS; i++) {
+            handle_mongoose_request(&c, MG_EV_HTTP_MSG, &hm);
+        }
+        double seconds = elapsed_seconds(&start);
+        TEST_ASSERT_EQUAL_INT(LOOKUPS, bench_route_hits);
+        TEST_ASSERT_EQUAL_INT(0, (int)c.send.len);
+        printf("  HEAD %-26s %.1f ns/dispatch\n", patterns[r], seconds * 1e9 / LOOKUPS);
+    }
+    cleanup_routes();
+}
+
+// Value of one exported series, or -1 if it is missing
+static double metric_value(const char *body, const char *series) {
+    size_t len = strlen(series);
+    for (const char *line = body; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        if (strncmp(line, series, len) == 0 && line[len] == ' ') return strtod(line + len + 1, NULL);
+    }
+    return -1;
+}
+
+void test_metrics_should_count_requests_per_route(void) {
+    struct mg_connection c;
+    const char *ok_series = "http_requests_total{method=\"GET\",route=\"/users/{id}\",code=\"2xx\"}";
+    const char *missing_series = "http_requests_total{method=\"GET\",route=\"/users/{id}\",code=\"4xx\"}";
+    const char *count_series = "http_request_duration_seconds_count{method=\"GET\",route=\"/users/{id}\"}";
+    const char *inf_series = "http_request_duration_seconds_bucket{method=\"GET\",route=\"/users/{id}\",le=\"+Inf\"}";
+    
+    cleanup_users();
+    init_users();
+    release_user(create_user("Measured User", "measured@example.com"));
+    
+    char *before = dispatch_request("GET", "/metrics", NULL, NULL);
+    for (int i = 0; i < 3; i++) {
+        send_request(&c, "GET", "/users/1", NULL, NULL, NULL);
+        mg_iobuf_free(&c.send);
+    }
+    send_request(&c, "GET", "/users/999", NULL, NULL, NULL);
+    mg_iobuf_free(&c.send);
+    send_request(&c, "GET", "/no/such/route", NULL, NULL, NULL);
+    mg_iobuf_free(&c.send);
+    
+    send_request(&c, "GET", "/metrics", NULL, NULL, NULL);
+    char *response = iobuf_to_string(&c.send);
+    mg_iobuf_free(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(response, "HTTP/1.1 200 OK"));
+    TEST_ASSERT_NOT_NULL(strstr(response, "Content-Type: text/plain; version=0.0.4"));
+    char *after = strstr(response, "\r\n\r\n") + 4;
+    
+    double ok_before = metric_value(before, ok_series);
+    double missing_before = metric_value(before, missing_series);
+    TEST_ASSERT_EQUAL_INT(3, (int)(metric_value(after, ok_series) - (ok_before < 0 ? 0 : ok_before)));
+    TEST_ASSERT_EQUAL_INT(1, (int)(metric_value(after, missing_series) - (missing_before < 0 ? 0 : missing_before)));
+    TEST_ASSERT_TRUE(metric_value(after, "http_requests_total{method=\"*\",route=\"unmatched\",code=\"4xx\"}") >= 1);
+    TEST_ASSERT_TRUE(metric_value(after, count_series) >= 4);
+    TEST_ASSERT_EQUAL_INT((int)metric_value(after, count_series), (int)metric_value(after, inf_series));
+    TEST_ASSERT_NOT_NULL(strstr(after, "# TYPE http_request_duration_seconds histogram\n"));
+    TEST_ASSERT_EQUAL_INT(1, (int)metric_value(after, "users_count"));
+    TEST_ASSERT_TRUE(metric_value(after, "users_lock_wait_seconds_total") >= 0);
+    
+    free(before);
+    free(response);
+    cleanup_users();
+}
+
+void test_json_writer_should_match_cjson_output(void) {
+    cleanup_users();
+    init_users();
+    release_user(create_user("Plain Name", "plain@example.com"));
+    release_user(create_user("Quote \" and \\ slash", "esc@example.com"));
+    release_user(create_user("Tab\tNew\nLine\x01", "ctl@example.com"));
+    release_user(create_user("J\xc3\xbcrgen", "utf8@example.com"));
+    
+    struct mg_iobuf io = {0};
+    cJSON *users = get_all_users();
+    char *expected = cJSON_Print(users);
+    TEST_ASSERT_TRUE(write_all_users(&io, 1));
+    char *actual = iobuf_to_string(&io);
+    TEST_ASSERT_EQUAL_STRING(expected, actual);
+    free(expected);
+    free(actual);
+    
+    // The second compact pass is copied from the fragments the first attached
+    expected = cJSON_PrintUnformatted(users);
+    for (int pass = 0; pass < 2; pass++) {
+        io.len = 0;
+        TEST_ASSERT_TRUE(write_all_users(&io, 0));
+        actual = iobuf_to_string(&io);
+        TEST_ASSERT_EQUAL_STRING(expected, actual);
+        free(actual);
+    }
+    free(expected);
+    cJSON_Delete(users);
+    
+    User *user = get_user_by_id(2);
+    cJSON *user_json = user_to_json(user);
+    expected = cJSON_Print(user_json);
+    io.len = 0;
+    TEST_ASSERT_TRUE(json_write_user(&io, user, 1, 0));
+    actual = iobuf_to_string(&io);
+    TEST_ASSERT_EQUAL_STRING(expected, actual);
+    free(expected);
+    free(actual);
+    cJSON_Delete(user_json);
+    release_user(user);
+    
+    mg_iobuf_free(&io);
+    cleanup_users();
+}
+
+void test_json_writer_benchmark_against_cjson(void) {
+    int sizes[] = {10000, 100000};
+    
+    cleanup_users();
+    init_users();
+    int created = 0;
+    for (int s = 0; s < 2; s++) {
+        seed_numbered_users(created + 1, sizes[s]);
+        created = sizes[s];
+        
+        struct timespec start;
+        timespec_get(&start, TIME_UTC);
+        cJSON *users = get_all_users();
+        char *printed = cJSON_Print(users);
+        size_t cjson_len = strlen(printed);
+        free(printed);
+        cJSON_Delete(users);
+        double cjson_seconds = elapsed_seconds(&start);
+        
+        struct mg_iobuf io = {0};
+        timespec_get(&start, TIME_UTC);
+        TEST_ASSERT_TRUE(write_all_users(&io, 1));
+        double writer_seconds = elapsed_seconds(&start);
+        TEST_ASSERT_EQUAL_INT((int)cjson_len, (int)io.len);
+        mg_iobuf_free(&io);
+        
+        printf("  %d users: cJSON tree %.2f ms, streaming writer %.2f ms\n",
+               sizes[s], cjson_seconds * 1000, writer_seconds * 1000);
+    }
+    cleanup_users();
+}
+
+void test_user_fragment_list_benchmark(void) {
+    int sizes[] = {10000, 100000, 1000000};
+    
+    cleanup_users();
+    init_users();
+    int created = 0;
+    for (int s = 0; s < 3; s++) {
+        seed_numbered_users(created + 1, sizes[s]);
+        created = sizes[s];
+        
+        // Pretty output has no fragments, so it is written field by field
+        // every time; the first compact pass renders the new users' fragments
+        double seconds[3];
+        size_t len = 0;
+        for (int pass = 0; pass < 3; pass++) {
+            struct mg_iobuf io = {0};
+            struct timespec start;
+            timespec_get(&start, TIME_UTC);
+            TEST_ASSERT_TRUE(write_all_users(&io, pass == 0));
+            seconds[pass] = elapsed_seconds(&start);
+            if (pass > 0) len = io.len;
+            mg_iobuf_free(&io);
+        }
+        
+        printf("  GET /users body, %d users: indented %.1f M users/s, compact building fragments %.1f M users/s, "
+               "from fragments %.1f M users/s (%.0f MB/s)\n", sizes[s],
+               sizes[s] / seconds[0] / 1e6, sizes[s] / seconds[1] / 1e6, sizes[s] / seconds[2] / 1e6,
+               len / seconds[2] / 1e6);
+    }
+    cleanup_users();
+}
+
+// Runs one request with a body and returns the response body
+static char* post_request(const char *uri, const char *query, const char *data) {
+    struct mg_connection c;
+    struct mg_http_message hm;
+    memset(&c, 0, sizeof(c));
+    memset(&hm, 0, sizeof(hm));
+    hm.method = mg_str("POST");
+    hm.uri = mg_str(uri);
+    hm.query = mg_str(query ? query : "");
+    hm.body = mg_str(data);
+    handle_mongoose_request(&c, MG_EV_HTTP_MSG, &hm);
+    
+    char *response = iobuf_to_string(&c.send);
+    mg_iobuf_free(&c.send);
+    char *body = strstr(response, "\r\n\r\n");
+    TEST_ASSERT_NOT_NULL(body);
+    memmove(response, body + 4, strlen(body + 4) + 1);
+    return response;
+}
+
+void test_bulk_endpoint_should_report_each_operation(void) {
+    cleanup_users();
+    init_users();
+    
+    char *body = post_request("/users/_bulk", NULL,
+        "[{\"op\":\"create\",\"name\":\"Alice\",\"email\":\"alice@example.com\"},"
+        " {\"op\":\"create\",\"name\":\"Bob\",\"email\":\"bob@example.com\"},"
+        " {\"op\":\"create\",\"name\":\"Copy\",\"email\":\"alice@example.com\"},"
+        " {\"op\":\"update\",\"id\":1,\"name\":\"Alicia\"},"
+        " {\"op\":\"delete\",\"id\":2},"
+        " {\"op\":\"delete\",\"id\":99},"
+        " {\"name\":\"No op\"}]");
+    TEST_ASSERT_EQUAL_STRING("[{\"status\":201,\"user\":{\"id\":1,\"name\":\"Alice\",\"email\":\"alice@example.com\"}},"
+                             "{\"status\":201,\"user\":{\"id\":2,\"name\":\"Bob\",\"email\":\"bob@example.com\"}},"
+                             "{\"status\":409,\"error\":\"Email already in use\"},"
+                             "{\"status\":200,\"user\":{\"id\":1,\"name\":\"Alicia\",\"email\":\"alice@example.com\"}},"
+                             "{\"status\":200},"
+                             "{\"status\":404,\"error\":\"User not found\"},"
+                             "{\"status\":400,\"error\":\"Missing op\"}]", body);
+    free(body);
+    
+    // NDJSON, with a blank line, a line that is not JSON and lines whose
+    // fields the pull parser leaves to cJSON
+    body = post_request("/users/_bulk", NULL,
+        "{\"op\":\"create\",\"name\":\"Carol\",\"email\":\"carol@example.com\"}\r\n"
+        "\n"
+        "{oops\n"
+        "{\"op\":\"update\",\"id\":3,\"email\":\"alice@example.com\"}\n"
+        "{\"op\":\"update\",\"id\":3,\"name\":7}\n"
+        "{\"op\":\"delete\",\"id\":\"3\"}\n"
+        "{\"op\":\"delete\",\"id\":1000000000000000000000000000000000}\n"
+        "{\"op\":\"delete\",\"id\":1.9}");
+    TEST_ASSERT_EQUAL_STRING("[{\"status\":201,\"user\":{\"id\":3,\"name\":\"Carol\",\"email\":\"carol@example.com\"}},"
+                             "{\"status\":400,\"error\":\"Invalid JSON\"},"
+                             "{\"status\":409,\"error\":\"Email already in use\"},"
+                             "{\"status\":400,\"error\":\"Invalid name or email\"},"
+                             "{\"status\":400,\"error\":\"Missing id\"},"
+                             "{\"status\":400,\"error\":\"Missing id\"},"
+                             "{\"status\":400,\"error\":\"Missing id\"}]", body);
+    free(body);
+    // A fractional id is not truncated to user 1
+    User *alicia = get_user_by_id(1);
+    TEST_ASSERT_NOT_NULL(alicia);
+    release_user(alicia);
+    
+    body = post_request("/users/_bulk", "pretty=1", "[{\"op\":\"delete\",\"id\":99}]");
+    TEST_ASSERT_EQUAL_STRING("[{\n\t\t\"status\":\t404,\n\t\t\"error\":\t\"User not found\"\n\t}]", body);
+    free(body);
+    body = post_request("/users/_bulk", NULL, "[]");
+    TEST_ASSERT_EQUAL_STRING("{\"error\":\"No operations\"}", body);
+    free(body);
+    
+    UserStoreStats stats;
+    get_user_store_stats(&stats);
+    TEST_ASSERT_EQUAL_INT(2, (int)stats.user_count);
+    cleanup_users();
+}
+
+void test_bulk_endpoint_benchmark_against_single_requests(void) {
+    enum { USERS = 10000 };
+    struct mg_connection c;
+    struct timespec start;
+    char item[128];
+    char request[256];
+    
+    // Both sides go through the HTTP parser, as they would off the wire
+    cleanup_users();
+    init_users();
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < USERS; i++) {
+        int len = snprintf(item, sizeof(item), "{\"name\":\"User %d\",\"email\":\"single%d@example.com\"}", i, i);
+        snprintf(request, sizeof(request), "POST /users HTTP/1.1\r\nContent-Type: application/json\r\n"
+                 "Content-Length: %d\r\n\r\n%s", len, item);
+        send_raw_request(&c, request);
+        mg_iobuf_free(&c.send);
+    }
+    double single_seconds = elapsed_seconds(&start);
+    
+    struct mg_iobuf ndjson = {0};
+    for (int i = 0; i < USERS; i++) {
+        int len = snprintf(item, sizeof(item), "{\"op\":\"create\",\"name\":\"User %d\",\"email\":\"bulk%d@example.com\"}\n", i, i);
+        mg_iobuf_add(&ndjson, ndjson.len, item, (size_t)len);
+    }
+    snprintf(request, sizeof(request), "POST /users/_bulk HTTP/1.1\r\nContent-Type: application/x-ndjson\r\n"
+             "Content-Length: %lu\r\n\r\n", (unsigned long)ndjson.len);
+    mg_iobuf_add(&ndjson, 0, request, strlen(request));
+    mg_iobuf_add(&ndjson, ndjson.len, "", 1);
+    timespec_get(&start, TIME_UTC);
+    send_raw_request(&c, (char*)ndjson.buf);
+    double bulk_seconds = elapsed_seconds(&start);
+    mg_iobuf_free(&ndjson);
+    
+    char *body = iobuf_to_string(&c.send);
+    mg_iobuf_free(&c.send);
+    TEST_ASSERT_NULL(strstr(body, "\"error\""));
+    free(body);
+    UserStoreStats stats;
+    get_user_store_stats(&stats);
+    TEST_ASSERT_EQUAL_INT(USERS * 2, (int)stats.user_count);
+    printf("  %d creates: %.1f ms as single requests, %.1f ms in one bulk request\n",
+           USERS, single_seconds * 1000, bulk_seconds * 1000);
+    cleanup_users();
+}
+
+void test_export_and_import_should_round_trip_users(void) {
+    cleanup_users();
+    init_users();
+    char *body = dispatch_request("GET", "/users/export", NULL, NULL);
+    TEST_ASSERT_EQUAL_STRING("", body);
+    free(body);
+    
+    // More than one batch, with gaps that an import has to keep
+    seed_numbered_users(1, 600);
+    for (int i = 1; i <= 600; i += 5) {
+        delete_user(i);
+    }
+    char *exported = dispatch_request("GET", "/users/export", NULL, NULL);
+    body = exported;
+    for (int id = 2; id <= 600; id++) {
+        if (id % 5 == 1) continue;
+        char line[128];
+        sprintf(line, "{\"id\":%d,\"name\":\"User %d\",\"email\":\"user%d@example.com\"}\n", id, id, id);
+        TEST_ASSERT_EQUAL_INT(0, strncmp(body, line, strlen(line)));
+        body += strlen(line);
+    }
+    TEST_ASSERT_EQUAL_STRING("", body);
+    
+    cleanup_users();
+    init_users();
+    body = post_request("/users/import", NULL, exported);
+    TEST_ASSERT_EQUAL_STRING("{\"imported\":480,\"failed\":0}", body);
+    free(body);
+    body = dispatch_request("GET", "/users/export", NULL, NULL);
+    TEST_ASSERT_EQUAL_STRING(exported, body);
+    free(body);
+    free(exported);
+    
+    // Lines without an id are created; bad lines are only counted
+    body = post_request("/users/import", NULL,
+        "{\"name\":\"New\",\"email\":\"new@example.com\"}\r\n"
+        "\n"
+        "{oops\n"
+        "{\"id\":2,\"name\":\"Replaced\",\"email\":\"replaced@example.com\"}\n"
+        "{\"id\":3,\"name\":\"No email\"}\n"
+        "{\"id\":4,\"name\":\"Taken\",\"email\":\"new@example.com\"}\n"
+        "{\"id\":7.5,\"name\":\"Fraction\",\"email\":\"fraction@example.com\"}");
+    TEST_ASSERT_EQUAL_STRING("{\"imported\":2,\"failed\":4}", body);
+    free(body);
+    User *user = get_user_by_email("new@example.com");
+    TEST_ASSERT_EQUAL_INT(601, user->id);
+    release_user(user);
+    user = get_user_by_id(2);
+    TEST_ASSERT_EQUAL_STRING("Replaced", user->name);
+    release_user(user);
+    // A fractional id is not truncated onto user 7
+    user = get_user_by_id(7);
+    TEST_ASSERT_EQUAL_STRING("User 7", user->name);
+    release_user(user);
+    TEST_ASSERT_NULL(get_user_by_email("fraction@example.com"));
+    cleanup_users();
+}
+
+static void fake_http_handler(struct mg_connection *c, int ev, void *ev_data) {
+}
+
+// Drives a streamed import the way mongoose would: headers first, then
+// one read event per piece of body that lands in the receive buffer
+void test_import_should_stream_body_from_receive_buffer(void) {
+    enum { USERS = 10000, READ_SIZE = 16 * 1024, OVERLONG = 70 * 1024 };
+    struct mg_connection c;
+    struct mg_http_message hm;
+    char head[128];
+    
+    cleanup_users();
+    init_users();
+    // Written into one buffer rather than grown a line at a time
+    size_t body_cap = (size_t)USERS * 80 + OVERLONG;
+    char *body = (char*)malloc(body_cap);
+    size_t body_len = 0;
+    for (int i = 1; i <= USERS; i++) {
+        body_len += (size_t)snprintf(body + body_len, body_cap - body_len,
+                                     "{\"id\":%d,\"name\":\"User %d\",\"email\":\"user%d@example.com\"}\n",
+                                     i * 2, i, i);
+    }
+    // An overlong line is rejected without being held
+    memset(body + body_len, 'x', OVERLONG);
+    body_len += OVERLONG;
+    int head_len = snprintf(head, sizeof(head), "POST /users/import HTTP/1.1\r\nContent-Length: %lu\r\n\r\n",
+                            (unsigned long)body_len);
+    const char *next_request = "GET /users/2 HTTP/1.1\r\n\r\n";
+    
+    memset(&c, 0, sizeof(c));
+    c.pfn = fake_http_handler;
+    mg_iobuf_add(&c.recv, 0, head, (size_t)head_len);
+    mg_iobuf_add(&c.recv, c.recv.len, body, READ_SIZE);
+    TEST_ASSERT_TRUE(mg_http_parse((char*)c.recv.buf, c.recv.len, &hm) > 0);
+    handle_mongoose_request(&c, MG_EV_HTTP_HDRS, &hm);
+    TEST_ASSERT_NULL(c.pfn);
+    handle_mongoose_request(&c, MG_EV_READ, NULL);
+    
+    size_t max_buffered = 0;
+    for (size_t pos = READ_SIZE; pos < body_len; pos += READ_SIZE) {
+        TEST_ASSERT_EQUAL_INT(0, (int)c.send.len);
+        size_t len = body_len - pos < READ_SIZE ? body_len - pos : READ_SIZE;
+        mg_iobuf_add(&c.recv, c.recv.len, body + pos, len);
+        if (pos + len == body_len) mg_iobuf_add(&c.recv, c.recv.len, next_request, strlen(next_request));
+        if (c.recv.len > max_buffered) max_buffered = c.recv.len;
+        handle_mongoose_request(&c, MG_EV_READ, NULL);
+    }
+    
+    // Answered, parser back in place, the pipelined request untouched
+    TEST_ASSERT_TRUE(c.pfn == fake_http_handler);
+    TEST_ASSERT_TRUE(max_buffered <= READ_SIZE + strlen(next_request));
+    TEST_ASSERT_EQUAL_INT((int)strlen(next_request), (int)c.recv.len);
+    TEST_ASSERT_EQUAL_INT(0, memcmp(c.recv.buf, next_request, c.recv.len));
+    char *response = iobuf_to_string(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(response, "HTTP/1.1 200"));
+    TEST_ASSERT_NOT_NULL(strstr(response, "\r\n\r\n{\"imported\":10000,\"failed\":1}"));
+    free(response);
+    
+    User *user = get_user_by_id(USERS * 2);
+    TEST_ASSERT_NOT_NULL(user);
+    TEST_ASSERT_EQUAL_STRING("User 10000", user->name);
+    release_user(user);
+    free(body);
+    mg_iobuf_free(&c.recv);
+    mg_iobuf_free(&c.send);
+    cleanup_users();
+}
+
+// Parses exactly len bytes from a buffer of that size, so reading past
+// the body shows up under a sanitizer
+static int read_exact(const char *json, size_t len, UserInput *input) {
+    char *copy = (char*)malloc(len ? len : 1);
+    memcpy(copy, json, len);
+    int fast = json_read_user_input(copy, len, input);
+    if (fast) {
+        // The strings live in input->storage, not in the body
+        memset(copy, '#', len);
+    }
+    free(copy);
+    return fast;
+}
+
+void test_json_reader_should_match_cjson(void) {
+    struct {
+        const char *body;
+        int fast;
+    } cases[] = {
+        {"{\"name\":\"Alice\",\"email\":\"alice@example.com\"}", 1},
+        {" {\r\n\t\"email\" : \"bob@example.com\" ,\n \"name\" : \"Bob\" }\n", 1},
+        {"{\"name\":\"A \\\"quoted\\\" \\\\ name\\/\\b\\f\\n\\r\\t\",\"email\":\"e@x\"}", 1},
+        {"{\"NAME\":\"Upper\",\"Email\":\"mixed@example.com\"}", 1},
+        {"{\"name\":\"first\",\"name\":\"second\"}", 1},
+        {"{\"name\":1,\"name\":\"second\",\"email\":null}", 1},
+        {"{\"id\":-1.5e+3,\"ok\":true,\"gone\":false,\"x\":null,\"n\":0,\"name\":\"N\"}", 1},
+        {"{\"names\":\"no\",\"nam\":\"no\",\"email\":\"yes\"}", 1},
+        {"{\"op\":\"update\",\"ID\":7,\"id\":\"8\",\"name\":\"N\"}", 1},
+        {"{\"Op\":5,\"op\":\"delete\",\"id\":\"12\"}", 1},
+        {"{\"op\":\"delete\",\"id\":1.25e1}", 1},
+        {"{}", 1},
+        {"{\"name\":\"Alice\",\"email\":\"alice@example.com\"} trailing", 1},
+        {"{\"meta\":{\"a\":1},\"name\":\"Nested\",\"email\":\"n@x\"}", 0},
+        {"{\"tags\":[1,2],\"name\":\"Array\"}", 0},
+        {"{\"name\":\"\\u00e9t\\u00e9\",\"email\":\"u@x\"}", 0},
+        {"{\"na\\u006de\":\"Escaped key\"}", 0},
+        {"{\"n\":01,\"name\":\"Lenient number\"}", 0},
+        {"{\"id\":1000000000000000000000000000000000,\"op\":\"delete\"}", 0},
+        {"{\"name\":\"Alice\",}", 0},
+        {"{\"name\":\"Alice\"", 0},
+        {"{\"name\" \"Alice\"}", 0},
+        {"[{\"name\":\"Alice\"}]", 0},
+        {"", 0},
+        {"null", 0},
+    };
+    
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const char *body = cases[i].body;
+        UserInput input;
+        TEST_ASSERT_EQUAL_INT_MESSAGE(cases[i].fast, read_exact(body, strlen(body), &input), body);
+        if (!cases[i].fast) continue;
+        
+        cJSON *json = cJSON_ParseWithLength(body, strlen(body));
+        TEST_ASSERT_NOT_NULL_MESSAGE(json, body);
+        cJSON *name = cJSON_GetObjectItem(json, "name");
+        cJSON *email = cJSON_GetObjectItem(json, "email");
+        if (cJSON_IsString(name)) {
+            TEST_ASSERT_EQUAL_STRING_MESSAGE(name->valuestring, input.name, body);
+        } else {
+            TEST_ASSERT_NULL_MESSAGE((void*)input.name, body);
+        }
+        if (cJSON_IsString(email)) {
+            TEST_ASSERT_EQUAL_STRING_MESSAGE(email->valuestring, input.email, body);
+        } else {
+            TEST_ASSERT_NULL_MESSAGE((void*)input.email, body);
+        }
+        cJSON *op = cJSON_GetObjectItem(json, "op");
+        cJSON *id = cJSON_GetObjectItem(json, "id");
+        if (cJSON_IsString(op)) {
+            TEST_ASSERT_EQUAL_STRING_MESSAGE(op->valuestring, input.op, body);
+        } else {
+            TEST_ASSERT_NULL_MESSAGE((void*)input.op, body);
+        }
+        TEST_ASSERT_EQUAL_INT_MESSAGE(cJSON_IsNumber(id), input.has_id, body);
+        if (cJSON_IsNumber(id)) TEST_ASSERT_TRUE_MESSAGE(id->valuedouble == input.id, body);
+        int mistyped = (name && !cJSON_IsString(name)) || (email && !cJSON_IsString(email)) ||
+                       (op && !cJSON_IsString(op)) || (id && !cJSON_IsNumber(id));
+        TEST_ASSERT_EQUAL_INT_MESSAGE(mistyped, input.mistyped, body);
+        cJSON_Delete(json);
+    }
+    
+    // Every cut of a valid body stops at its length
+    const char *body = "{\"name\":\"Alice\",\"email\":\"alice@example.com\"}";
+    UserInput input;
+    for (size_t len = 0; len < strlen(body); len++) {
+        TEST_ASSERT_EQUAL_INT(0, read_exact(body, len, &input));
+    }
+    
+    // Strings that do not fit the fixed storage are left to cJSON
+    char long_body[JSON_READER_STORAGE + 64];
+    snprintf(long_body, sizeof(long_body), "{\"name\":\"%0*d\",\"email\":\"e@x\"}", JSON_READER_STORAGE, 0);
+    TEST_ASSERT_EQUAL_INT(0, read_exact(long_body, strlen(long_body), &input));
+    
+    // Over HTTP the body is not NUL-terminated and the fallback respects that too
+    cleanup_users();
+    init_users();
+    const char *posted[] = {
+        "{\"name\":\"Fast\",\"email\":\"fast@example.com\"}",
+        "{\"name\":\"\\u0053low\",\"email\":\"slow@example.com\",\"tags\":[]}",
+    };
+    for (int i = 0; i < 2; i++) {
+        struct mg_connection c;
+        struct mg_http_message hm;
+        char wire[256];
+        snprintf(wire, sizeof(wire), "%s{\"name\":\"Trailing\"}", posted[i]);
+        memset(&c, 0, sizeof(c));
+        memset(&hm, 0, sizeof(hm));
+        hm.method = mg_str("POST");
+        hm.uri = mg_str("/users");
+        hm.body = mg_str_n(wire, strlen(posted[i]));
+        handle_mongoose_request(&c, MG_EV_HTTP_MSG, &hm);
+        TEST_ASSERT_EQUAL_INT(0, strncmp((char*)c.send.buf, "HTTP/1.1 201", 12));
+        mg_iobuf_free(&c.send);
+    }
+    User *user = get_user_by_email("slow@example.com");
+    TEST_ASSERT_EQUAL_STRING("Slow", user->name);
+    release_user(user);
+    char *response = post_request("/users", NULL, "{\"name\":");
+    TEST_ASSERT_EQUAL_STRING("{\"error\":\"Invalid JSON\"}", response);
+    free(response);
+    cleanup_users();
+}
+
+void test_json_reader_benchmark_against_cjson(void) {
+    enum { BODIES = 200000 };
+    const char *body = "{\"name\":\"Johnathan Doe\",\"email\":\"johnathan.doe@example.com\"}";
+    size_t len = strlen(body);
+    struct timespec start;
+    size_t checksum = 0;
+    
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < BODIES; i++) {
+        cJSON *json = cJSON_ParseWithLength(body, len);
+        checksum += strlen(cJSON_GetObjectItem(json, "name")->valuestring);
+        checksum += strlen(cJSON_GetObjectItem(json, "email")->valuestring);
+        cJSON_Delete(json);
+    }
+    double cjson_seconds = elapsed_seconds(&start);
+    
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < BODIES; i++) {
+        UserInput input;
+        TEST_ASSERT_TRUE(json_read_user_input(body, len, &input));
+        checksum -= strlen(input.name) + strlen(input.email);
+    }
+    double reader_seconds = elapsed_seconds(&start);
+    TEST_ASSERT_EQUAL_INT(0, (int)checksum);
+    
+    printf("  %d UserInput bodies: cJSON %.1f ns/body (%.0f MB/s), pull parser %.1f ns/body (%.0f MB/s)\n",
+           BODIES, cjson_seconds * 1e9 / BODIES, (double)len * BODIES / cjson_seconds / 1e6,
+           reader_seconds * 1e9 / BODIES, (double)len * BODIES / reader_seconds / 1e6);
+}
+
+// Copies the ETag header of a raw response into etag, or "" if it has none
+static void response_etag(struct mg_connection *c, char *etag, size_t size) {
+    char *response = iobuf_to_string(&c->send);
+    char *header = strstr(response, "\r\nETag: ");
+    etag[0] = '\0';
+    if (header) {
+        header += 8;
+        size_t len = (size_t)(strstr(header, "\r\n") - header);
+        if (len < size) {
+            memcpy(etag, header, len);
+            etag[len] = '\0';
+        }
+    }
+    free(response);
+}
+
+static int response_status(struct mg_connection *c) {
+    return c->send.len > 12 ? atoi((const char*)c->send.buf + 9) : 0;
+}
+
+void test_conditional_get_should_answer_not_modified_until_store_changes(void) {
+    struct mg_connection c;
+    char user_tag[64];
+    char list_tag[64];
+    char tag[64];
+    
+    cleanup_users();
+    init_users();
+    release_user(create_user("Alice", "alice@example.com"));
+    release_user(create_user("Bob", "bob@example.com"));
+    
+    send_request(&c, "GET", "/users/1", NULL, NULL, NULL);
+    TEST_ASSERT_EQUAL_INT(200, response_status(&c));
+    response_etag(&c, user_tag, sizeof(user_tag));
+    TEST_ASSERT_TRUE(user_tag[0] == '"');
+    mg_iobuf_free(&c.send);
+    send_request(&c, "GET", "/users", NULL, NULL, NULL);
+    response_etag(&c, list_tag, sizeof(list_tag));
+    TEST_ASSERT_TRUE(list_tag[0] == '"');
+    TEST_ASSERT_NOT_EQUAL(0, strcmp(user_tag, list_tag));
+    mg_iobuf_free(&c.send);
+    
+    // Same tag back: 304 with no body
+    send_request(&c, "GET", "/users/1", NULL, "If-None-Match", user_tag);
+    TEST_ASSERT_EQUAL_INT(304, response_status(&c));
+    TEST_ASSERT_EQUAL_INT(0, memcmp(c.send.buf + c.send.len - 4, "\r\n\r\n", 4));
+    mg_iobuf_free(&c.send);
+    send_request(&c, "GET", "/users", NULL, "If-None-Match", list_tag);
+    TEST_ASSERT_EQUAL_INT(304, response_status(&c));
+    mg_iobuf_free(&c.send);
+    send_request(&c, "GET", "/users", "limit=1", "If-None-Match", list_tag);
+    TEST_ASSERT_EQUAL_INT(304, response_status(&c));
+    mg_iobuf_free(&c.send);
+    
+    // Indented output is a different representation
+    send_request(&c, "GET", "/users/1", "pretty=1", "If-None-Match", user_tag);
+    TEST_ASSERT_EQUAL_INT(200, response_status(&c));
+    mg_iobuf_free(&c.send);
+    
+    // A write elsewhere changes the listing but not user 1
+    release_user(update_user(2, "Robert", NULL));
+    send_request(&c, "GET", "/users/1", NULL, "If-None-Match", user_tag);
+    TEST_ASSERT_EQUAL_INT(304, response_status(&c));
+    mg_iobuf_free(&c.send);
+    send_request(&c, "GET", "/users", NULL, "If-None-Match", list_tag);
+    TEST_ASSERT_EQUAL_INT(200, response_status(&c));
+    response_etag(&c, tag, sizeof(tag));
+    TEST_ASSERT_NOT_EQUAL(0, strcmp(tag, list_tag));
+    mg_iobuf_free(&c.send);
+    
+    // Updating the user itself, even to the same values, gives a new tag
+    release_user(update_user(1, "Alice", NULL));
+    send_request(&c, "GET", "/users/1", NULL, "If-None-Match", user_tag);
+    TEST_ASSERT_EQUAL_INT(200, response_status(&c));
+    response_etag(&c, tag, sizeof(tag));
+    TEST_ASSERT_NOT_EQUAL(0, strcmp(tag, user_tag));
+    mg_iobuf_free(&c.send);
+    
+    // Deletes move the listing on too
+    send_request(&c, "GET", "/users", "limit=10", NULL, NULL);
+    response_etag(&c, list_tag, sizeof(list_tag));
+    mg_iobuf_free(&c.send);
+    delete_user(2);
+    send_request(&c, "GET", "/users", "limit=10", "If-None-Match", list_tag);
+    TEST_ASSERT_EQUAL_INT(200, response_status(&c));
+    mg_iobuf_free(&c.send);
+    cleanup_users();
+}
+
+void test_conditional_get_benchmark_against_full_render(void) {
+    enum { USERS = 10000, POLLS = 200 };
+    struct mg_connection c;
+    struct timespec start;
+    char tag[64];
+    
+    cleanup_users();
+    init_users();
+    seed_numbered_users(1, USERS);
+    send_request(&c, "GET", "/users", "limit=1000", NULL, NULL);
+    response_etag(&c, tag, sizeof(tag));
+    mg_iobuf_free(&c.send);
+    
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < POLLS; i++) {
+        send_request(&c, "GET", "/users", "limit=1000", NULL, NULL);
+        TEST_ASSERT_EQUAL_INT(200, response_status(&c));
+        mg_iobuf_free(&c.send);
+    }
+    double full_seconds = elapsed_seconds(&start);
+    
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < POLLS; i++) {
+        send_request(&c, "GET", "/users", "limit=1000", "If-None-Match", tag);
+        TEST_ASSERT_EQUAL_INT(304, response_status(&c));
+        mg_iobuf_free(&c.send);
+    }
+    double cached_seconds = elapsed_seconds(&start);
+    
+    printf("  GET /users?limit=1000 poll: %.1f us rendered, %.2f us as 304\n",
+           full_seconds * 1e6 / POLLS, cached_seconds * 1e6 / POLLS);
+    cleanup_users();
+}
+
+void test_full_listing_should_be_rendered_once_per_generation(void) {
+    enum { CONNECTIONS = 32, OVERSIZED = 120000 };
+    static struct mg_connection conns[CONNECTIONS];
+    struct mg_connection c;
+    struct mg_mgr mgr;
+    const char *request = "GET /users HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    
+    cleanup_users();
+    init_users();
+    seed_numbered_users(1, 100);
+    
+    // Every connection asks for the list at once; all get the same message
+    memset(&mgr, 0, sizeof(mgr));
+    memset(conns, 0, sizeof(conns));
+    for (int i = 0; i < CONNECTIONS; i++) {
+        conns[i].mgr = &mgr;
+        conns[i].id = (unsigned long)(i + 1);
+    }
+    TEST_ASSERT_TRUE(start_request_workers(4));
+    for (int i = 0; i < CONNECTIONS; i++) {
+        struct mg_http_message hm;
+        TEST_ASSERT_TRUE(mg_http_parse(request, strlen(request), &hm) > 0);
+        handle_mongoose_request(&conns[i], MG_EV_HTTP_MSG, &hm);
+    }
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    int answered = 0;
+    while (answered < CONNECTIONS && elapsed_seconds(&start) < 10.0) {
+        // A wakeup for any connection delivers every finished response
+        handle_mongoose_request(&conns[0], MG_EV_WAKEUP, NULL);
+        answered = 0;
+        for (int i = 0; i < CONNECTIONS; i++) {
+            if (conns[i].send.len > 0 && !conns[i].is_resp) answered++;
+        }
+    }
+    stop_request_workers();
+    TEST_ASSERT_EQUAL_INT(CONNECTIONS, answered);
+    char *first = iobuf_to_string(&conns[0].send);
+    size_t first_len = conns[0].send.len;
+    TEST_ASSERT_NOT_NULL(strstr(first, "Content-Length: "));
+    TEST_ASSERT_NULL(strstr(first, "Transfer-Encoding"));
+    for (int i = 0; i < CONNECTIONS; i++) {
+        TEST_ASSERT_EQUAL_INT((int)first_len, (int)conns[i].send.len);
+        TEST_ASSERT_EQUAL_INT(0, memcmp(first, conns[i].send.buf, first_len));
+        mg_iobuf_free(&conns[i].send);
+    }
+    free(first);
+    
+#ifdef HAVE_ZLIB
+    // The entry above was rendered for clients without gzip; the first
+    // read after a write that accepts it gets a compressed one
+    release_user(update_user(1, "User 1", NULL));
+    send_request(&c, "GET", "/users", NULL, "Accept-Encoding", "gzip");
+    char *gzipped = iobuf_to_string(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(gzipped, "Content-Encoding: gzip"));
+    TEST_ASSERT_NOT_NULL(strstr(gzipped, "-gzip\"\r\n"));
+    mg_iobuf_free(&c.send);
+    free(gzipped);
+#endif
+    
+    // A write is seen by the next read
+    release_user(update_user(7, "Renamed", NULL));
+    char *body = dispatch_request("GET", "/users", NULL, NULL);
+    TEST_ASSERT_NOT_NULL(strstr(body, "\"name\":\"Renamed\""));
+    free(body);
+    delete_user(7);
+    body = dispatch_request("GET", "/users", NULL, NULL);
+    TEST_ASSERT_NULL(strstr(body, "\"name\":\"Renamed\""));
+    free(body);
+    
+    // Past the cache's size limit the list is streamed as before
+    seed_numbered_users(101, OVERSIZED);
+    send_request(&c, "GET", "/users", "pretty=1", NULL, NULL);
+    char *response = iobuf_to_string(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(response, "Transfer-Encoding: chunked"));
+    free(response);
+    mg_iobuf_free(&c.send);
+    cJSON *users = get_all_users();
+    char *expected = cJSON_Print(users);
+    body = dispatch_request("GET", "/users", "pretty=1", NULL);
+    TEST_ASSERT_EQUAL_STRING(expected, body);
+    free(body);
+    free(expected);
+    cJSON_Delete(users);
+    cleanup_users();
+}
+
+void test_full_listing_cache_benchmark_against_render(void) {
+    enum { USERS = 10000, READS = 200 };
+    struct mg_connection c;
+    struct timespec start;
+    
+    cleanup_users();
+    init_users();
+    seed_numbered_users(1, USERS);
+    
+    // A write before every read forces a fresh render each time
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < READS; i++) {
+        release_user(update_user(1, "User 1", NULL));
+        send_request(&c, "GET", "/users", NULL, NULL, NULL);
+        TEST_ASSERT_EQUAL_INT(200, response_status(&c));
+        mg_iobuf_free(&c.send);
+    }
+    double render_seconds = elapsed_seconds(&start);
+    
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < READS; i++) {
+        send_request(&c, "GET", "/users", NULL, NULL, NULL);
+        TEST_ASSERT_EQUAL_INT(200, response_status(&c));
+        mg_iobuf_free(&c.send);
+    }
+    double cached_seconds = elapsed_seconds(&start);
+    
+    printf("  GET /users with %d users: %.1f us after a write, %.1f us from the cache\n",
+           USERS, render_seconds * 1e6 / READS, cached_seconds * 1e6 / READS);
+    cleanup_users();
+}
+
+#ifdef HAVE_ZLIB
+// Inflates a gzip body into a new NUL-terminated string
+static char* gunzip(const char *data, size_t len) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    TEST_ASSERT_EQUAL_INT(Z_OK, inflateInit2(&stream, 15 + 16));
+    size_t size = len * 8 + 1024;
+    char *out = (char*)malloc(size);
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)len;
+    int status = Z_OK;
+    while (status == Z_OK) {
+        if (stream.total_out + 1 >= size) {
+            size *= 2;
+            out = (char*)realloc(out, size);
+        }
+        stream.next_out = (Bytef*)out + stream.total_out;
+        stream.avail_out = (uInt)(size - stream.total_out - 1);
+        status = inflate(&stream, Z_NO_FLUSH);
+    }
+    TEST_ASSERT_EQUAL_INT(Z_STREAM_END, status);
+    out[stream.total_out] = '\0';
+    inflateEnd(&stream);
+    return out;
+}
+
+static char* request_gunzipped(const char *request, char *etag, size_t etag_size) {
+    struct mg_connection c;
+    send_raw_request(&c, request);
+    char *response = iobuf_to_string(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(response, "Content-Encoding: gzip\r\n"));
+    TEST_ASSERT_NOT_NULL(strstr(response, "Vary: Accept-Encoding\r\n"));
+    free(response);
+    if (etag) response_etag(&c, etag, etag_size);
+    size_t len;
+    char *body = response_body(&c, &len);
+    char *plain = gunzip(body, len);
+    free(body);
+    return plain;
+}
+#endif
+
+void test_dynamic_responses_should_be_gzipped_when_accepted(void) {
+#ifdef HAVE_ZLIB
+    struct mg_connection c;
+    char etag[64];
+    char request[256];
+    
+    cleanup_users();
+    init_users();
+    seed_numbered_users(1, 3000);
+    char *before = dispatch_request("GET", "/metrics", NULL, NULL);
+    
+    // A page: same body as uncompressed, under the gzip variant's tag
+    char *expected = dispatch_request("GET", "/users", "limit=200", NULL);
+    char *plain = request_gunzipped("GET /users?limit=200 HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n",
+                                    etag, sizeof(etag));
+    TEST_ASSERT_EQUAL_STRING(expected, plain);
+    TEST_ASSERT_EQUAL_INT(0, strcmp(etag + strlen(etag) - 6, "-gzip\""));
+    free(expected);
+    free(plain);
+    sprintf(request, "GET /users?limit=200 HTTP/1.1\r\nAccept-Encoding: gzip\r\nIf-None-Match: %s\r\n\r\n", etag);
+    send_raw_request(&c, request);
+    TEST_ASSERT_EQUAL_INT(304, response_status(&c));
+    // Caches must not answer a gzip validator with the identity body
+    char *response = iobuf_to_string(&c.send);
+    TEST_ASSERT_NOT_NULL(strstr(response, "\r\nVary: Accept-Encoding\r\n"));
+    free(response);
+    mg_iobuf_free(&c.send);
+    
+    // The streamed export is compressed as it goes, and every write the
+    // event loop reports gets more of it (response_body checks)
+    expected = dispatch_request("GET", "/users/export", NULL, NULL);
+    plain = request_gunzipped("GET /users/export HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n", NULL, 0);
+    TEST_ASSERT_EQUAL_STRING(expected, plain);
+    free(expected);
+    free(plain);
+    
+    // Small bodies and clients that do not ask stay uncompressed
+    send_raw_request(&c, "GET /users/1 HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n");
+    response = iobuf_to_string(&c.send);
+    TEST_ASSERT_NULL(strstr(response, "Content-Encoding"));
+    free(response);
+    mg_iobuf_free(&c.send);
+    send_raw_request(&c, "GET /users?limit=200 HTTP/1.1\r\nAccept-Encoding: gzip;q=0\r\n\r\n");
+    response = iobuf_to_string(&c.send);
+    TEST_ASSERT_NULL(strstr(response, "Content-Encoding"));
+    free(response);
+    mg_iobuf_free(&c.send);
+    
+    // Metrics see what went in and what came out
+    char *after = dispatch_request("GET", "/metrics", NULL, NULL);
+    double in = metric_value(after, "http_compression_input_bytes_total") -
+                metric_value(before, "http_compression_input_bytes_total");
+    double out = metric_value(after, "http_compression_output_bytes_total") -
+                 metric_value(before, "http_compression_output_bytes_total");
+    TEST_ASSERT_TRUE(in > 0);
+    TEST_ASSERT_TRUE(out > 0 && out < in / 2);
+    TEST_ASSERT_TRUE(metric_value(after, "http_compression_seconds_total") > 0);
+    TEST_ASSERT_TRUE(metric_value(after, "http_compression_ratio") < 1);
+    free(before);
+    free(after);
+    cleanup_users();
+#endif
+}
+
+void test_response_gzip_benchmark(void) {
+#ifdef HAVE_ZLIB
+    enum { USERS = 10000, REQUESTS = 200 };
+    struct mg_connection c;
+    struct timespec start;
+    const char *requests[2] = {
+        "GET /users?limit=1000 HTTP/1.1\r\n\r\n",
+        "GET /users?limit=1000 HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n"
+    };
+    double seconds[2];
+    size_t bytes[2];
+    
+    cleanup_users();
+    init_users();
+    seed_numbered_users(1, USERS);
+    for (int gzip = 0; gzip < 2; gzip++) {
+        timespec_get(&start, TIME_UTC);
+        for (int i = 0; i < REQUESTS; i++) {
+            send_raw_request(&c, requests[gzip]);
+            bytes[gzip] = c.send.len;
+            mg_iobuf_free(&c.send);
+        }
+        seconds[gzip] = elapsed_seconds(&start);
+    }
+    
+    printf("  GET /users?limit=1000: %lu bytes in %.1f us, gzipped %lu bytes (%.1f%%) in %.1f us\n",
+           (unsigned long)bytes[0], seconds[0] * 1e6 / REQUESTS, (unsigned long)bytes[1],
+           100.0 * (double)bytes[1] / (double)bytes[0], seconds[1] * 1e6 / REQUESTS);
+    cleanup_users();
+#endif
+}
+
+static int starts_with(const char *str, const char *prefix) {
+    return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+void test_response_heads_should_carry_status_type_and_cors(void) {
+    struct mg_connection c;
+    
+    cleanup_users();
+    init_users();
+    send_request(&c, "GET", "/users/9", NULL, NULL, NULL);
+    char *response = iobuf_to_string(&c.send);
+    TEST_ASSERT_TRUE(starts_with(response, "HTTP/1.1 404 Not Found\r\n"
+                                           "Content-Type: application/json\r\n"
+                                           "Access-Control-Allow-Origin: *\r\n"));
+    TEST_ASSERT_NOT_NULL(strstr(response, "\r\nVary: Accept-Encoding\r\nContent-Length: 26"));
+    free(response);
+    mg_iobuf_free(&c.send);
+    
+    send_request(&c, "OPTIONS", "/users", NULL, NULL, NULL);
+    response = iobuf_to_string(&c.send);
+    TEST_ASSERT_TRUE(starts_with(response, "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n"));
+    TEST_ASSERT_NOT_NULL(strstr(response, "Access-Control-Max-Age: 86400\r\nContent-Length: 0\r\n\r\n"));
+    free(response);
+    mg_iobuf_free(&c.send);
+    
+    send_raw_request(&c, "GET /users HTTP/1.1\r\nIf-None-Match: *\r\n\r\n");
+    response = iobuf_to_string(&c.send);
+    TEST_ASSERT_TRUE(starts_with(response, "HTTP/1.1 304 Not Modified\r\nAccess-Control-Allow-Origin: *\r\n"));
+    TEST_ASSERT_EQUAL_INT(0, strcmp(response + strlen(response) - 4, "\r\n\r\n"));
+    free(response);
+    mg_iobuf_free(&c.send);
+}
+
+#ifndef _WIN32
+// Runs GET /users and plays the event loop's part over a socket pair:
+// anything queued in c->send is written to fds[0], and the response is
+// read back from fds[1] into wire. With direct set the connection has the
+// socket, so the routes may write to it themselves. peak is the largest
+// the send buffer got.
+static void serve_over_socket(int fds[2], int direct, struct mg_iobuf *wire, size_t *peak) {
+    struct mg_connection c;
+    struct mg_http_message hm;
+    char buf[65536];
+    memset(&c, 0, sizeof(c));
+    memset(&hm, 0, sizeof(hm));
+    hm.method = mg_str("GET");
+    hm.uri = mg_str("/users");
+    hm.query = mg_str("");
+    if (direct) c.fd = (void*)(size_t)fds[0];
+    handle_mongoose_request(&c, MG_EV_HTTP_MSG, &hm);
+    
+    *peak = c.send.len;
+    wire->len = 0;
+    for (;;) {
+        ssize_t n;
+        while ((n = read(fds[1], buf, sizeof(buf))) > 0) mg_iobuf_add(wire, wire->len, buf, (size_t)n);
+        if (!c.is_resp && c.send.len == 0) break;
+        if (c.send.len > 0 && (n = send(fds[0], c.send.buf, c.send.len, 0)) > 0) {
+            mg_iobuf_del(&c.send, 0, (size_t)n);
+        }
+        handle_mongoose_request(&c, MG_EV_WRITE, NULL);
+        if (c.send.len > *peak) *peak = c.send.len;
+    }
+    mg_iobuf_free(&c.send);
+}
+
+static int open_socket_pair(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 0;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+    return 1;
+}
+#endif
+
+void test_large_cached_bodies_should_be_written_from_the_cache(void) {
+#ifndef _WIN32
+    int fds[2];
+    struct mg_iobuf wire = {0};
+    size_t peak;
+    size_t expected_len;
+    
+    cleanup_users();
+    init_users();
+    seed_numbered_users(1, 20000);
+    // Without a socket the body is copied behind the head as before
+    char *expected = dispatch_request("GET", "/users", NULL, NULL);
+    expected_len = strlen(expected);
+    TEST_ASSERT_TRUE(expected_len > 1000000);
+    
+    TEST_ASSERT_TRUE(open_socket_pair(fds));
+    for (int round = 0; round < 2; round++) {
+        serve_over_socket(fds, 1, &wire, &peak);
+        mg_iobuf_add(&wire, wire.len, "", 1);
+        char *body = strstr((char*)wire.buf, "\r\n\r\n");
+        TEST_ASSERT_NOT_NULL(body);
+        TEST_ASSERT_TRUE(starts_with((char*)wire.buf, "HTTP/1.1 200 OK\r\n"));
+        TEST_ASSERT_EQUAL_STRING(expected, body + 4);
+        // Only slices of the body ever pass through the send buffer
+        TEST_ASSERT_TRUE(peak < expected_len / 16);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    mg_iobuf_free(&wire);
+    free(expected);
+    cleanup_users();
+#endif
+}
+
+void test_response_write_benchmark(void) {
+    enum { HEADS = 100000, USERS = 20000, LISTS = 50 };
+    struct mg_connection c;
+    struct timespec start;
+    static const char head[] = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: application/json\r\n"
+                               "Access-Control-Allow-Origin: *\r\n"
+                               "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
+                               "Access-Control-Allow-Headers: Content-Type, Authorization, X-Requested-With, Accept, "
+                               "Origin\r\n"
+                               "Vary: Accept-Encoding\r\n";
+    
+    // Formatting the head for every response against copying a prebuilt one
+    memset(&c, 0, sizeof(c));
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < HEADS; i++) {
+        c.send.len = 0;
+        mg_printf(&c, "HTTP/1.1 %d %s\r\n"
+                      "Content-Type: %s\r\n"
+                      "Access-Control-Allow-Origin: *\r\n"
+                      "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
+                      "Access-Control-Allow-Headers: Content-Type, Authorization, X-Requested-With, Accept, Origin\r\n"
+                      "Vary: Accept-Encoding\r\n", 200, "OK", "application/json");
+    }
+    double formatted = elapsed_seconds(&start);
+    TEST_ASSERT_EQUAL_INT(sizeof(head) - 1, c.send.len);
+    TEST_ASSERT_EQUAL_INT(0, memcmp(c.send.buf, head, sizeof(head) - 1));
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < HEADS; i++) {
+        c.send.len = 0;
+        mg_send(&c, head, sizeof(head) - 1);
+    }
+    double prebuilt = elapsed_seconds(&start);
+    mg_iobuf_free(&c.send);
+    printf("  Response head: formatted %.0f ns, prebuilt %.0f ns\n",
+           formatted * 1e9 / HEADS, prebuilt * 1e9 / HEADS);
+    
+#ifndef _WIN32
+    int fds[2];
+    struct mg_iobuf wire = {0};
+    double seconds[2];
+    size_t peak[2];
+    
+    cleanup_users();
+    init_users();
+    seed_numbered_users(1, USERS);
+    TEST_ASSERT_TRUE(open_socket_pair(fds));
+    for (int direct = 0; direct < 2; direct++) {
+        timespec_get(&start, TIME_UTC);
+        for (int i = 0; i < LISTS; i++) {
+            serve_over_socket(fds, direct, &wire, &peak[direct]);
+        }
+        seconds[direct] = elapsed_seconds(&start);
+    }
+    printf("  Cached GET /users (%lu bytes) over a socket: copied %.0f us (send buffer %lu KB), "
+           "direct %.0f us (send buffer %lu KB)\n",
+           (unsigned long)wire.len, seconds[0] * 1e6 / LISTS, (unsigned long)(peak[0] / 1024),
+           seconds[1] * 1e6 / LISTS, (unsigned long)(peak[1] / 1024));
+    close(fds[0]);
+    close(fds[1]);
+    mg_iobuf_free(&wire);
+    cleanup_users();
+#endif
+}
+
 int main(void) {
     UNITY_BEGIN();
     
@@ -173,6 +1885,40 @@ int main(void) {
     RUN_TEST(test_multiple_users);
     RUN_TEST(test_user_json_conversion);
     RUN_TEST(test_get_all_users_json);
+    RUN_TEST(test_responses_should_be_compact_unless_pretty_requested);
+    RUN_TEST(test_full_listing_should_stream_in_chunks);
+    RUN_TEST(test_swagger_spec_should_be_served_from_cache);
+    RUN_TEST(test_requests_should_round_trip_through_worker_pool);
+    RUN_TEST(test_access_log_should_be_written_in_batches);
+    RUN_TEST(test_logger_should_stop_while_threads_are_logging);
+    RUN_TEST(test_logger_should_free_rings_of_exited_threads);
+    RUN_TEST(test_logger_should_wake_from_idle_for_one_line);
+    RUN_TEST(test_registered_routes_should_dispatch_by_method_and_path);
+    RUN_TEST(test_metrics_should_count_requests_per_route);
+    RUN_TEST(test_json_writer_should_match_cjson_output);
+    RUN_TEST(test_bulk_endpoint_should_report_each_operation);
+    RUN_TEST(test_export_and_import_should_round_trip_users);
+    RUN_TEST(test_import_should_stream_body_from_receive_buffer);
+    RUN_TEST(test_json_reader_should_match_cjson);
+    RUN_TEST(test_conditional_get_should_answer_not_modified_until_store_changes);
+    RUN_TEST(test_full_listing_should_be_rendered_once_per_generation);
+    RUN_TEST(test_dynamic_responses_should_be_gzipped_when_accepted);
+    RUN_TEST(test_response_heads_should_carry_status_type_and_cors);
+    RUN_TEST(test_large_cached_bodies_should_be_written_from_the_cache);
+    
+    // Timing runs: slow, and only their printed numbers matter
+    if (getenv("RUN_BENCHMARKS")) {
+        RUN_TEST(test_access_log_benchmark);
+        RUN_TEST(test_route_dispatch_benchmark);
+        RUN_TEST(test_json_writer_benchmark_against_cjson);
+        RUN_TEST(test_user_fragment_list_benchmark);
+        RUN_TEST(test_bulk_endpoint_benchmark_against_single_requests);
+        RUN_TEST(test_json_reader_benchmark_against_cjson);
+        RUN_TEST(test_conditional_get_benchmark_against_full_render);
+        RUN_TEST(test_full_listing_cache_benchmark_against_render);
+        RUN_TEST(test_response_gzip_benchmark);
+        RUN_TEST(test_response_write_benchmark);
+    }
     
     return UNITY_END();
 }
@@ -1,5 +1,95 @@
+#include <time.h>
+#include <stdlib.h>
+#include <limits.h>
 #include "unity.h"
 #include "users.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef struct StressWorker {
+    int thread_index;
+    int iterations;
+    long ops;
+    int failures;
+} StressWorker;
+
+static void stress_worker(StressWorker *worker) {
+    char name[64];
+    char email[64];
+    for (int i = 0; i < worker->iterations; i++) {
+        sprintf(name, "Worker %d-%d", worker->thread_index, i);
+        sprintf(email, "w%d-%d@example.com", worker->thread_index, i);
+        User *user = create_user(name, email);
+        if (!user) {
+            worker->failures++;
+            continue;
+        }
+        int id = user->id;
+        release_user(user);
+        
+        User *found = get_user_by_id(id);
+        if (!found || strcmp(found->email, email) != 0) worker->failures++;
+        release_user(found);
+        
+        User *updated = update_user(id, "Renamed", NULL);
+        if (!updated) worker->failures++;
+        release_user(updated);
+        worker->ops += 3;
+        
+        // Every other user is removed again so the store keeps churning
+        if (i % 2 == 1) {
+            if (!delete_user(id)) worker->failures++;
+            worker->ops++;
+        }
+    }
+}
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+static DWORD WINAPI stress_thread_main(LPVOID arg) {
+    stress_worker((StressWorker*)arg);
+    return 0;
+}
+static void thread_start(thread_t *thread, StressWorker *worker) {
+    *thread = CreateThread(NULL, 0, stress_thread_main, worker, 0, NULL);
+}
+static void thread_join(thread_t thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+#else
+typedef pthread_t thread_t;
+static void* stress_thread_main(void *arg) {
+    stress_worker((StressWorker*)arg);
+    return NULL;
+}
+static void thread_start(thread_t *thread, StressWorker *worker) {
+    pthread_create(thread, NULL, stress_thread_main, worker);
+}
+static void thread_join(thread_t thread) {
+    pthread_join(thread, NULL);
+}
+#endif
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Creates "User <i>" <user<i>@example.com> for every i from first to last
+static void seed_numbered_users(int first, int last) {
+    char name[50];
+    char email[50];
+    for (int i = first; i <= last; i++) {
+        sprintf(name, "User %d", i);
+        sprintf(email, "user%d@example.com", i);
+        release_user(create_user(name, email));
+    }
+}
 
 void setUp(void) {
     init_users();
@@ -16,6 +106,7 @@ void test_create_user_should_create_new_user(void) {
     TEST_ASSERT_EQUAL_INT(1, user->id);
     TEST_ASSERT_EQUAL_STRING("Test User", user->name);
     TEST_ASSERT_EQUAL_STRING("test@example.com", user->email);
+    release_user(user);
 }
 
 void test_create_user_should_increment_ids(void) {
@@ -26,6 +117,9 @@ void test_create_user_should_increment_ids(void) {
     TEST_ASSERT_EQUAL_INT(1, user1->id);
     TEST_ASSERT_EQUAL_INT(2, user2->id);
     TEST_ASSERT_EQUAL_INT(3, user3->id);
+    release_user(user1);
+    release_user(user2);
+    release_user(user3);
 }
 
 void test_create_user_should_reject_null_input(void) {
@@ -41,6 +135,7 @@ void test_create_user_should_reject_null_input(void) {
 void test_get_user_by_id_should_find_existing_user(void) {
     User *created = create_user("Find Me", "findme@example.com");
     int id = created->id;
+    release_user(created);
     
     User *found = get_user_by_id(id);
     
@@ -48,6 +143,7 @@ void test_get_user_by_id_should_find_existing_user(void) {
     TEST_ASSERT_EQUAL_INT(id, found->id);
     TEST_ASSERT_EQUAL_STRING("Find Me", found->name);
     TEST_ASSERT_EQUAL_STRING("findme@example.com", found->email);
+    release_user(found);
 }
 
 void test_get_user_by_id_should_return_null_for_nonexistent(void) {
@@ -58,34 +154,40 @@ void test_get_user_by_id_should_return_null_for_nonexistent(void) {
 void test_update_user_should_update_name_only(void) {
     User *user = create_user("Original Name", "original@example.com");
     int id = user->id;
+    release_user(user);
     
     User *updated = update_user(id, "New Name", NULL);
     
     TEST_ASSERT_NOT_NULL(updated);
     TEST_ASSERT_EQUAL_STRING("New Name", updated->name);
     TEST_ASSERT_EQUAL_STRING("original@example.com", updated->email);
+    release_user(updated);
 }
 
 void test_update_user_should_update_email_only(void) {
     User *user = create_user("Test User", "original@example.com");
     int id = user->id;
+    release_user(user);
     
     User *updated = update_user(id, NULL, "new@example.com");
     
     TEST_ASSERT_NOT_NULL(updated);
     TEST_ASSERT_EQUAL_STRING("Test User", updated->name);
     TEST_ASSERT_EQUAL_STRING("new@example.com", updated->email);
+    release_user(updated);
 }
 
 void test_update_user_should_update_both_fields(void) {
     User *user = create_user("Old Name", "old@example.com");
     int id = user->id;
+    release_user(user);
     
     User *updated = update_user(id, "New Name", "new@example.com");
     
     TEST_ASSERT_NOT_NULL(updated);
     TEST_ASSERT_EQUAL_STRING("New Name", updated->name);
     TEST_ASSERT_EQUAL_STRING("new@example.com", updated->email);
+    release_user(updated);
 }
 
 void test_update_user_should_return_null_for_nonexistent(void) {
@@ -96,10 +198,12 @@ void test_update_user_should_return_null_for_nonexistent(void) {
 void test_delete_user_should_remove_existing_user(void) {
     User *user = create_user("Delete Me", "delete@example.com");
     int id = user->id;
+    release_user(user);
     
     // Verify user exists
     User *found = get_user_by_id(id);
     TEST_ASSERT_NOT_NULL(found);
+    release_user(found);
     
     // Delete user
     int result = delete_user(id);
@@ -124,9 +228,9 @@ void test_get_all_users_should_return_json_array(void) {
     cJSON_Delete(users);
     
     // Add some users
-    create_user("User 1", "user1@example.com");
-    create_user("User 2", "user2@example.com");
-    create_user("User 3", "user3@example.com");
+    release_user(create_user("User 1", "user1@example.com"));
+    release_user(create_user("User 2", "user2@example.com"));
+    release_user(create_user("User 3", "user3@example.com"));
     
     // Get all users
     users = get_all_users();
@@ -170,6 +274,7 @@ void test_user_to_json_should_convert_user_struct(void) {
     TEST_ASSERT_EQUAL_STRING("json@example.com", email->valuestring);
     
     cJSON_Delete(json);
+    release_user(user);
 }
 
 void test_user_to_json_should_handle_null(void) {
@@ -188,16 +293,19 @@ void test_seed_users_should_create_three_users(void) {
     TEST_ASSERT_NOT_NULL(alice);
     TEST_ASSERT_EQUAL_STRING("Alice", alice->name);
     TEST_ASSERT_EQUAL_STRING("alice@example.com", alice->email);
+    release_user(alice);
     
     User *bob = get_user_by_id(2);
     TEST_ASSERT_NOT_NULL(bob);
     TEST_ASSERT_EQUAL_STRING("Bob", bob->name);
     TEST_ASSERT_EQUAL_STRING("bob@example.com", bob->email);
+    release_user(bob);
     
     User *charlie = get_user_by_id(3);
     TEST_ASSERT_NOT_NULL(charlie);
     TEST_ASSERT_EQUAL_STRING("Charlie", charlie->name);
     TEST_ASSERT_EQUAL_STRING("charlie@example.com", charlie->email);
+    release_user(charlie);
     
     cJSON_Delete(users);
 }
@@ -212,6 +320,7 @@ void test_concurrent_operations_should_maintain_consistency(void) {
         User *user = create_user(name, email);
         TEST_ASSERT_NOT_NULL(user);
         TEST_ASSERT_EQUAL_INT(i + 1, user->id);
+        release_user(user);
     }
     
     // Verify all users exist
@@ -231,6 +340,719 @@ void test_concurrent_operations_should_maintain_consistency(void) {
     cJSON_Delete(users);
 }
 
+// Runs `threads` stress workers against an empty store and checks that
+// the survivors come back exactly once each, in ascending id order.
+// Returns the number of operations performed.
+static long run_stress_workers(int threads, int iterations) {
+    thread_t handles[8];
+    StressWorker workers[8];
+    
+    cleanup_users();
+    init_users();
+    for (int i = 0; i < threads; i++) {
+        workers[i].thread_index = i;
+        workers[i].iterations = iterations;
+        workers[i].ops = 0;
+        workers[i].failures = 0;
+        thread_start(&handles[i], &workers[i]);
+    }
+    long ops = 0;
+    for (int i = 0; i < threads; i++) {
+        thread_join(handles[i]);
+        ops += workers[i].ops;
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+    
+    cJSON *users = get_all_users();
+    TEST_ASSERT_EQUAL_INT(threads * iterations / 2, cJSON_GetArraySize(users));
+    int previous_id = 0;
+    int ordered = 1;
+    cJSON *item;
+    cJSON_ArrayForEach(item, users) {
+        int id = cJSON_GetObjectItem(item, "id")->valueint;
+        if (id <= previous_id) ordered = 0;
+        previous_id = id;
+    }
+    TEST_ASSERT_TRUE(ordered);
+    cJSON_Delete(users);
+    return ops;
+}
+
+void test_concurrent_operations_should_maintain_consistency_across_threads(void) {
+    run_stress_workers(4, 2000);
+}
+
+void test_concurrent_operations_benchmark(void) {
+    int thread_counts[] = {1, 2, 4, 8};
+    for (int t = 0; t < 4; t++) {
+        struct timespec start;
+        timespec_get(&start, TIME_UTC);
+        long ops = run_stress_workers(thread_counts[t], 20000);
+        double seconds = elapsed_seconds(&start);
+        printf("  %d thread(s): %.0f ops/sec\n", thread_counts[t], seconds > 0 ? ops / seconds : 0.0);
+    }
+}
+
+void test_get_user_by_id_should_find_users_across_index_resizes(void) {
+    // Churn deletes in while the index is growing
+    for (int i = 3; i <= 6000; i += 3) {
+        seed_numbered_users(i - 2, i);
+        TEST_ASSERT_EQUAL_INT(1, delete_user(i - 1));
+    }
+    
+    for (int i = 1; i <= 6000; i++) {
+        User *user = get_user_by_id(i);
+        if (i % 3 == 2) {
+            TEST_ASSERT_NULL(user);
+        } else {
+            TEST_ASSERT_NOT_NULL(user);
+            TEST_ASSERT_EQUAL_INT(i, user->id);
+            release_user(user);
+        }
+    }
+    
+    cJSON *users = get_all_users();
+    TEST_ASSERT_EQUAL_INT(4000, cJSON_GetArraySize(users));
+    cJSON_Delete(users);
+}
+
+void test_id_lookup_cost_should_stay_flat_as_store_grows(void) {
+    // 16000 users take every shard's index through several resizes
+    int sizes[] = {1000, 4000, 16000};
+    int created = 0;
+    
+    for (int s = 0; s < 3; s++) {
+        seed_numbered_users(created + 1, sizes[s]);
+        created = sizes[s];
+        
+        UserStoreStats stats;
+        get_user_store_stats(&stats);
+        TEST_ASSERT_EQUAL_INT(sizes[s], (int)stats.user_count);
+        // Linear probing below 75% load averages well under 3 slots per hit
+        TEST_ASSERT_TRUE(stats.index_avg_probe <= 3.0);
+        TEST_ASSERT_TRUE(stats.index_max_probe <= 64);
+    }
+}
+
+void test_create_user_should_reject_duplicate_email(void) {
+    User *first = create_user("First", "same@example.com");
+    TEST_ASSERT_NOT_NULL(first);
+    
+    User *second = create_user("Second", "same@example.com");
+    TEST_ASSERT_NULL(second);
+    TEST_ASSERT_EQUAL_INT(USER_ERR_EMAIL_TAKEN, users_last_error());
+    
+    // The email becomes available again once its owner is deleted
+    TEST_ASSERT_EQUAL_INT(1, delete_user(first->id));
+    release_user(first);
+    second = create_user("Second", "same@example.com");
+    TEST_ASSERT_NOT_NULL(second);
+    release_user(second);
+}
+
+void test_get_user_by_email_should_follow_updates(void) {
+    User *user = create_user("Mail User", "old@example.com");
+    int id = user->id;
+    release_user(user);
+    release_user(create_user("Other User", "other@example.com"));
+    
+    User *found = get_user_by_email("old@example.com");
+    TEST_ASSERT_NOT_NULL(found);
+    TEST_ASSERT_EQUAL_INT(id, found->id);
+    release_user(found);
+    TEST_ASSERT_NULL(get_user_by_email("missing@example.com"));
+    
+    // Taking another user's email is refused and leaves the record intact
+    TEST_ASSERT_NULL(update_user(id, NULL, "other@example.com"));
+    TEST_ASSERT_EQUAL_INT(USER_ERR_EMAIL_TAKEN, users_last_error());
+    found = get_user_by_id(id);
+    TEST_ASSERT_EQUAL_STRING("old@example.com", found->email);
+    release_user(found);
+    
+    user = update_user(id, NULL, "new@example.com");
+    TEST_ASSERT_NOT_NULL(user);
+    release_user(user);
+    TEST_ASSERT_NULL(get_user_by_email("old@example.com"));
+    found = get_user_by_email("new@example.com");
+    TEST_ASSERT_NOT_NULL(found);
+    TEST_ASSERT_EQUAL_INT(id, found->id);
+    release_user(found);
+    
+    TEST_ASSERT_EQUAL_INT(1, delete_user(id));
+    TEST_ASSERT_NULL(get_user_by_email("new@example.com"));
+}
+
+void test_references_should_survive_update_and_delete(void) {
+    User *user = create_user("Snapshot", "snapshot@example.com");
+    int id = user->id;
+    
+    // An update publishes a new version; the old reference is unchanged
+    User *updated = update_user(id, "Renamed", NULL);
+    TEST_ASSERT_NOT_NULL(updated);
+    TEST_ASSERT_EQUAL_STRING("Snapshot", user->name);
+    TEST_ASSERT_EQUAL_STRING("Renamed", updated->name);
+    
+    // Deleting while a reader holds the record must not free it underneath
+    TEST_ASSERT_EQUAL_INT(1, delete_user(id));
+    TEST_ASSERT_EQUAL_INT(id, updated->id);
+    TEST_ASSERT_EQUAL_STRING("Renamed", updated->name);
+    TEST_ASSERT_EQUAL_STRING("snapshot@example.com", updated->email);
+    TEST_ASSERT_NULL(get_user_by_id(id));
+    
+    release_user(user);
+    release_user(updated);
+}
+
+void test_record_memory_should_be_reused_after_churn(void) {
+    char name[50];
+    UserStoreStats before;
+    UserStoreStats after;
+    
+    seed_numbered_users(1, 1000);
+    get_user_store_stats(&before);
+    TEST_ASSERT_TRUE(before.bytes_live > 0);
+    TEST_ASSERT_TRUE(before.bytes_reserved >= before.bytes_live);
+    TEST_ASSERT_TRUE(before.fragmentation >= 0.0 && before.fragmentation < 1.0);
+    
+    // Rename everyone and replace half the users with similar-sized records
+    for (int i = 1; i <= 1000; i++) {
+        sprintf(name, "Name %d", i);
+        release_user(update_user(i, name, NULL));
+    }
+    for (int i = 1; i <= 1000; i += 2) {
+        TEST_ASSERT_EQUAL_INT(1, delete_user(i));
+    }
+    seed_numbered_users(1001, 1500);
+    get_user_store_stats(&after);
+    
+    // Freed blocks are recycled, so nothing new is reserved from the system
+    TEST_ASSERT_EQUAL_INT((int)before.bytes_reserved, (int)after.bytes_reserved);
+    TEST_ASSERT_TRUE(after.bytes_live > before.bytes_live);
+}
+
+void test_get_users_page_should_walk_store_in_id_order(void) {
+    User *page[64];
+    
+    seed_numbered_users(1, 500);
+    // Leave gaps, including a run long enough to sweep deleted ids
+    for (int i = 1; i <= 500; i++) {
+        if (i % 3 == 0 || (i > 100 && i <= 400)) delete_user(i);
+    }
+    
+    int after = 0;
+    int expected = 0;
+    int seen = 0;
+    int pages = 0;
+    do {
+        size_t count = get_users_page(after, 64, page, &after);
+        TEST_ASSERT_TRUE(count > 0 && count <= 64);
+        for (size_t i = 0; i < count; i++) {
+            do {
+                expected++;
+            } while (expected % 3 == 0 || (expected > 100 && expected <= 400));
+            TEST_ASSERT_EQUAL_INT(expected, page[i]->id);
+            release_user(page[i]);
+            seen++;
+        }
+        pages++;
+    } while (after != 0);
+    
+    int survivors = 0;
+    for (int i = 1; i <= 500; i++) {
+        if (!(i % 3 == 0 || (i > 100 && i <= 400))) survivors++;
+    }
+    TEST_ASSERT_EQUAL_INT(survivors, seen);
+    TEST_ASSERT_EQUAL_INT((survivors + 63) / 64, pages);
+    
+    // A cursor pointing at a deleted id resumes at the next live one
+    int next;
+    TEST_ASSERT_EQUAL_INT(1, (int)get_users_page(150, 1, page, &next));
+    TEST_ASSERT_EQUAL_INT(401, page[0]->id);
+    TEST_ASSERT_EQUAL_INT(401, next);
+    release_user(page[0]);
+    TEST_ASSERT_EQUAL_INT(0, (int)get_users_page(500, 10, page, &next));
+    TEST_ASSERT_EQUAL_INT(0, next);
+}
+
+void test_apply_user_batch_should_apply_ops_in_order(void) {
+    enum { CREATES = 600 };
+    static char names[CREATES][32];
+    static char emails[CREATES][48];
+    UserOp ops[CREATES + 4];
+    memset(ops, 0, sizeof(ops));
+    
+    // More ops than one locked slice holds
+    for (int i = 0; i < CREATES; i++) {
+        sprintf(names[i], "Batch %d", i);
+        sprintf(emails[i], "batch%d@example.com", i);
+        ops[i].type = USER_OP_CREATE;
+        ops[i].name = names[i];
+        ops[i].email = emails[i];
+    }
+    ops[CREATES].type = USER_OP_UPDATE;
+    ops[CREATES].id = 1;
+    ops[CREATES].email = "batch599@example.com";
+    ops[CREATES + 1].type = USER_OP_UPDATE;
+    ops[CREATES + 1].id = 1;
+    ops[CREATES + 1].name = "First";
+    ops[CREATES + 2].type = USER_OP_DELETE;
+    ops[CREATES + 2].id = 2;
+    ops[CREATES + 3].type = USER_OP_DELETE;
+    ops[CREATES + 3].id = 2;
+    
+    TEST_ASSERT_EQUAL_INT(CREATES + 2, (int)apply_user_batch(ops, CREATES + 4));
+    TEST_ASSERT_EQUAL_INT(USER_OK, ops[CREATES - 1].error);
+    TEST_ASSERT_EQUAL_INT(CREATES, ops[CREATES - 1].user->id);
+    TEST_ASSERT_EQUAL_INT(USER_ERR_EMAIL_TAKEN, ops[CREATES].error);
+    TEST_ASSERT_NULL(ops[CREATES].user);
+    TEST_ASSERT_EQUAL_STRING("First", ops[CREATES + 1].user->name);
+    TEST_ASSERT_EQUAL_INT(USER_OK, ops[CREATES + 2].error);
+    TEST_ASSERT_EQUAL_INT(USER_ERR_NOT_FOUND, ops[CREATES + 3].error);
+    for (int i = 0; i < CREATES + 4; i++) {
+        release_user(ops[i].user);
+    }
+    
+    UserStoreStats stats;
+    get_user_store_stats(&stats);
+    TEST_ASSERT_EQUAL_INT(CREATES - 1, (int)stats.user_count);
+    User *first = get_user_by_email("batch0@example.com");
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_EQUAL_STRING("First", first->name);
+    release_user(first);
+    TEST_ASSERT_NULL(get_user_by_id(2));
+}
+
+void test_apply_user_batch_should_put_users_under_their_ids(void) {
+    UserOp ops[5];
+    memset(ops, 0, sizeof(ops));
+    ops[0].type = USER_OP_PUT;
+    ops[0].id = 10;
+    ops[0].name = "Ten";
+    ops[0].email = "ten@example.com";
+    ops[1].type = USER_OP_PUT;
+    ops[1].id = 10;
+    ops[1].name = "Still ten";
+    ops[1].email = "ten@example.com";
+    ops[2].type = USER_OP_CREATE;
+    ops[2].name = "Next";
+    ops[2].email = "next@example.com";
+    ops[3].type = USER_OP_PUT;
+    ops[3].id = 5;
+    ops[3].name = "No email";
+    ops[4].type = USER_OP_PUT;
+    ops[4].id = 5;
+    ops[4].name = "Taken";
+    ops[4].email = "next@example.com";
+    
+    TEST_ASSERT_EQUAL_INT(3, (int)apply_user_batch(ops, 5));
+    TEST_ASSERT_EQUAL_INT(10, ops[0].user->id);
+    TEST_ASSERT_EQUAL_STRING("Still ten", ops[1].user->name);
+    // Creates carry on after the highest id put so far
+    TEST_ASSERT_EQUAL_INT(11, ops[2].user->id);
+    TEST_ASSERT_EQUAL_INT(USER_ERR_INVALID, ops[3].error);
+    TEST_ASSERT_EQUAL_INT(USER_ERR_EMAIL_TAKEN, ops[4].error);
+    for (int i = 0; i < 5; i++) {
+        release_user(ops[i].user);
+    }
+    
+    UserStoreStats stats;
+    get_user_store_stats(&stats);
+    TEST_ASSERT_EQUAL_INT(2, (int)stats.user_count);
+    TEST_ASSERT_NULL(get_user_by_id(5));
+}
+
+void test_apply_user_batch_should_refuse_ids_past_int_max(void) {
+    UserOp ops[3];
+    memset(ops, 0, sizeof(ops));
+    ops[0].type = USER_OP_PUT;
+    ops[0].id = INT_MAX;
+    ops[0].name = "Last";
+    ops[0].email = "last@example.com";
+    ops[1].type = USER_OP_PUT;
+    ops[1].id = INT_MAX - 1;
+    ops[1].name = "Almost last";
+    ops[1].email = "almost@example.com";
+    ops[2].type = USER_OP_CREATE;
+    ops[2].name = "After";
+    ops[2].email = "after@example.com";
+    
+    // INT_MAX itself would leave no id for the next create
+    TEST_ASSERT_EQUAL_INT(1, (int)apply_user_batch(ops, 3));
+    TEST_ASSERT_EQUAL_INT(USER_ERR_INVALID, ops[0].error);
+    TEST_ASSERT_EQUAL_INT(INT_MAX - 1, ops[1].user->id);
+    TEST_ASSERT_EQUAL_INT(USER_ERR_INVALID, ops[2].error);
+    release_user(ops[1].user);
+    
+    // Creates fail instead of wrapping to a negative id
+    TEST_ASSERT_NULL(create_user("After", "after@example.com"));
+    TEST_ASSERT_EQUAL_INT(USER_ERR_INVALID, users_last_error());
+    UserStoreStats stats;
+    get_user_store_stats(&stats);
+    TEST_ASSERT_EQUAL_INT(1, (int)stats.user_count);
+}
+
+void test_get_users_page_should_walk_past_an_id_put_back_and_deleted_again(void) {
+    User *page[64];
+    UserOp op;
+    
+    seed_numbered_users(1, 2000);
+    TEST_ASSERT_TRUE(delete_user(17));
+    memset(&op, 0, sizeof(op));
+    op.type = USER_OP_PUT;
+    op.id = 17;
+    op.name = "Back again";
+    op.email = "back@example.com";
+    TEST_ASSERT_EQUAL_INT(1, (int)apply_user_batch(&op, 1));
+    release_user(op.user);
+    TEST_ASSERT_TRUE(delete_user(17));
+    
+    // Every other user comes back exactly once, in id order
+    int after = 16;
+    int seen = 0;
+    int last = 16;
+    do {
+        size_t count = get_users_page(after, 64, page, &after);
+        for (size_t i = 0; i < count; i++) {
+            TEST_ASSERT_TRUE(page[i]->id > last);
+            TEST_ASSERT_TRUE(page[i]->id != 17);
+            last = page[i]->id;
+            seen++;
+            release_user(page[i]);
+        }
+    } while (after);
+    TEST_ASSERT_EQUAL_INT(2000 - 17, seen);
+}
+
+void test_user_fragment_should_be_attached_once_per_record(void) {
+    User *user = create_user("Alice", "alice@example.com");
+    TEST_ASSERT_NULL((void*)user_fragment(user));
+    
+    UserFragment *first = user_fragment_alloc(5);
+    memcpy(first->json, "first", 5);
+    TEST_ASSERT_TRUE(user_attach_fragment(user, first) == first);
+    
+    // A second attach loses to the first and is freed
+    UserFragment *second = user_fragment_alloc(6);
+    memcpy(second->json, "second", 6);
+    const UserFragment *attached = user_attach_fragment(user, second);
+    TEST_ASSERT_TRUE(attached == first);
+    TEST_ASSERT_EQUAL_INT(5, (int)attached->len);
+    
+    // The record stays as it was; the update publishes one without a fragment
+    User *updated = update_user(user->id, "Alicia", NULL);
+    TEST_ASSERT_TRUE(user_fragment(user) == first);
+    TEST_ASSERT_NULL((void*)user_fragment(updated));
+    release_user(updated);
+    release_user(user);
+}
+
+#define TEST_WAL_PATH "test_users.wal"
+
+// Restarts the store from the log alone and returns the records replayed
+static long reopen_user_log(void) {
+    close_user_log();
+    cleanup_users();
+    init_users();
+    return open_user_log(TEST_WAL_PATH, 5);
+}
+
+void test_user_log_should_restore_store_after_restart(void) {
+    remove(TEST_WAL_PATH);
+    TEST_ASSERT_EQUAL_INT(0, (int)open_user_log(TEST_WAL_PATH, 5));
+    
+    release_user(create_user("Alice", "alice@example.com"));
+    release_user(create_user("Bob", "bob@example.com"));
+    release_user(create_user("Carol", "carol@example.com"));
+    release_user(update_user(2, "Robert", "robert@example.com"));
+    TEST_ASSERT_TRUE(delete_user(1));
+    // The freed email can be taken again, and replay must agree
+    release_user(create_user("Alicia", "alice@example.com"));
+    TEST_ASSERT_TRUE(sync_user_log());
+    
+    TEST_ASSERT_EQUAL_INT(6, (int)reopen_user_log());
+    TEST_ASSERT_NULL(get_user_by_id(1));
+    User *bob = get_user_by_id(2);
+    TEST_ASSERT_NOT_NULL(bob);
+    TEST_ASSERT_EQUAL_STRING("Robert", bob->name);
+    TEST_ASSERT_EQUAL_STRING("robert@example.com", bob->email);
+    release_user(bob);
+    User *alicia = get_user_by_email("alice@example.com");
+    TEST_ASSERT_NOT_NULL(alicia);
+    TEST_ASSERT_EQUAL_INT(4, alicia->id);
+    release_user(alicia);
+    TEST_ASSERT_NULL(get_user_by_email("bob@example.com"));
+    
+    // New ids continue after the highest one ever logged
+    User *next = create_user("Dave", "dave@example.com");
+    TEST_ASSERT_EQUAL_INT(5, next->id);
+    release_user(next);
+    TEST_ASSERT_EQUAL_INT(7, (int)reopen_user_log());
+    
+    close_user_log();
+    remove(TEST_WAL_PATH);
+}
+
+void test_user_log_should_drop_torn_tail(void) {
+    remove(TEST_WAL_PATH);
+    TEST_ASSERT_EQUAL_INT(0, (int)open_user_log(TEST_WAL_PATH, 5));
+    release_user(create_user("Alice", "alice@example.com"));
+    release_user(create_user("Bob", "bob@example.com"));
+    close_user_log();
+    
+    // A crash halfway through the next frame leaves a partial header and body
+    FILE *f = fopen(TEST_WAL_PATH, "ab");
+    TEST_ASSERT_NOT_NULL(f);
+    fwrite("\x20\x00\x00\x00\xde\xad\xbe\xefP\x03", 1, 10, f);
+    fclose(f);
+    
+    TEST_ASSERT_EQUAL_INT(2, (int)reopen_user_log());
+    release_user(create_user("Carol", "carol@example.com"));
+    TEST_ASSERT_EQUAL_INT(3, (int)reopen_user_log());
+    User *carol = get_user_by_id(3);
+    TEST_ASSERT_NOT_NULL(carol);
+    TEST_ASSERT_EQUAL_STRING("carol@example.com", carol->email);
+    release_user(carol);
+    
+    close_user_log();
+    remove(TEST_WAL_PATH);
+}
+
+void test_user_log_should_replay_concurrent_writes(void) {
+    enum { THREADS = 4, ITERATIONS = 5000 };
+    thread_t handles[THREADS];
+    StressWorker workers[THREADS];
+    
+    remove(TEST_WAL_PATH);
+    TEST_ASSERT_EQUAL_INT(0, (int)open_user_log(TEST_WAL_PATH, 5));
+    for (int i = 0; i < THREADS; i++) {
+        workers[i].thread_index = i;
+        workers[i].iterations = ITERATIONS;
+        workers[i].ops = 0;
+        workers[i].failures = 0;
+        thread_start(&handles[i], &workers[i]);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        thread_join(handles[i]);
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+    TEST_ASSERT_TRUE(sync_user_log());
+    
+    cJSON *live = get_all_users();
+    char *expected = cJSON_PrintUnformatted(live);
+    cJSON_Delete(live);
+    // Each iteration creates and renames a user; every other one deletes it
+    long writes = THREADS * (ITERATIONS * 2 + ITERATIONS / 2);
+    TEST_ASSERT_EQUAL_INT((int)writes, (int)reopen_user_log());
+    cJSON *replayed = get_all_users();
+    char *actual = cJSON_PrintUnformatted(replayed);
+    cJSON_Delete(replayed);
+    TEST_ASSERT_EQUAL_STRING(expected, actual);
+    
+    free(expected);
+    free(actual);
+    close_user_log();
+    remove(TEST_WAL_PATH);
+}
+
+#define TEST_SNAPSHOT_PATH "test_users.snap"
+
+// Restarts the store from the snapshot plus the log written after it
+static long restart_from_snapshot(long *replayed) {
+    close_user_log();
+    cleanup_users();
+    init_users();
+    long loaded = load_user_snapshot(TEST_SNAPSHOT_PATH);
+    *replayed = open_user_log(TEST_WAL_PATH, 5);
+    return loaded;
+}
+
+static char* store_as_json(void) {
+    cJSON *users = get_all_users();
+    char *text = cJSON_PrintUnformatted(users);
+    cJSON_Delete(users);
+    return text;
+}
+
+void test_user_snapshot_should_restore_store_with_later_log_writes(void) {
+    long replayed = -1;
+    remove(TEST_WAL_PATH);
+    remove(TEST_SNAPSHOT_PATH);
+    TEST_ASSERT_EQUAL_INT(0, (int)open_user_log(TEST_WAL_PATH, 5));
+    release_user(create_user("Alice", "alice@example.com"));
+    release_user(create_user("Bob", "bob@example.com"));
+    release_user(create_user("Carol", "carol@example.com"));
+    release_user(update_user(2, "Robert", "robert@example.com"));
+    TEST_ASSERT_TRUE(start_user_snapshot(TEST_SNAPSHOT_PATH));
+    TEST_ASSERT_TRUE(wait_user_snapshot());
+    
+    // Only these reach the store through the log on restart
+    release_user(create_user("Dave", "dave@example.com"));
+    release_user(update_user(1, "Alicia", NULL));
+    TEST_ASSERT_TRUE(delete_user(3));
+    char *expected = store_as_json();
+    
+    TEST_ASSERT_EQUAL_INT(3, (int)restart_from_snapshot(&replayed));
+    TEST_ASSERT_EQUAL_INT(3, (int)replayed);
+    char *actual = store_as_json();
+    TEST_ASSERT_EQUAL_STRING(expected, actual);
+    free(expected);
+    free(actual);
+    
+    // Snapshot records are copied on write; old references stay readable
+    User *robert = get_user_by_id(2);
+    TEST_ASSERT_NOT_NULL(robert);
+    User *bob = update_user(2, "Bob", "bob@example.com");
+    TEST_ASSERT_NOT_NULL(bob);
+    TEST_ASSERT_EQUAL_STRING("Robert", robert->name);
+    TEST_ASSERT_EQUAL_STRING("bob@example.com", bob->email);
+    TEST_ASSERT_NULL(get_user_by_email("robert@example.com"));
+    release_user(robert);
+    release_user(bob);
+    User *next = create_user("Erin", "erin@example.com");
+    TEST_ASSERT_EQUAL_INT(5, next->id);
+    release_user(next);
+    
+    // A second snapshot replaces the mapped one and covers the whole log
+    TEST_ASSERT_TRUE(start_user_snapshot(TEST_SNAPSHOT_PATH));
+    TEST_ASSERT_TRUE(wait_user_snapshot());
+    expected = store_as_json();
+    TEST_ASSERT_EQUAL_INT(4, (int)restart_from_snapshot(&replayed));
+    TEST_ASSERT_EQUAL_INT(0, (int)replayed);
+    actual = store_as_json();
+    TEST_ASSERT_EQUAL_STRING(expected, actual);
+    free(expected);
+    free(actual);
+    
+    close_user_log();
+    remove(TEST_WAL_PATH);
+    remove(TEST_SNAPSHOT_PATH);
+}
+
+void test_user_snapshot_should_reject_damaged_file(void) {
+    remove(TEST_SNAPSHOT_PATH);
+    TEST_ASSERT_EQUAL_INT(-1, (int)load_user_snapshot(TEST_SNAPSHOT_PATH));
+    release_user(create_user("Alice", "alice@example.com"));
+    TEST_ASSERT_TRUE(start_user_snapshot(TEST_SNAPSHOT_PATH));
+    TEST_ASSERT_TRUE(wait_user_snapshot());
+    // Only an empty store can be loaded into
+    TEST_ASSERT_EQUAL_INT(-1, (int)load_user_snapshot(TEST_SNAPSHOT_PATH));
+    
+    // Cut the string heap short, as a copy interrupted midway would
+    FILE *f = fopen(TEST_SNAPSHOT_PATH, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    char image[256];
+    size_t size = fread(image, 1, sizeof(image), f);
+    fclose(f);
+    f = fopen(TEST_SNAPSHOT_PATH, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    fwrite(image, 1, size - 4, f);
+    fclose(f);
+    
+    cleanup_users();
+    init_users();
+    TEST_ASSERT_EQUAL_INT(-1, (int)load_user_snapshot(TEST_SNAPSHOT_PATH));
+    TEST_ASSERT_NULL(get_user_by_id(1));
+    remove(TEST_SNAPSHOT_PATH);
+}
+
+void test_user_snapshot_should_rotate_log_past_what_it_covers(void) {
+    long replayed = -1;
+    remove(TEST_WAL_PATH);
+    remove(TEST_SNAPSHOT_PATH);
+    TEST_ASSERT_EQUAL_INT(0, (int)open_user_log(TEST_WAL_PATH, 5));
+    seed_numbered_users(1, 100);
+    TEST_ASSERT_TRUE(start_user_snapshot(TEST_SNAPSHOT_PATH));
+    TEST_ASSERT_TRUE(wait_user_snapshot());
+    
+    // Only the segment frame is left, and later writes go after it
+    FILE *f = fopen(TEST_WAL_PATH, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    fseek(f, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(24, (int)ftell(f));
+    fclose(f);
+    TEST_ASSERT_TRUE(delete_user(7));
+    release_user(create_user("After", "after@example.com"));
+    char *expected = store_as_json();
+    TEST_ASSERT_EQUAL_INT(100, (int)restart_from_snapshot(&replayed));
+    TEST_ASSERT_EQUAL_INT(2, (int)replayed);
+    char *actual = store_as_json();
+    TEST_ASSERT_EQUAL_STRING(expected, actual);
+    free(actual);
+    
+    // Rotating again keeps positions counting from the first log
+    TEST_ASSERT_TRUE(start_user_snapshot(TEST_SNAPSHOT_PATH));
+    TEST_ASSERT_TRUE(wait_user_snapshot());
+    release_user(update_user(1, "Renamed", NULL));
+    free(expected);
+    expected = store_as_json();
+    TEST_ASSERT_EQUAL_INT(100, (int)restart_from_snapshot(&replayed));
+    TEST_ASSERT_EQUAL_INT(1, (int)replayed);
+    actual = store_as_json();
+    TEST_ASSERT_EQUAL_STRING(expected, actual);
+    free(expected);
+    free(actual);
+    
+    // Without its snapshot the rotated log is refused rather than half-replayed
+    close_user_log();
+    cleanup_users();
+    init_users();
+    TEST_ASSERT_EQUAL_INT(-1, (int)open_user_log(TEST_WAL_PATH, 5));
+    TEST_ASSERT_NULL(get_user_by_id(1));
+    remove(TEST_WAL_PATH);
+    remove(TEST_SNAPSHOT_PATH);
+}
+
+void test_user_snapshot_cold_start_benchmark(void) {
+    enum { USERS = 1000000 };
+    struct timespec start;
+    
+    remove(TEST_WAL_PATH);
+    remove(TEST_SNAPSHOT_PATH);
+    TEST_ASSERT_EQUAL_INT(0, (int)open_user_log(TEST_WAL_PATH, 5));
+    timespec_get(&start, TIME_UTC);
+    seed_numbered_users(1, USERS);
+    TEST_ASSERT_TRUE(sync_user_log());
+    double create_seconds = elapsed_seconds(&start);
+    
+    // The whole log is replayed before a snapshot rotates it away
+    close_user_log();
+    cleanup_users();
+    init_users();
+    timespec_get(&start, TIME_UTC);
+    TEST_ASSERT_EQUAL_INT(USERS, (int)open_user_log(TEST_WAL_PATH, 5));
+    double replay_seconds = elapsed_seconds(&start);
+    
+    timespec_get(&start, TIME_UTC);
+    TEST_ASSERT_TRUE(start_user_snapshot(TEST_SNAPSHOT_PATH));
+    TEST_ASSERT_TRUE(wait_user_snapshot());
+    double write_seconds = elapsed_seconds(&start);
+    
+    // Only the loading is timed, not tearing down the store before it
+    close_user_log();
+    cleanup_users();
+    init_users();
+    timespec_get(&start, TIME_UTC);
+    TEST_ASSERT_EQUAL_INT(USERS, (int)load_user_snapshot(TEST_SNAPSHOT_PATH));
+    TEST_ASSERT_EQUAL_INT(0, (int)open_user_log(TEST_WAL_PATH, 5));
+    double snapshot_seconds = elapsed_seconds(&start);
+    UserStoreStats stats;
+    get_user_store_stats(&stats);
+    TEST_ASSERT_EQUAL_INT(USERS, (int)stats.user_count);
+    User *last = get_user_by_email("user1000000@example.com");
+    TEST_ASSERT_NOT_NULL(last);
+    TEST_ASSERT_EQUAL_INT(USERS, last->id);
+    release_user(last);
+    
+    printf("  %d users: created in %.0f ms, snapshot written in %.0f ms\n",
+           USERS, create_seconds * 1000, write_seconds * 1000);
+    printf("  cold start: %.0f ms from the mapped snapshot, %.0f ms replaying the log\n",
+           snapshot_seconds * 1000, replay_seconds * 1000);
+    
+    close_user_log();
+    remove(TEST_WAL_PATH);
+    remove(TEST_SNAPSHOT_PATH);
+}
+
 int main(void) {
     UnityBegin();
     
@@ -250,6 +1072,31 @@ int main(void) {
     RUN_TEST(test_user_to_json_should_handle_null);
     RUN_TEST(test_seed_users_should_create_three_users);
     RUN_TEST(test_concurrent_operations_should_maintain_consistency);
+    RUN_TEST(test_concurrent_operations_should_maintain_consistency_across_threads);
+    RUN_TEST(test_get_user_by_id_should_find_users_across_index_resizes);
+    RUN_TEST(test_id_lookup_cost_should_stay_flat_as_store_grows);
+    RUN_TEST(test_create_user_should_reject_duplicate_email);
+    RUN_TEST(test_get_user_by_email_should_follow_updates);
+    RUN_TEST(test_references_should_survive_update_and_delete);
+    RUN_TEST(test_record_memory_should_be_reused_after_churn);
+    RUN_TEST(test_get_users_page_should_walk_store_in_id_order);
+    RUN_TEST(test_apply_user_batch_should_apply_ops_in_order);
+    RUN_TEST(test_apply_user_batch_should_put_users_under_their_ids);
+    RUN_TEST(test_apply_user_batch_should_refuse_ids_past_int_max);
+    RUN_TEST(test_get_users_page_should_walk_past_an_id_put_back_and_deleted_again);
+    RUN_TEST(test_user_fragment_should_be_attached_once_per_record);
+    RUN_TEST(test_user_log_should_restore_store_after_restart);
+    RUN_TEST(test_user_log_should_drop_torn_tail);
+    RUN_TEST(test_user_log_should_replay_concurrent_writes);
+    RUN_TEST(test_user_snapshot_should_restore_store_with_later_log_writes);
+    RUN_TEST(test_user_snapshot_should_reject_damaged_file);
+    RUN_TEST(test_user_snapshot_should_rotate_log_past_what_it_covers);
+    
+    // Timing runs: slow, and only their printed numbers matter
+    if (getenv("RUN_BENCHMARKS")) {
+        RUN_TEST(test_concurrent_operations_benchmark);
+        RUN_TEST(test_user_snapshot_cold_start_benchmark);
+    }
     
     return UnityEnd();
 }
\ No newline at end of file
@@ -120,8 +120,19 @@ static void UnityAssertTrue(int condition, const char* msg, int line) {
     }
 }
 
+// Provided by each test file, run around every test like upstream Unity
+void setUp(void);
+void tearDown(void);
+
 // Macros
-#define RUN_TEST(func) UnityDefaultTestRun(func, #func, __LINE__)
+#define UNITY_BEGIN() UnityBegin()
+#define UNITY_END() UnityEnd()
+
+#define RUN_TEST(func) do { \
+        setUp(); \
+        UnityDefaultTestRun(func, #func, __LINE__); \
+        tearDown(); \
+    } while (0)
 
 #define TEST_ASSERT_EQUAL_INT(expected, actual) \
     UnityAssertEqualNumber((expected), (actual), NULL, __LINE__)
@@ -135,6 +146,9 @@ static void UnityAssertTrue(int condition, const char* msg, int line) {
 #define TEST_ASSERT_EQUAL_STRING_MESSAGE(expected, actual, message) \
     UnityAssertEqualString((expected), (actual), (message), __LINE__)
 
+#define TEST_ASSERT_NOT_EQUAL(expected, actual) \
+    UnityAssertTrue((expected) != (actual), "Expected Not Equal", __LINE__)
+
 #define TEST_ASSERT_NULL(pointer) \
     UnityAssertNull((pointer), NULL, __LINE__)
 